@@ -0,0 +1,42 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ */
+
+#ifndef _AES_H_
+#define _AES_H_
+
+#include <stdint.h>
+
+#define AES_BLOCK_SIZE		16
+#define AES_KEY_SIZE		16
+
+/*
+ * AES-128 encryption, shared by bootloader and host tool.
+ * On the device blocks are encrypted by the CRYPTO engine.
+ */
+struct aes_ctx {
+	uint8_t key[AES_KEY_SIZE];
+	/* round keys of software cipher */
+	uint8_t rk[11 * AES_BLOCK_SIZE];
+};
+
+void aes_init(struct aes_ctx *ctx, const uint8_t *key);
+
+/*
+ * \brief encrypt one block
+ */
+void aes_encrypt(const struct aes_ctx *ctx, uint8_t *out, const uint8_t *in);
+
+/*
+ * \brief XOR data in place with CTR keystream at byte offset ofs,
+ *        counter block is iv with ofs / 16 added to its last 32 bits
+ *        (big endian), so any part of stream is processed alone.
+ */
+void aes_ctr(const struct aes_ctx *ctx, const uint8_t *iv, uint32_t ofs,
+	     uint8_t *data, uint32_t len);
+
+#endif
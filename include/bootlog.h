@@ -0,0 +1,96 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ */
+
+#ifndef _BOOTLOG_H_
+#define _BOOTLOG_H_
+
+#include <stdint.h>
+
+#include "btlproto.h"
+
+/* USER_DATA page, out of application and bootloader areas */
+#define BOOTLOG_ADDR		0x0fe00000
+/* last page of main flash, out of application and its copy */
+#define BOOTLOG_SPARE_ADDR	0x0007f800
+#define BOOTLOG_SIZE		2048
+#define BOOTLOG_PAGES		2
+
+#define BOOTLOG_MAGIC		0x474f4c42
+
+/* pages of application area, pages of its copy follow them in map */
+#define BOOTLOG_AREA_PAGES	(BTL_APP_SIZE / BTL_FLASH_PAGE_SIZE)
+#define BOOTLOG_MAP_WORDS	(2 * BOOTLOG_AREA_PAGES / 32)
+
+/*
+ * Boot state record, records are appended to one page and the other
+ * page is erased only when it is full, so every record slot is
+ * programmed once per erase cycle. The full page keeps the latest
+ * state until the next record is programmed, power loss while the
+ * other page is erased does not lose it.
+ */
+struct bootlog_rec {
+	uint32_t magic;
+	uint32_t seq;
+	/* pending request, BTL_FLASH_APP or 0 */
+	uint32_t target;
+	/* bytes of application already installed */
+	uint32_t progress;
+	/* CRC-32 of the last validated application */
+	uint32_t digest;
+	/* pages changed and not signed since, BTL_SIGN build */
+	uint32_t dirty[BOOTLOG_MAP_WORDS];
+	uint32_t reserved[2];
+	/* CRC-32 of record above */
+	uint32_t crc;
+} __attribute__((__packed__));
+
+#define BOOTLOG_RECS		(BOOTLOG_SIZE / sizeof(struct bootlog_rec))
+
+/*
+ * \brief find the latest valid record of both pages and the first
+ *        free slot of its page
+ */
+void bootlog_init(void);
+
+/*
+ * \brief the latest record, cached in RAM
+ */
+const struct bootlog_rec *bootlog_get(void);
+
+/*
+ * \brief append record with new state
+ * \return 0 or -1 on flash error
+ */
+int bootlog_put(uint32_t target, uint32_t progress, uint32_t digest);
+
+/*
+ * \brief pages of application or its copy touched by range are changed,
+ *        record is appended only if some page was not changed yet
+ * \return 0 or -1 on flash error
+ */
+int bootlog_change(uint32_t addr, uint32_t size);
+
+/*
+ * \brief pages of application or its copy inside range are signed
+ * \return 0 or -1 on flash error
+ */
+int bootlog_sign(uint32_t addr, uint32_t size);
+
+/*
+ * \brief application is installed from its copy and takes its pages state
+ * \return 0 or -1 on flash error
+ */
+int bootlog_install(uint32_t digest);
+
+/*
+ * \return 1 if area at addr, BTL_APP_ADDR or BTL_FLASH_APP_ADDR,
+ *         has no changed page that is not signed
+ */
+int bootlog_signed(uint32_t addr);
+
+#endif
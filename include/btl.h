@@ -12,17 +12,180 @@
 #include <stdint.h>
 
 #include "btlproto.h"
+#include "btlcodec.h"
+#ifdef BTL_SIGN
+#include "sha256.h"
+#endif
 
 typedef struct btl_if_s {
+	int port;
 	int reset;
 	unsigned int baud;
+	/* packet of request and its reply */
 	uint8_t buf[BTL_MAX_PKT_SIZE];
-	unsigned int len;
+	struct btl_decoder dec;
+	/* SWRITE receive window */
+	struct {
+		int active;
+		/* first missing sequence number */
+		uint8_t base;
+		/* next to highest received */
+		uint8_t next;
+		/* bit n is set if base + n is received */
+		uint32_t rcvd;
+	} sr;
+	/* write session digest of COMMIT */
+	struct {
+		int open;
+		uint32_t start;
+		uint32_t end;
+		/* digest is computed up to addr */
+		uint32_t addr;
+		/* pages below limit are written */
+		uint32_t limit;
+		uint32_t crc;
+		uint32_t bad;
+#ifdef BTL_SIGN
+		struct sha256_ctx sha;
+#endif
+	} cm;
+#ifdef BTL_ENCRYPT
+	/* CRYPT write mode */
+	struct {
+		int active;
+		uint8_t iv[BTL_CRYPT_IV_SIZE];
+	} ec;
+#endif
+#ifdef BTL_SIGN
+	/* SIGN of COMMIT range */
+	struct {
+		int valid;
+		uint32_t addr;
+		uint8_t sig[BTL_SIGN_SIZE];
+	} sg;
+#endif
+	/* address header of bus packet */
+	uint8_t ahdr[BTL_ADDR_HDR_SIZE];
+	unsigned int alen;
+	int to;
+#ifdef BTL_BUS
+	/* write bitmap of broadcast session */
+	struct {
+		int open;
+		uint32_t start;
+		uint32_t end;
+		uint8_t map[BTL_BITMAP_SIZE];
+	} bm;
+#endif
+	/* background ERASE */
+	struct {
+		int active;
+		/* range of request, repeated request is not an error */
+		uint32_t start;
+		uint32_t addr;
+		uint32_t end;
+		/* PROGRESS frame every step pages */
+		uint32_t step;
+		uint32_t count;
+		/* PROGRESS frame is due */
+		int report;
+		int err;
+	} er;
+	/* BRIDGE to downstream port */
+	struct {
+		/* requested, applied after reply is sent */
+		int req;
+		int mode;
+		uint32_t baud;
+		/* FORWARD frames are passed */
+		int fwd;
+	} br;
+	/* SREAD stream */
+	struct {
+		int active;
+		uint8_t id;
+		uint32_t addr;
+		uint32_t end;
+		uint32_t credit;
+	} rd;
+	struct {
+		uint32_t frames;
+		uint32_t crc_err;
+		uint32_t size_err;
+		uint32_t timeout;
+	} stats;
 } btl_if_t;
 
+/* destination of packet */
+#define BTL_TO_NONE		0
+#define BTL_TO_ME		1
+#define BTL_TO_ALL		2
+#define BTL_TO_OTHER		3
+
 int btl_handle_packet(btl_if_t *bi);
 
-int btl_read_byte(btl_if_t *bi, char c);
+/*
+ * \brief drop received bytes of incomplete packet
+ */
+static inline void btl_reset(btl_if_t *bi)
+{
+	btl_decoder_reset(&bi->dec);
+	bi->alen = 0;
+}
+
+/*
+ * \brief drop handled frame, bytes received after it are kept
+ */
+static inline void btl_next(btl_if_t *bi)
+{
+	btl_decode_skip(&bi->dec);
+	bi->alen = 0;
+}
+
+/*
+ * \brief bytes left to be parsed after resync or handled frame
+ */
+static inline int btl_pending(btl_if_t *bi)
+{
+	return bi->dec.pos < bi->dec.len;
+}
+
+/*
+ * \brief parse received byte \c, buffered bytes only if \c is negative
+ * \return BTL_DEC_FRAME with packet in buffer, BTL_DEC_MORE or error
+ *         of dropped frame
+ */
+int btl_read_byte(btl_if_t *bi, int c);
+
+/*
+ * \brief build NACK frame in packet buffer if SWRITE sequence is active
+ * \return frame size or 0
+ */
+int btl_nack(btl_if_t *bi);
+
+/*
+ * \brief build next DATA frame of SREAD stream in \buf
+ * \return frame size or 0 if stream is stopped or out of credit
+ */
+int btl_data_frame(btl_if_t *bi, uint8_t *buf);
+
+/*
+ * \brief build PROGRESS frame of background erase in \buf
+ * \return frame size or 0 if no report is due
+ */
+int btl_progress_frame(btl_if_t *bi, uint8_t *buf);
+
+/*
+ * \brief build FORWARD frame in \buf of data received on downstream
+ *        port of frame bridge
+ * \return frame size or 0 if bridge is closed or no data
+ */
+int btl_forward_frame(btl_if_t *bi, uint8_t *buf);
+
+/*
+ * \brief background work while the line is idle
+ */
+void btl_idle(btl_if_t *bi);
 
 
 #endif
@@ -0,0 +1,109 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Frame codec shared by bootloader and console tool
+ */
+
+#ifndef _BTLCODEC_H_
+#define _BTLCODEC_H_
+
+#include <stdint.h>
+
+#include "btlproto.h"
+
+/* decoder events */
+#define BTL_DEC_MORE		0
+#define BTL_DEC_FRAME		1
+/* size field over BTL_MAX_DATA_SIZE */
+#define BTL_DEC_ESIZE		(-1)
+/* complete frame with invalid CRC */
+#define BTL_DEC_ECRC		(-2)
+
+/*
+ * Incremental frame decoder, bytes are buffered from prefix on.
+ * On invalid size or CRC the prefix was false or the frame is damaged,
+ * scan is restarted from the next prefix in buffered bytes, so a frame
+ * swallowed by a false header is still found.
+ */
+struct btl_decoder {
+	uint8_t buf[BTL_MAX_PKT_SIZE];
+	/* bytes buffered */
+	unsigned int len;
+	/* bytes checked, crc of checked bytes after size field */
+	unsigned int pos;
+	uint8_t crc;
+	/* frame at start of buffer was returned, dropped by next call */
+	int done;
+};
+
+#define btl_decoder_pkt(dec)	((btl_packet_t *)(dec)->buf)
+
+/*
+ * \brief CRC-8 of protocol, polynomial BTL_CRC_POLY
+ */
+uint8_t btl_crc8(const void *data, unsigned int len);
+
+/*
+ * \brief build frame in \buf, \data may point to data field of \buf
+ * \return frame size or -1 if data does not fit
+ */
+int btl_encode(void *buf, uint8_t cmd, uint8_t status, uint32_t addr,
+		const void *data, unsigned int len);
+
+/*
+ * \brief build address header for device \eui in \buf
+ * \return header size
+ */
+int btl_encode_addr(void *buf, const uint8_t *eui);
+
+/*
+ * \brief check CRC of received address header
+ * \return 1 if valid
+ */
+int btl_addr_valid(const void *buf);
+
+static inline void btl_decoder_reset(struct btl_decoder *dec)
+{
+	dec->len = 0;
+	dec->pos = 0;
+	dec->crc = 0;
+	dec->done = 0;
+}
+
+/*
+ * \brief append byte to decoder, call btl_decode() to get events
+ */
+void btl_decode_put(struct btl_decoder *dec, uint8_t c);
+
+/*
+ * \brief parse buffered bytes up to the next event
+ * \return BTL_DEC_FRAME with frame at btl_decoder_pkt(),
+ *         BTL_DEC_ESIZE or BTL_DEC_ECRC with bytes left to be parsed
+ *         by next call, BTL_DEC_MORE if all buffered bytes are parsed
+ */
+int btl_decode(struct btl_decoder *dec);
+
+static inline int btl_decode_byte(struct btl_decoder *dec, uint8_t c)
+{
+	btl_decode_put(dec, c);
+	return btl_decode(dec);
+}
+
+/*
+ * \brief parse \len bytes of \data up to the next event,
+ *        noise in front of prefix is skipped without buffering
+ * \return event as btl_decode(), \used is set to bytes consumed
+ */
+int btl_decode_feed(struct btl_decoder *dec, const void *data, unsigned int len,
+		unsigned int *used);
+
+/*
+ * \brief drop returned frame or prefix of truncated frame, scan is
+ *        restarted from the next prefix by next call of btl_decode()
+ */
+void btl_decode_skip(struct btl_decoder *dec);
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Protocol of serial port, shared by bootloader and its emulator
+ */
+
+#ifndef _BTLPORT_H_
+#define _BTLPORT_H_
+
+#include <stdint.h>
+
+#include "btl.h"
+#include "usart.h"
+
+/* Maximum time to wait for free space in TX queue */
+#define USART_TX_TIMEOUT_MS	100
+/* DATA frames of streaming read queued for transmission */
+#define BTL_PORT_DATA_FRAMES	2
+
+struct boot_port {
+	uint32_t baud;
+	uint32_t last_time;
+	btl_if_t iface;
+	usart_frame_t reply;
+	volatile int reply_busy;
+	struct boot_data {
+		usart_frame_t frame;
+		volatile int busy;
+		uint8_t buf[BTL_MAX_PKT_SIZE];
+	} data[BTL_PORT_DATA_FRAMES];
+};
+
+struct boot_ports {
+	struct boot_port usart[USART_NUM];
+	/* ports are bridged by interrupts, protocol is off */
+	int bridge;
+};
+
+/*
+ * \brief run protocol of port on one received byte, or do idle work
+ *        and input timeout if nothing is received
+ */
+void btl_port_handle(struct boot_ports *bp, int port);
+
+#endif
@@ -35,19 +35,309 @@ typedef struct btl_packet_s {
 #define BTL_PKT_PREXIX		'#'
 #define BTL_PKT_REPLY		0x80
 
-#define BTL_CMD_INFO		0x00
-#define BTL_CMD_ERASE		0x01
-#define BTL_CMD_WRITE		0x02
-#define BTL_CMD_READ		0x03
-#define BTL_CMD_VERIFY		0x04
-#define BTL_CMD_BAUD		0x05
-#define BTL_CMD_RESET		0xff
+/*
+ * ADDRESS HEADER, prefix of packet on shared bus:
+ * PREFIX          char '@'
+ * EUI48           6 bytes, little endian, ff:ff:ff:ff:ff:ff is broadcast
+ * CS              u8 crc8 of EUI48
+ * Device handles packets addressed to it and broadcast packets, replies
+ * to addressed packets only. Packets without header are handled as before.
+ */
+typedef struct btl_addr_hdr_s {
+	uint8_t prefix;
+	uint8_t eui[6];
+	uint8_t crc;
+} __attribute__((__packed__)) btl_addr_hdr_t;
+
+#define BTL_ADDR_HDR_SIZE	sizeof(btl_addr_hdr_t)
+#define BTL_PKT_ADDR_PREFIX	'@'
+
+/*
+ * Command table, the only definition of request opcodes and their rules,
+ * device dispatch and host request checks are built from it.
+ * X(name, handler, opcode, min, max, check, flags, reply)
+ *   name	BTL_CMD_<name> opcode constant
+ *   handler	btl_cmd_<handler>() of device
+ *   min, max	request payload size, bytes
+ *   check	address check of request done before handler
+ *   flags	BTL_CF_ flags
+ *   reply	maximum reply payload size, bytes
+ */
+#define BTL_COMMANDS(X) \
+	X(INFO,    info,    0x00, 0, 0,  BTL_CHECK_NONE, 0, BTL_MAX_DATA_SIZE) \
+	X(ERASE,   erase,   0x01, 4, 8,  BTL_CHECK_LEN,  0, 4) \
+	X(WRITE,   write,   0x02, 0, BTL_MAX_DATA_SIZE, BTL_CHECK_DATA, 0, 0) \
+	X(READ,    read,    0x03, 0, 4,  BTL_CHECK_NONE, 0, BTL_MAX_DATA_SIZE) \
+	X(VERIFY,  verify,  0x04, 0, BTL_MAX_DATA_SIZE, BTL_CHECK_DATA, 0, 0) \
+	X(BAUD,    baud,    0x05, 4, 4,  BTL_CHECK_NONE, 0, 0) \
+	X(STATS,   stats,   0x06, 0, 0,  BTL_CHECK_NONE, 0, sizeof(struct btl_stats_s)) \
+	X(PROFILE, profile, 0x07, 0, 0,  BTL_CHECK_NONE, 0, sizeof(struct btl_prof_s)) \
+	X(ID,      id,      0x08, 0, 0,  BTL_CHECK_NONE, 0, 8) \
+	X(DIGEST,  digest,  0x09, 4, 4,  BTL_CHECK_APP,  0, 4) \
+	X(SWRITE,  swrite,  0x0a, 0, BTL_MAX_DATA_SIZE, BTL_CHECK_DATA, \
+	  BTL_CF_SR, 1 + BTL_SR_WINDOW) \
+	X(SREAD,   sread,   0x0c, 8, 8,  BTL_CHECK_READ, 0, 0) \
+	X(CREDIT,  credit,  0x0d, 0, 0,  BTL_CHECK_NONE, \
+	  BTL_CF_RD | BTL_CF_FWD | BTL_CF_NOREPLY, 0) \
+	X(COMMIT,  commit,  0x0f, 4, 8,  BTL_CHECK_APP,  0, sizeof(struct btl_commit_s)) \
+	X(BITMAP,  bitmap,  0x10, 0, 4,  BTL_CHECK_NONE, 0, BTL_MAX_DATA_SIZE) \
+	X(BRIDGE,  bridge,  0x11, 1, 1,  BTL_CHECK_NONE, 0, 0) \
+	X(FORWARD, forward, 0x12, 0, BTL_MAX_DATA_SIZE, BTL_CHECK_NONE, \
+	  BTL_CF_FWD | BTL_CF_NOREPLY, 0) \
+	X(SIGN,    sign,    0x14, BTL_SIGN_SIZE, BTL_SIGN_SIZE, BTL_CHECK_NONE, 0, 0) \
+	X(CRYPT,   crypt,   0x15, 0, BTL_CRYPT_IV_SIZE, BTL_CHECK_NONE, 0, 0) \
+	X(RESET,   reset,   0xff, 0, 0,  BTL_CHECK_NONE, 0, 0)
+
+/*
+ * Frames sent by device on its own, X(name, opcode)
+ */
+#define BTL_FRAMES(X) \
+	X(NACK,     0x0b) \
+	X(DATA,     0x0e) \
+	X(PROGRESS, 0x13)
+
+#define BTL_CMD_ENUM(name, handler, op, ...)	BTL_CMD_##name = op,
+#define BTL_FRAME_ENUM(name, op)		BTL_CMD_##name = op,
+
+enum {
+	BTL_COMMANDS(BTL_CMD_ENUM)
+	BTL_FRAMES(BTL_FRAME_ENUM)
+};
+
+/* address check of request */
+#define BTL_CHECK_NONE		0
+/* range of address and payload size */
+#define BTL_CHECK_DATA		1
+/* range of address and u32 length at payload start */
+#define BTL_CHECK_LEN		2
+/* u32 length at payload start, range lies in application area or its copy */
+#define BTL_CHECK_APP		3
+/* u32 length at payload start, range lies in flash */
+#define BTL_CHECK_READ		4
+
+/* SWRITE window stays open */
+#define BTL_CF_SR		0x01
+/* SREAD stream goes on */
+#define BTL_CF_RD		0x02
+/* bridge keeps passing FORWARD frames */
+#define BTL_CF_FWD		0x04
+/* no reply is sent */
+#define BTL_CF_NOREPLY		0x08
+
+/*
+ * Table entry, slot of opcode is its low bits, all opcodes
+ * of table map to different slots
+ */
+struct btl_cmd_desc {
+	uint8_t op;
+	uint8_t min;
+	uint8_t max;
+	uint8_t check;
+	uint8_t flags;
+	uint8_t reply;
+};
+
+#define BTL_CMD_SLOTS		32
+#define btl_cmd_slot(op)	((op) & (BTL_CMD_SLOTS - 1))
+
+#define BTL_CMD_DESC(name, handler, op, min, max, check, flags, reply) \
+	[btl_cmd_slot(op)] = { op, min, max, check, flags, reply },
+
+/*
+ * \brief table entry of request opcode, NULL if opcode is unknown
+ */
+static inline const struct btl_cmd_desc *btl_cmd_find(const struct btl_cmd_desc *table,
+						      uint8_t op)
+{
+	const struct btl_cmd_desc *d = &table[btl_cmd_slot(op)];
+
+	return d->op == op ? d : NULL;
+}
 
 #define BTL_STATUS_OK		0x00
 #define BTL_STATUS_ERROR	0xff
 
 #define BTL_CMD_ERROR		0x7f
 
+/*
+ * SWRITE command, write with selective repeat
+ * Request status is 8-bit sequence number. Request without data opens
+ * sequence starting from its number, any other command closes it.
+ * Frames are written in any order, up to BTL_SR_WINDOW frames ahead
+ * of the first missing one.
+ * Reply payload is the sequence number followed by sequence numbers
+ * still missing below the highest received one.
+ *
+ * NACK frame is sent by device in SWRITE sequence on corrupted or
+ * truncated frame, payload is missing sequence numbers followed by
+ * sequence number next to the highest received one.
+ */
+#define BTL_SR_WINDOW		32
+
+/*
+ * SREAD command, streaming read
+ * Request status is stream id, payload is u32 length and u32 initial
+ * credit in bytes. Device replies and sends DATA frames of consecutive
+ * addresses at line rate, status of DATA frame is stream id.
+ * Frames are sent while frame address is below credit address.
+ *
+ * CREDIT command has no reply, its address is new credit address of
+ * stream with id in status. Any other command stops the stream.
+ */
+
+/*
+ * BITMAP command, write bitmap of broadcast session
+ * Request with u32 length payload opens session of range, bit n is set
+ * when packet in block start + n * BTL_MAX_DATA_SIZE is written, packets
+ * of blocks already written are skipped. Request without payload reads
+ * bitmap from byte offset in address.
+ */
+#define BTL_BITMAP_SIZE		256
+#define BTL_BITMAP_RANGE	(BTL_BITMAP_SIZE * 8 * BTL_MAX_DATA_SIZE)
+
+/*
+ * ERASE command, request payload is u32 length.
+ * With u32 length and u32 report interval in pages erase runs in
+ * background, device replies at once and other commands are handled
+ * meanwhile. PROGRESS frame with reply flag is sent every interval
+ * pages and when erase is finished, frame address is the next page to
+ * erase, payload is u32 bytes left, status is error if erase failed.
+ * Request with zero length cancels background erase, reply payload is
+ * u32 address where it stopped.
+ */
+
+/*
+ * BRIDGE command, connect downstream port of unit
+ * Request address is downstream baud rate, 0 keeps it, payload is one
+ * byte mode. In BTL_BRIDGE_RAW mode all bytes are passed between ports
+ * in both directions after the reply, until reset.
+ * In BTL_BRIDGE_FRAME mode FORWARD request payload is sent downstream
+ * and data received downstream comes back in FORWARD frames with reply
+ * flag. FORWARD request has no reply, any other command closes bridge.
+ */
+#define BTL_BRIDGE_RAW		0
+#define BTL_BRIDGE_FRAME	1
+
+/*
+ * DIGEST command, CRC-32 of flash range of u32 length in payload,
+ * at most BTL_DIGEST_MAX bytes of application area or its copy
+ */
+#define BTL_DIGEST_MAX		BTL_FLASH_PAGE_SIZE
+
+/*
+ * COMMIT command, integrity check of written range
+ * Request with u32 length payload opens write session of range, device
+ * computes CRC-32 of pages behind the written ones while the line is idle
+ * and compares every written packet with flash contents.
+ * Request with u32 length and u32 expected CRC-32 of range (unwritten
+ * bytes are 0xff) finishes the digest and closes session.
+ * Reply payload is struct btl_commit_s, page is the first page found
+ * mismatched by packet compare or BTL_COMMIT_NO_PAGE.
+ * Range of application area or its copy only. If more than BTL_DIGEST_MAX
+ * bytes are left to digest, device goes on while the line is idle and
+ * replies BTL_COMMIT_BUSY with address reached in page, request is
+ * repeated until it has the result.
+ */
+#define BTL_COMMIT_PASS		0
+#define BTL_COMMIT_FAIL		1
+/* range matches CRC-32, but its signature is missing or wrong */
+#define BTL_COMMIT_SIGN		2
+/* digest goes on, request is repeated */
+#define BTL_COMMIT_BUSY		3
+#define BTL_COMMIT_NO_PAGE	0xffffffff
+
+struct btl_commit_s {
+	uint32_t result;
+	uint32_t crc;
+	uint32_t page;
+} __attribute__((__packed__));
+
+/*
+ * SIGN command, signature of COMMIT range, signing build only
+ * Request address is range start, payload is Ed25519 signature of
+ * struct btl_sign_msg_s, digest is SHA-256 of range (unwritten bytes
+ * are 0xff). Device hashes range along with CRC-32 while the line is
+ * idle and checks signature when COMMIT closes session. Range failed
+ * the check gets its first page erased.
+ */
+#define BTL_SIGN_SIZE		64
+
+struct btl_sign_msg_s {
+	uint32_t addr;
+	uint32_t size;
+	uint8_t digest[32];
+} __attribute__((__packed__));
+
+/*
+ * CRYPT command, encrypted write mode, encrypting build only
+ * Request payload is 16 byte initial counter block, written data of
+ * WRITE and SWRITE is decrypted with AES-128-CTR of key built into
+ * device before it is programmed. Keystream at address addr is made of
+ * counter block with addr / 16 added to its last 32 bits (big endian),
+ * so packets are decrypted in any order. Request without payload
+ * returns to plain writes. READ and SREAD of bootloader area holding
+ * the key are refused by encrypting build.
+ */
+#define BTL_CRYPT_IV_SIZE	16
+
+/*
+ * STATS command
+ * Request address BTL_STATS_CLEAR resets counters after reading.
+ * Reply payload is struct btl_stats_s, times in microseconds.
+ */
+#define BTL_STATS_CLEAR		0x00000001
+
+struct btl_stats_s {
+	/* link */
+	uint32_t rx_bytes;
+	uint32_t tx_bytes;
+	uint32_t frames;
+	uint32_t crc_err;
+	uint32_t size_err;
+	uint32_t timeout;
+	uint32_t rx_overrun;
+	uint32_t rx_drop;
+	uint32_t tx_drop;
+	/* flash */
+	uint32_t erase_time;
+	uint32_t erase_max;
+	uint32_t write_time;
+	uint32_t write_max;
+	/* achieved write rate, bytes per millisecond */
+	uint32_t write_rate;
+} __attribute__((__packed__));
+
+/*
+ * PROFILE command, available in profiling build only
+ * Request address is probe number, BTL_PROF_CLEAR flag resets the probe
+ * after reading. Reply payload is struct btl_prof_s, times in CPU cycles.
+ */
+#define BTL_PROF_CLEAR		0x80000000
+
+#define BTL_PROF_PACKET		0
+#define BTL_PROF_READ_BYTE	1
+#define BTL_PROF_FLASH_ERASE	2
+#define BTL_PROF_FLASH_WRITE	3
+#define BTL_PROF_USART_RX_IRQ	4
+#define BTL_PROF_USART_TX_IRQ	5
+#define BTL_PROF_TIMER		6
+#define BTL_PROF_NUM		7
+
+/*
+ * log2 histogram, bucket 0 counts samples below 2^BTL_PROF_HIST_SHIFT
+ * cycles, bucket n counts samples in [2^(n + SHIFT - 1), 2^(n + SHIFT)),
+ * the last bucket counts everything above.
+ */
+#define BTL_PROF_HIST		16
+#define BTL_PROF_HIST_SHIFT	5
+
+struct btl_prof_s {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint32_t avg;
+	uint16_t hist[BTL_PROF_HIST];
+} __attribute__((__packed__));
 
 #define BTL_MAX_DATA_SIZE	64
 #define BTL_MAX_PKT_SIZE	(BTL_MAX_DATA_SIZE + BTL_HEADER_SIZE + 1)
@@ -68,9 +358,33 @@ static inline uint8_t crc8_calc(uint8_t crc, uint8_t a, uint8_t poly)
 
 #define BTL_CRC_POLY		0xd5
 
+/*
+ * CRC-32 (IEEE 802.3), chained by passing previous result as \crc,
+ * initial value 0
+ */
+#define BTL_CRC32_POLY		0xedb88320
+
+static inline uint32_t crc32_calc(uint32_t crc, const void *data, unsigned int len)
+{
+	const uint8_t *p = data;
+	int i;
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (BTL_CRC32_POLY & -(crc & 1));
+	}
+	return ~crc;
+}
+
 #define BTL_ADDR		0xfe10000
 #define BTL_SIZE		0x4000
 
+#define BTL_FLASH_PAGE_SIZE	2048
+#define BTL_FLASH_SIZE		0x80000
+
+#define BTL_APP_ADDR		0x0
 #define BTL_FLASH_APP_ADDR	0x40000
 #define BTL_APP_SIZE		0x20000
 
@@ -0,0 +1,35 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ */
+
+#ifndef _ED25519_H_
+#define _ED25519_H_
+
+#include <stdint.h>
+
+#define ED25519_KEY_SIZE	32
+#define ED25519_SIG_SIZE	64
+
+/*
+ * \brief check Ed25519 (RFC 8032) signature of message
+ * \return 0 if signature is valid, -1 otherwise
+ */
+int ed25519_verify(const uint8_t *sig, const uint8_t *pub,
+		   const void *msg, uint32_t len);
+
+/*
+ * \brief public key of 32 byte secret seed
+ */
+void ed25519_public(uint8_t *pub, const uint8_t *seed);
+
+/*
+ * \brief sign message with 32 byte secret seed, host tool only
+ */
+void ed25519_sign(uint8_t *sig, const uint8_t *seed,
+		  const void *msg, uint32_t len);
+
+#endif
@@ -9,15 +9,26 @@
 #ifndef _FLASH_H_
 #define _FLASH_H_
 
+#include <stdint.h>
 #include <string.h>
 
+struct flash_stats {
+	uint32_t erase_time;
+	uint32_t erase_max;
+	uint32_t write_time;
+	uint32_t write_max;
+	uint32_t write_bytes;
+};
+
+void flash_get_stats(struct flash_stats *st, int clear);
+
 int flash_erase(unsigned int addr, unsigned int len);
 
 int flash_write(unsigned int addr, const void *data, unsigned int len);
 
 static inline int flash_read(unsigned int addr, void *buf, unsigned int len)
 {
-	memcpy(buf, (void *)addr, len);
+	memcpy(buf, (const void *)(uintptr_t)addr, len);
 	return len;
 }
 
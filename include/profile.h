@@ -0,0 +1,51 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Cycle counter profiling, enabled by BTL_PROFILE
+ */
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stdint.h>
+
+#include "btlproto.h"
+
+#ifdef BTL_PROFILE
+
+#include <em_device.h>
+
+#include "target.h"
+
+#define PROF_START(t)		uint32_t t = DWT->CYCCNT
+#define PROF_END(probe, t)	prof_add(probe, DWT->CYCCNT - (t))
+
+void prof_init(void);
+
+RAMFUNC void prof_add(int probe, uint32_t cycles);
+
+int prof_get(int probe, struct btl_prof_s *p, int clear);
+
+#else
+
+#define PROF_START(t)
+#define PROF_END(probe, t)
+
+static inline void prof_init(void)
+{
+}
+
+static inline int prof_get(int probe, struct btl_prof_s *p, int clear)
+{
+	(void)probe;
+	(void)p;
+	(void)clear;
+	return -1;
+}
+
+#endif
+
+#endif
@@ -14,6 +14,8 @@
 #include <stdbool.h>
 #include <sys/cdefs.h>
 
+#include "target.h"
+
 
 typedef struct {
 	size_t head;
@@ -38,8 +40,9 @@ static inline bool queue_empty(queue_t *q)
 }
 
 int queue_init(queue_t *q, void *buf, size_t size);
-int queue_write(queue_t *q, uint8_t d);
-int queue_read(queue_t *q);
+/* used by interrupt handlers, run from RAM */
+RAMFUNC int queue_write(queue_t *q, uint8_t d);
+RAMFUNC int queue_read(queue_t *q);
 int queue_read_buf(queue_t *q, void *buf, size_t len);
 
 /*
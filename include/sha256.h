@@ -0,0 +1,31 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ */
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stdint.h>
+
+#define SHA256_BLOCK_SIZE	64
+#define SHA256_DIGEST_SIZE	32
+
+/*
+ * Incremental SHA-256, shared by bootloader and host tool.
+ * On the device blocks are compressed by the CRYPTO engine.
+ */
+struct sha256_ctx {
+	uint32_t state[8];
+	uint32_t buf[SHA256_BLOCK_SIZE / 4];
+	uint64_t len;
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, uint32_t len);
+void sha256_final(struct sha256_ctx *ctx, uint8_t *digest);
+
+#endif
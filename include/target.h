@@ -19,6 +19,17 @@
 # define HWREV		1
 #endif
 
+/*
+ * Function runs from RAM, so it is not stalled while flash is erased
+ * or written. RAM is out of BL range of flash code, calls are long.
+ */
+#if defined(__arm__)
+#define RAMFUNC		__attribute__((__section__(".ram"), __noinline__, __long_call__))
+#else
+/* shared sources built on host by simulator */
+#define RAMFUNC
+#endif
+
 #if (HWREV < 2)
 
 #define LED_GREEN_PORT			gpioPortA
@@ -46,6 +57,13 @@
 #define USART0_ROUTE_RX			USART_ROUTELOC0_RXLOC_LOC8
 #define USART0_ROUTE_HALF_RX		USART_ROUTELOC0_RXLOC_LOC9
 
+/* Optional hardware flow control, CTS input and RTS output */
+#define USART0_PORT_CTS			gpioPortC
+#define USART0_PIN_CTS			8
+#define USART0_ROUTE_CTS		USART_ROUTELOC1_CTSLOC_LOC11
+#define USART0_PORT_RTS			gpioPortC
+#define USART0_PIN_RTS			9
+
 #define USART1_PORT_TX			gpioPortC
 #define USART1_PIN_TX			11
 #define USART1_ROUTE_TX			USART_ROUTELOC0_TXLOC_LOC16
@@ -84,6 +102,13 @@
 #define USART0_ROUTE_RX			USART_ROUTELOC0_RXLOC_LOC14
 #define USART0_ROUTE_HALF_RX		USART_ROUTELOC0_RXLOC_LOC15
 
+/* Optional hardware flow control, CTS input and RTS output */
+#define USART0_PORT_CTS			gpioPortC
+#define USART0_PIN_CTS			8
+#define USART0_ROUTE_CTS		USART_ROUTELOC1_CTSLOC_LOC11
+#define USART0_PORT_RTS			gpioPortC
+#define USART0_PIN_RTS			9
+
 #define USART1_PORT_TX			gpioPortB
 #define USART1_PIN_TX			15
 #define USART1_ROUTE_TX			USART_ROUTELOC0_TXLOC_LOC10
@@ -129,6 +154,11 @@
 
 #define USART_NUM			2
 
+/* RTS is deasserted when RX queue fill level reaches high watermark
+ * and asserted again when it drops to low watermark */
+#define USART_RTS_HIGH(len)		((len) - (len) / 4)
+#define USART_RTS_LOW(len)		((len) / 4)
+
 typedef struct usart_hw_s {
 	USART_TypeDef *regs;
 	CMU_Clock_TypeDef clock;
@@ -140,6 +170,13 @@ typedef struct usart_hw_s {
 		uint32_t pin;
 		int inverted;
 	} tx, rx;
+	/* hardware flow control */
+	int flow;
+	struct {
+		uint32_t route;
+		GPIO_Port_TypeDef port;
+		uint32_t pin;
+	} cts, rts;
 } usart_hw_t;
 
 static inline void usart_hw_tx_irq_disable(usart_hw_t *hw)
@@ -152,6 +189,11 @@ static inline void usart_hw_tx_complete_irq_disable(usart_hw_t *hw)
 	USART_IntDisable(hw->regs, USART_IEN_TXC);
 }
 
+static inline void usart_hw_tx_complete_clear(usart_hw_t *hw)
+{
+	USART_IntClear(hw->regs, USART_IF_TXC);
+}
+
 static inline void usart_hw_tx_irq_enable(usart_hw_t *hw)
 {
 	USART_IntEnable(hw->regs, USART_IEN_TXBL);
@@ -172,11 +214,32 @@ static inline void usart_hw_rx_irq_enable(usart_hw_t *hw)
 	USART_IntEnable(hw->regs, USART_IEN_RXDATAV | USART_IEN_RXOF);
 }
 
+static inline void usart_hw_rx_overrun_clear(usart_hw_t *hw)
+{
+	USART_IntClear(hw->regs, USART_IF_RXOF);
+}
+
+/*
+ * RTS is active low, asserted RTS allows remote side to transmit
+ */
+static inline void usart_hw_rts(usart_hw_t *hw, int on)
+{
+	if (on)
+		GPIO_PinOutClear(hw->rts.port, hw->rts.pin);
+	else
+		GPIO_PinOutSet(hw->rts.port, hw->rts.pin);
+}
+
 static inline void usart_hw_tx(usart_hw_t *hw, uint8_t data)
 {
 	hw->regs->TXDATA = data;
 }
 
+static inline int usart_hw_tx_complete(usart_hw_t *hw)
+{
+	return hw->regs->STATUS & USART_STATUS_TXC;
+}
+
 static inline int usart_hw_rx_ready(usart_hw_t *hw)
 {
 	return USART_IntGet(hw->regs) & USART_IEN_RXDATAV;
@@ -233,12 +296,15 @@ static inline void usart_hw_enable(usart_hw_t *hw, int ena_tx, int ena_rx)
 
 //GPIO_PinOutSet
 
-void usart_hw_half_duplex_tx(usart_hw_t *hw);
-void usart_hw_half_duplex_rx(usart_hw_t *hw);
+/* called from TX interrupts and raw bridge, run from RAM */
+RAMFUNC void usart_hw_half_duplex_tx(usart_hw_t *hw);
+RAMFUNC void usart_hw_half_duplex_rx(usart_hw_t *hw);
 usart_hw_t *usart_hw_init(int num);
 
 void target_init(void);
 uint64_t taget_get_id(void);
+/* restart bootloader, does not return on device */
+void target_reset(void);
 
 #define TIMER_TICK_HZ			1000
 uint32_t timer_get_us(void);
@@ -10,6 +10,37 @@
 #define _USART_H_
 
 #include "target.h"
+#include "queue.h"
+
+struct usart_frame;
+
+typedef void (*usart_frame_cb)(void *, struct usart_frame *);
+
+/*
+ * Transmit frame descriptor.
+ * The buffer is sent directly by the TX interrupt without copying,
+ * so it must stay valid until the completion callback is called.
+ */
+typedef struct usart_frame {
+	TAILQ_ENTRY(usart_frame) queue;
+	const uint8_t *buf;
+	unsigned int len;
+	unsigned int pos;
+	/* TX queue position where frame is inserted */
+	size_t mark;
+	usart_frame_cb done;
+	void *arg;
+} usart_frame_t;
+
+struct usart_stats {
+	uint32_t rx_bytes;
+	uint32_t tx_bytes;
+	uint32_t rx_overrun;
+	uint32_t rx_drop;
+	uint32_t tx_drop;
+};
+
+void usart_get_stats(int num, struct usart_stats *st, int clear);
 
 void usart_rx_enable(int num);
 
@@ -17,6 +48,8 @@ void usart_half_duplex_rx(int num);
 
 void usart_half_duplex_tx(int num);
 
+void usart_set_half_duplex(int num, int on);
+
 void usart_set_msb(int num, int msb);
 
 void usart_set_inv(int num, int rx, int tx);
@@ -29,17 +62,29 @@ int usart_read(int num);
 
 int usart_read_buf(int num, void *buf, int len);
 
-int usart_write(int num, char d);
+/* raw bridge writes from RX interrupt */
+RAMFUNC int usart_write(int num, char d);
 
 int usart_write_buf(int num, const void *buf, int len);
 
+int usart_write_buf_timeout(int num, const void *buf, int len, uint32_t ms);
+
+int usart_write_frame(int num, usart_frame_t *f);
+
+RAMFUNC int usart_tx_busy(int num);
+
+int usart_tx_flush(int num, uint32_t ms);
+
 int usart_init(int num, int rxlen, int txlen);
 
-void usart_rx_irq(int num);
+/* interrupt handlers run from RAM */
+RAMFUNC void usart_rx_irq(int num);
+
+RAMFUNC void usart_rx_overrun_irq(int num);
 
-void usart_tx_irq(int num);
+RAMFUNC void usart_tx_irq(int num);
 
-void usart_tx_complete_irq(int num);
+RAMFUNC void usart_tx_complete_irq(int num);
 
 typedef void (*usart_cb)(void *, uint8_t);
 
@@ -47,4 +92,6 @@ void usart_rx_set_callback(int num, usart_cb, void *arg);
 
 void usart_tx_set_callback(int num, usart_cb, void *arg);
 
+void usart_bridge(int a, int b);
+
 #endif
@@ -0,0 +1,184 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * AES-128 (FIPS 197) and CTR mode (SP 800-38A)
+ */
+
+#include <string.h>
+
+#include "aes.h"
+
+#if defined(__arm__)
+#include "em_device.h"
+#endif
+
+#if defined(CRYPTO_PRESENT)
+#include "em_cmu.h"
+#include "em_crypto.h"
+#endif
+
+/* keystream blocks made at once */
+#define AES_CTR_BLOCKS		4
+
+static const uint8_t aes_sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+	0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+	0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+	0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+	0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+	0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+	0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+	0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+	0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+	0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+	0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+	0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+	0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+	0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+	0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+	0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+	0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static uint8_t aes_xtime(uint8_t x)
+{
+	return (x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+}
+
+#if defined(CRYPTO_PRESENT)
+
+/* encrypt n blocks of buf in place by the CRYPTO engine */
+static void aes_blocks(const struct aes_ctx *ctx, uint8_t *buf, uint32_t n)
+{
+	CMU_ClockEnable(cmuClock_CRYPTO, true);
+	CRYPTO_AES_ECB128(CRYPTO, buf, buf, n * AES_BLOCK_SIZE, ctx->key, true);
+}
+
+#else
+
+static void aes_blocks(const struct aes_ctx *ctx, uint8_t *buf, uint32_t n)
+{
+	const uint8_t *rk;
+	uint8_t t[AES_BLOCK_SIZE], a0, a1, a2, a3, x;
+	int r, i;
+
+	for (; n--; buf += AES_BLOCK_SIZE) {
+		rk = ctx->rk;
+		for (i = 0; i < AES_BLOCK_SIZE; i++)
+			buf[i] ^= rk[i];
+
+		for (r = 1; r <= 10; r++) {
+			/* SubBytes and ShiftRows, state is column major */
+			for (i = 0; i < AES_BLOCK_SIZE; i++)
+				t[i] = aes_sbox[buf[(i + 4 * (i % 4)) % AES_BLOCK_SIZE]];
+
+			/* MixColumns */
+			for (i = 0; r < 10 && i < AES_BLOCK_SIZE; i += 4) {
+				a0 = t[i];
+				a1 = t[i + 1];
+				a2 = t[i + 2];
+				a3 = t[i + 3];
+				x = a0 ^ a1 ^ a2 ^ a3;
+				t[i] ^= x ^ aes_xtime(a0 ^ a1);
+				t[i + 1] ^= x ^ aes_xtime(a1 ^ a2);
+				t[i + 2] ^= x ^ aes_xtime(a2 ^ a3);
+				t[i + 3] ^= x ^ aes_xtime(a3 ^ a0);
+			}
+
+			rk += AES_BLOCK_SIZE;
+			for (i = 0; i < AES_BLOCK_SIZE; i++)
+				buf[i] = t[i] ^ rk[i];
+		}
+	}
+}
+
+#endif
+
+void aes_init(struct aes_ctx *ctx, const uint8_t *key)
+{
+	uint8_t *rk = ctx->rk;
+	uint8_t t[4], rcon = 1;
+	int i, j;
+
+	memcpy(ctx->key, key, AES_KEY_SIZE);
+	memcpy(rk, key, AES_KEY_SIZE);
+
+	for (i = AES_KEY_SIZE; i < (int)sizeof(ctx->rk); i += 4) {
+		memcpy(t, &rk[i - 4], 4);
+		if (i % AES_KEY_SIZE == 0) {
+			j = t[0];
+			t[0] = aes_sbox[t[1]] ^ rcon;
+			t[1] = aes_sbox[t[2]];
+			t[2] = aes_sbox[t[3]];
+			t[3] = aes_sbox[j];
+			rcon = aes_xtime(rcon);
+		}
+		for (j = 0; j < 4; j++)
+			rk[i + j] = rk[i - AES_KEY_SIZE + j] ^ t[j];
+	}
+}
+
+void aes_encrypt(const struct aes_ctx *ctx, uint8_t *out, const uint8_t *in)
+{
+	uint32_t buf[AES_BLOCK_SIZE / 4];
+
+	memcpy(buf, in, AES_BLOCK_SIZE);
+	aes_blocks(ctx, (uint8_t *)buf, 1);
+	memcpy(out, buf, AES_BLOCK_SIZE);
+}
+
+void aes_ctr(const struct aes_ctx *ctx, const uint8_t *iv, uint32_t ofs,
+	     uint8_t *data, uint32_t len)
+{
+	uint32_t ks[AES_CTR_BLOCKS * AES_BLOCK_SIZE / 4];
+	uint8_t *k = (uint8_t *)ks, *c;
+	uint32_t blk = ofs / AES_BLOCK_SIZE, skip = ofs % AES_BLOCK_SIZE;
+	uint32_t n, i, ctr;
+
+	while (len) {
+		n = (skip + len + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+		if (n > AES_CTR_BLOCKS)
+			n = AES_CTR_BLOCKS;
+
+		for (i = 0; i < n; i++) {
+			c = k + i * AES_BLOCK_SIZE;
+			ctr = ((uint32_t)iv[12] << 24 | (uint32_t)iv[13] << 16 |
+			       (uint32_t)iv[14] << 8 | iv[15]) + blk + i;
+			memcpy(c, iv, AES_BLOCK_SIZE - 4);
+			c[12] = ctr >> 24;
+			c[13] = ctr >> 16;
+			c[14] = ctr >> 8;
+			c[15] = ctr;
+		}
+		aes_blocks(ctx, k, n);
+		blk += n;
+
+		n = n * AES_BLOCK_SIZE - skip;
+		if (n > len)
+			n = len;
+		for (i = 0; i < n; i++)
+			data[i] ^= k[skip + i];
+
+		data += n;
+		len -= n;
+		skip = 0;
+	}
+}
@@ -0,0 +1,226 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Wear leveled boot state journal
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "btlproto.h"
+#include "flash.h"
+#include "bootlog.h"
+
+static const uint32_t bootlog_pages[BOOTLOG_PAGES] = {
+	BOOTLOG_ADDR,
+	BOOTLOG_SPARE_ADDR,
+};
+
+static struct {
+	/* page being filled and its first free slot */
+	unsigned int page;
+	unsigned int next;
+	struct bootlog_rec last;
+} bootlog;
+
+#define bootlog_slot(p, n)	((const struct bootlog_rec *)(uintptr_t)bootlog_pages[p] + (n))
+
+static int bootlog_free(unsigned int p, unsigned int n)
+{
+	const uint32_t *w = (const uint32_t *)bootlog_slot(p, n);
+	unsigned int i;
+
+	for (i = 0; i < sizeof(struct bootlog_rec) / 4; i++) {
+		if (w[i] != 0xffffffff)
+			return 0;
+	}
+	return 1;
+}
+
+static int bootlog_valid(const struct bootlog_rec *r)
+{
+	return r->magic == BOOTLOG_MAGIC &&
+		r->crc == crc32_calc(0, r, offsetof(struct bootlog_rec, crc));
+}
+
+/*
+ * \brief first free slot of page, records fill slots from the start
+ */
+static unsigned int bootlog_scan(unsigned int p)
+{
+	unsigned int lo = 0, hi = BOOTLOG_RECS;
+	unsigned int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (bootlog_free(p, mid))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/*
+ * \brief the latest valid record of page below slot \n, torn record
+ *        of power loss is skipped
+ */
+static const struct bootlog_rec *bootlog_latest(unsigned int p, unsigned int n)
+{
+	while (n--) {
+		if (bootlog_valid(bootlog_slot(p, n)))
+			return bootlog_slot(p, n);
+	}
+	return NULL;
+}
+
+void bootlog_init(void)
+{
+	const struct bootlog_rec *r, *last = NULL;
+	unsigned int p, n;
+
+	bootlog.page = 0;
+	bootlog.next = bootlog_scan(0);
+
+	for (p = 0; p < BOOTLOG_PAGES; p++) {
+		n = bootlog_scan(p);
+		r = bootlog_latest(p, n);
+		if (!r || (last && (int32_t)(r->seq - last->seq) <= 0))
+			continue;
+
+		last = r;
+		bootlog.page = p;
+		bootlog.next = n;
+	}
+
+	memset(&bootlog.last, 0, sizeof(bootlog.last));
+	if (last)
+		bootlog.last = *last;
+}
+
+const struct bootlog_rec *bootlog_get(void)
+{
+	return &bootlog.last;
+}
+
+/*
+ * \brief program record built on the latest state
+ */
+static int bootlog_append(struct bootlog_rec *r)
+{
+	unsigned int p;
+
+	r->magic = BOOTLOG_MAGIC;
+	r->seq = bootlog.last.seq + 1;
+	r->crc = crc32_calc(0, r, offsetof(struct bootlog_rec, crc));
+
+	if (bootlog.next >= BOOTLOG_RECS) {
+		/* full page keeps the latest state while the other one is erased */
+		p = (bootlog.page + 1) % BOOTLOG_PAGES;
+		if (flash_erase(bootlog_pages[p], BOOTLOG_SIZE) < 0)
+			return -1;
+		bootlog.page = p;
+		bootlog.next = 0;
+	}
+
+	/* failed slot is not programmed again */
+	if (flash_write((uintptr_t)bootlog_slot(bootlog.page, bootlog.next++),
+			r, sizeof(*r)) < 0)
+		return -1;
+
+	bootlog.last = *r;
+	return 0;
+}
+
+int bootlog_put(uint32_t target, uint32_t progress, uint32_t digest)
+{
+	struct bootlog_rec r = bootlog.last;
+
+	r.target = target;
+	r.progress = progress;
+	r.digest = digest;
+	return bootlog_append(&r);
+}
+
+/*
+ * \brief set or clear map bits of pages of both areas in range, pages
+ *        touched by range are set, only pages inside range are cleared
+ */
+static int bootlog_map(uint32_t addr, uint32_t size, int set)
+{
+	static const uint32_t base[2] = { BTL_APP_ADDR, BTL_FLASH_APP_ADDR };
+	struct bootlog_rec r = bootlog.last;
+	uint32_t lo, hi, n;
+	unsigned int i;
+
+	for (i = 0; i < 2; i++) {
+		if (addr >= base[i] + BTL_APP_SIZE || addr + size <= base[i])
+			continue;
+
+		lo = addr > base[i] ? addr - base[i] : 0;
+		hi = addr + size - base[i];
+		if (hi > BTL_APP_SIZE)
+			hi = BTL_APP_SIZE;
+
+		if (set) {
+			lo /= BTL_FLASH_PAGE_SIZE;
+			hi = (hi + BTL_FLASH_PAGE_SIZE - 1) / BTL_FLASH_PAGE_SIZE;
+		} else {
+			lo = (lo + BTL_FLASH_PAGE_SIZE - 1) / BTL_FLASH_PAGE_SIZE;
+			hi /= BTL_FLASH_PAGE_SIZE;
+		}
+
+		for (; lo < hi; lo++) {
+			n = i * BOOTLOG_AREA_PAGES + lo;
+			if (set)
+				r.dirty[n / 32] |= 1u << (n % 32);
+			else
+				r.dirty[n / 32] &= ~(1u << (n % 32));
+		}
+	}
+
+	/* most packets land on pages already changed */
+	if (!memcmp(r.dirty, bootlog.last.dirty, sizeof(r.dirty)))
+		return 0;
+
+	return bootlog_append(&r);
+}
+
+int bootlog_change(uint32_t addr, uint32_t size)
+{
+	return bootlog_map(addr, size, 1);
+}
+
+int bootlog_sign(uint32_t addr, uint32_t size)
+{
+	return bootlog_map(addr, size, 0);
+}
+
+int bootlog_install(uint32_t digest)
+{
+	struct bootlog_rec r = bootlog.last;
+	unsigned int i, n = BOOTLOG_MAP_WORDS / 2;
+
+	for (i = 0; i < n; i++)
+		r.dirty[i] = r.dirty[n + i];
+
+	r.target = 0;
+	r.progress = BTL_APP_SIZE;
+	r.digest = digest;
+	return bootlog_append(&r);
+}
+
+int bootlog_signed(uint32_t addr)
+{
+	unsigned int n = BOOTLOG_MAP_WORDS / 2;
+	unsigned int i = addr == BTL_FLASH_APP_ADDR ? n : 0;
+
+	for (n += i; i < n; i++) {
+		if (bootlog.last.dirty[i])
+			return 0;
+	}
+	return 1;
+}
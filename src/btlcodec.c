@@ -0,0 +1,202 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Frame codec shared by bootloader and console tool
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "btlcodec.h"
+
+/* CRC covers bytes from cmd on */
+#define BTL_CRC_START		offsetof(btl_packet_t, cmd)
+
+/* crc8_calc() of BTL_CRC_POLY for every byte, one lookup per byte */
+static const uint8_t btl_crc8_tab[256] = {
+	0x00, 0xd5, 0x7f, 0xaa, 0xfe, 0x2b, 0x81, 0x54,
+	0x29, 0xfc, 0x56, 0x83, 0xd7, 0x02, 0xa8, 0x7d,
+	0x52, 0x87, 0x2d, 0xf8, 0xac, 0x79, 0xd3, 0x06,
+	0x7b, 0xae, 0x04, 0xd1, 0x85, 0x50, 0xfa, 0x2f,
+	0xa4, 0x71, 0xdb, 0x0e, 0x5a, 0x8f, 0x25, 0xf0,
+	0x8d, 0x58, 0xf2, 0x27, 0x73, 0xa6, 0x0c, 0xd9,
+	0xf6, 0x23, 0x89, 0x5c, 0x08, 0xdd, 0x77, 0xa2,
+	0xdf, 0x0a, 0xa0, 0x75, 0x21, 0xf4, 0x5e, 0x8b,
+	0x9d, 0x48, 0xe2, 0x37, 0x63, 0xb6, 0x1c, 0xc9,
+	0xb4, 0x61, 0xcb, 0x1e, 0x4a, 0x9f, 0x35, 0xe0,
+	0xcf, 0x1a, 0xb0, 0x65, 0x31, 0xe4, 0x4e, 0x9b,
+	0xe6, 0x33, 0x99, 0x4c, 0x18, 0xcd, 0x67, 0xb2,
+	0x39, 0xec, 0x46, 0x93, 0xc7, 0x12, 0xb8, 0x6d,
+	0x10, 0xc5, 0x6f, 0xba, 0xee, 0x3b, 0x91, 0x44,
+	0x6b, 0xbe, 0x14, 0xc1, 0x95, 0x40, 0xea, 0x3f,
+	0x42, 0x97, 0x3d, 0xe8, 0xbc, 0x69, 0xc3, 0x16,
+	0xef, 0x3a, 0x90, 0x45, 0x11, 0xc4, 0x6e, 0xbb,
+	0xc6, 0x13, 0xb9, 0x6c, 0x38, 0xed, 0x47, 0x92,
+	0xbd, 0x68, 0xc2, 0x17, 0x43, 0x96, 0x3c, 0xe9,
+	0x94, 0x41, 0xeb, 0x3e, 0x6a, 0xbf, 0x15, 0xc0,
+	0x4b, 0x9e, 0x34, 0xe1, 0xb5, 0x60, 0xca, 0x1f,
+	0x62, 0xb7, 0x1d, 0xc8, 0x9c, 0x49, 0xe3, 0x36,
+	0x19, 0xcc, 0x66, 0xb3, 0xe7, 0x32, 0x98, 0x4d,
+	0x30, 0xe5, 0x4f, 0x9a, 0xce, 0x1b, 0xb1, 0x64,
+	0x72, 0xa7, 0x0d, 0xd8, 0x8c, 0x59, 0xf3, 0x26,
+	0x5b, 0x8e, 0x24, 0xf1, 0xa5, 0x70, 0xda, 0x0f,
+	0x20, 0xf5, 0x5f, 0x8a, 0xde, 0x0b, 0xa1, 0x74,
+	0x09, 0xdc, 0x76, 0xa3, 0xf7, 0x22, 0x88, 0x5d,
+	0xd6, 0x03, 0xa9, 0x7c, 0x28, 0xfd, 0x57, 0x82,
+	0xff, 0x2a, 0x80, 0x55, 0x01, 0xd4, 0x7e, 0xab,
+	0x84, 0x51, 0xfb, 0x2e, 0x7a, 0xaf, 0x05, 0xd0,
+	0xad, 0x78, 0xd2, 0x07, 0x53, 0x86, 0x2c, 0xf9,
+};
+
+#define btl_crc8_byte(crc, c)	btl_crc8_tab[(uint8_t)((crc) ^ (c))]
+
+uint8_t btl_crc8(const void *data, unsigned int len)
+{
+	const uint8_t *p = data;
+	uint8_t crc = 0;
+
+	while (len--)
+		crc = btl_crc8_byte(crc, *p++);
+
+	return crc;
+}
+
+int btl_encode(void *buf, uint8_t cmd, uint8_t status, uint32_t addr,
+		const void *data, unsigned int len)
+{
+	btl_packet_t *pkt = buf;
+
+	if (len > BTL_MAX_DATA_SIZE)
+		return -1;
+
+	pkt->prefix = BTL_PKT_PREXIX;
+	pkt->size = len;
+	pkt->cmd = cmd;
+	pkt->status = status;
+	pkt->addr = addr;
+
+	if (data && len && data != pkt->data)
+		memmove(pkt->data, data, len);
+
+	btl_packet_crc(pkt) = btl_crc8(btl_start_crc(pkt), btl_size_crc(pkt));
+	return btl_size_pkt(pkt);
+}
+
+int btl_encode_addr(void *buf, const uint8_t *eui)
+{
+	btl_addr_hdr_t *hdr = buf;
+
+	hdr->prefix = BTL_PKT_ADDR_PREFIX;
+	memcpy(hdr->eui, eui, sizeof(hdr->eui));
+	hdr->crc = btl_crc8(hdr->eui, sizeof(hdr->eui));
+	return BTL_ADDR_HDR_SIZE;
+}
+
+int btl_addr_valid(const void *buf)
+{
+	const btl_addr_hdr_t *hdr = buf;
+
+	return hdr->prefix == BTL_PKT_ADDR_PREFIX &&
+		btl_crc8(hdr->eui, sizeof(hdr->eui)) == hdr->crc;
+}
+
+/*
+ * \brief drop \n bytes in front of buffer and bytes up to the next prefix,
+ *        parsing is restarted
+ */
+static void btl_decode_drop(struct btl_decoder *dec, unsigned int n)
+{
+	const uint8_t *p;
+
+	p = n < dec->len ? memchr(&dec->buf[n], BTL_PKT_PREXIX, dec->len - n) : NULL;
+	if (p) {
+		dec->len -= p - dec->buf;
+		memmove(dec->buf, p, dec->len);
+	} else {
+		dec->len = 0;
+	}
+
+	dec->pos = 0;
+	dec->crc = 0;
+	dec->done = 0;
+}
+
+void btl_decode_put(struct btl_decoder *dec, uint8_t c)
+{
+	if (dec->done)
+		btl_decode_drop(dec, btl_size_pkt(btl_decoder_pkt(dec)));
+
+	/* noise between frames is not buffered */
+	if (dec->len == 0 && c != BTL_PKT_PREXIX)
+		return;
+
+	/* unreachable while events are taken, keeps buffer bound */
+	if (dec->len == sizeof(dec->buf))
+		btl_decode_drop(dec, 1);
+
+	dec->buf[dec->len++] = c;
+}
+
+int btl_decode(struct btl_decoder *dec)
+{
+	btl_packet_t *pkt = btl_decoder_pkt(dec);
+
+	if (dec->done)
+		btl_decode_drop(dec, btl_size_pkt(pkt));
+
+	while (dec->pos < dec->len) {
+		if (dec->pos >= BTL_CRC_START && dec->pos < BTL_HEADER_SIZE + pkt->size)
+			dec->crc = btl_crc8_byte(dec->crc, dec->buf[dec->pos]);
+		dec->pos++;
+
+		if (dec->pos == BTL_HEADER_SIZE && pkt->size > BTL_MAX_DATA_SIZE) {
+			btl_decode_drop(dec, 1);
+			return BTL_DEC_ESIZE;
+		}
+
+		if (dec->pos < BTL_HEADER_SIZE || dec->pos < btl_size_pkt(pkt))
+			continue;
+
+		if (dec->crc != btl_packet_crc(pkt)) {
+			btl_decode_drop(dec, 1);
+			return BTL_DEC_ECRC;
+		}
+
+		dec->done = 1;
+		return BTL_DEC_FRAME;
+	}
+
+	return BTL_DEC_MORE;
+}
+
+int btl_decode_feed(struct btl_decoder *dec, const void *data, unsigned int len,
+		unsigned int *used)
+{
+	const uint8_t *p = data;
+	const uint8_t *end = p + len;
+	int res;
+
+	while ((res = btl_decode(dec)) == BTL_DEC_MORE && p < end) {
+		if (dec->len == 0) {
+			/* hunt for prefix */
+			p = memchr(p, BTL_PKT_PREXIX, end - p);
+			if (!p) {
+				p = end;
+				break;
+			}
+		}
+		btl_decode_put(dec, *p++);
+	}
+
+	*used = p - (const uint8_t *)data;
+	return res;
+}
+
+void btl_decode_skip(struct btl_decoder *dec)
+{
+	if (dec->len)
+		btl_decode_drop(dec, dec->done ? btl_size_pkt(btl_decoder_pkt(dec)) : 1);
+}
@@ -0,0 +1,184 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Protocol of serial port, shared by bootloader and its emulator
+ */
+
+#include <stdint.h>
+
+#include "target.h"
+#include "usart.h"
+#include "btl.h"
+#include "btlport.h"
+
+static RAMFUNC void usart_reply_done(void *arg, usart_frame_t *f)
+{
+	struct boot_port *bp = arg;
+	(void)f;
+
+	bp->reply_busy = 0;
+}
+
+static void usart_reply(struct boot_port *bp, int port, int len)
+{
+	bp->reply.buf = bp->iface.buf;
+	bp->reply.len = len;
+	bp->reply.done = usart_reply_done;
+	bp->reply.arg = bp;
+	bp->reply_busy = 1;
+	usart_write_frame(port, &bp->reply);
+}
+
+static RAMFUNC void usart_data_done(void *arg, usart_frame_t *f)
+{
+	struct boot_data *bd = arg;
+	(void)f;
+
+	bd->busy = 0;
+}
+
+/*
+ * \brief queue DATA frames of streaming read, frames are built in own
+ *        buffers, so packet reception goes on while they are sent.
+ */
+static void usart_data(struct boot_port *bp, int port)
+{
+	struct boot_data *bd;
+	int i, len;
+
+	for (i = 0; i < BTL_PORT_DATA_FRAMES; i++) {
+		bd = &bp->data[i];
+		if (bd->busy)
+			continue;
+
+		if ((len = btl_progress_frame(&bp->iface, bd->buf)) == 0 &&
+		    (len = btl_data_frame(&bp->iface, bd->buf)) == 0 &&
+		    (len = btl_forward_frame(&bp->iface, bd->buf)) == 0)
+			return;
+
+		bd->frame.buf = bd->buf;
+		bd->frame.len = len;
+		bd->frame.done = usart_data_done;
+		bd->frame.arg = bd;
+		bd->busy = 1;
+		usart_write_frame(port, &bd->frame);
+	}
+}
+
+/*
+ * \brief connect downstream port requested by BRIDGE
+ */
+static void usart_bridge_open(struct boot_ports *ports, int port)
+{
+	btl_if_t *bi = &ports->usart[port].iface;
+	int down = port ^ 1;
+
+	bi->br.req = 0;
+	if (bi->br.baud) {
+		/* downstream is flushed before the reply */
+		usart_set_baudrate(down, bi->br.baud);
+		ports->usart[down].baud = usart_get_baudrate(down);
+	}
+
+	if (bi->br.mode == BTL_BRIDGE_RAW) {
+		usart_bridge(port, down);
+		ports->bridge = 1;
+		return;
+	}
+
+	/* downstream bytes are read by FORWARD frames from now on */
+	while (usart_read(down) >= 0)
+		;
+	btl_reset(&ports->usart[down].iface);
+	bi->br.fwd = 1;
+}
+
+void btl_port_handle(struct boot_ports *ports, int port)
+{
+	int len;
+	int err;
+	int c;
+	uint32_t ms = timer_get_ms();
+	struct boot_port *bp = &ports->usart[port];
+
+	/* downstream port of frame bridge */
+	if (ports->usart[port ^ 1].iface.br.fwd)
+		return;
+
+	usart_data(bp, port);
+
+	/* reply is sent from the packet buffer, wait until it is out */
+	if (bp->reply_busy)
+		return;
+
+	c = usart_read(port);
+	if (c < 0 && !btl_pending(&bp->iface)) {
+		btl_idle(&bp->iface);
+
+		if ((ms - bp->last_time) > 1) {
+			/* reset input bytes by 1 mS timeout */
+			bp->last_time = ms;
+			if (bp->iface.dec.len) {
+				bp->iface.stats.timeout++;
+				/* truncated frame of SWRITE sequence */
+				len = btl_nack(&bp->iface);
+				if (len > 0)
+					usart_reply(bp, port, len);
+			}
+			btl_reset(&bp->iface);
+		}
+		return;
+	}
+	if (c >= 0)
+		bp->last_time = ms;
+
+	err = btl_read_byte(&bp->iface, c);
+	if (err == BTL_DEC_ECRC) {
+		/* damaged frame of SWRITE sequence */
+		len = btl_nack(&bp->iface);
+		if (len > 0)
+			usart_reply(bp, port, len);
+		return;
+	}
+
+	if (err != BTL_DEC_FRAME)
+		return;
+
+	/* complete */
+	len = btl_handle_packet(&bp->iface);
+
+	if (bp->iface.br.req && bp->iface.br.baud &&
+	    usart_tx_flush(port ^ 1, USART_TX_TIMEOUT_MS) < 0) {
+		/* downstream is held by flow control, its baud rate is not changed */
+		btl_packet_t *pkt = (btl_packet_t *)bp->iface.buf;
+
+		bp->iface.br.req = 0;
+		len = btl_encode(pkt, pkt->cmd | BTL_PKT_REPLY, BTL_STATUS_ERROR,
+				 pkt->addr, NULL, 0);
+	}
+
+	if (len > 0)
+		usart_reply(bp, port, len);
+
+	if (bp->iface.reset) {
+		/* system reset requested, reply held by flow control longer is lost */
+		usart_tx_flush(port, USART_TX_TIMEOUT_MS);
+		target_reset();
+		return;
+	}
+
+	/* change baud rate requested, not under reply still being sent */
+	if (bp->iface.baud && usart_tx_flush(port, USART_TX_TIMEOUT_MS) == 0)
+		usart_set_baudrate(port, bp->iface.baud);
+
+	/* bridged bytes are queued behind the reply */
+	if (bp->iface.br.req)
+		usart_bridge_open(ports, port);
+
+	bp->iface.baud = 0;
+	bp->iface.reset = 0;
+	btl_next(&bp->iface);
+}
@@ -12,37 +12,70 @@
 #include "btl.h"
 #include "target.h"
 #include "flash.h"
+#include "usart.h"
+#include "profile.h"
+#include "bootlog.h"
+#ifdef BTL_SIGN
+#include "ed25519.h"
+#endif
+#ifdef BTL_ENCRYPT
+#include "aes.h"
+#endif
+
+/* digest computed on one idle call, bytes */
+#define BTL_DIGEST_STEP		256
+/* maximum time to wait for free space in downstream TX queue */
+#define BTL_FORWARD_TIMEOUT_MS	10
+/* downstream port of bridge */
+#define btl_downstream(bi)	((bi)->port ^ 1)
 
-static uint8_t crc8_cal_buf(const void *data, int len)
+/*
+ * Protect bootloader area and spare page of boot journal,
+ * range wrapping past the end of address space overlaps them too
+ */
+static int btl_area(uint32_t addr, uint32_t size)
 {
-	int i;
-	uint8_t crc = 0;
-	const uint8_t *p = data;
+	if (size > UINT32_MAX - addr)
+		return 1;
 
-	for (i = 0; i < len; i++)
-		crc = crc8_calc(crc, *p++, BTL_CRC_POLY);
+	if (addr < BTL_ADDR + BTL_SIZE && addr + size > BTL_ADDR)
+		return 1;
+
+	if (addr < BOOTLOG_SPARE_ADDR + BOOTLOG_SIZE && addr + size > BOOTLOG_SPARE_ADDR)
+		return 1;
 
-	return crc;
+	return 0;
 }
 
-static void btl_make_header(btl_packet_t *pkt, uint8_t status, uint8_t size)
+/*
+ * \brief range lies in application area or in its copy at BTL_FLASH_APP_ADDR
+ */
+static int btl_app_area(uint32_t addr, uint32_t size)
 {
-	pkt->prefix = BTL_PKT_PREXIX;
-	pkt->size = size;
-	pkt->cmd |= BTL_PKT_REPLY;
-	pkt->status = status;
+	if (addr >= BTL_FLASH_APP_ADDR)
+		addr -= BTL_FLASH_APP_ADDR;
+
+	return addr < BTL_APP_SIZE && size <= BTL_APP_SIZE - addr;
 }
 
 /*
- * Protect bootloader area
+ * \brief range lies in main flash, USER_DATA page or bootloader area,
+ *        other addresses may be unmapped
  */
-static int btl_area(uint32_t addr, uint8_t size)
+static int btl_read_area(uint32_t addr, uint32_t size)
 {
-	if (((addr >= BTL_ADDR && (addr + size) < (BTL_ADDR + BTL_SIZE)) ||
-	    ((addr + size) >= BTL_ADDR && (addr + size) < (BTL_ADDR + BTL_SIZE))))
-		return 1;
+	if (size > UINT32_MAX - addr)
+		return 0;
 
-	return 0;
+#ifdef BTL_ENCRYPT
+	/* key of encrypted writes lies in bootloader flash */
+	if (btl_area(addr, size))
+		return 0;
+#endif
+
+	return addr + size <= BTL_FLASH_SIZE ||
+	       (addr >= BOOTLOG_ADDR && addr + size <= BOOTLOG_ADDR + BOOTLOG_SIZE) ||
+	       (addr >= BTL_ADDR && addr + size <= BTL_ADDR + BTL_SIZE);
 }
 
 static uint32_t btl_get_u32(btl_packet_t *pkt)
@@ -51,6 +84,117 @@ static uint32_t btl_get_u32(btl_packet_t *pkt)
 		((uint32_t)pkt->data[2] << 16) | ((uint32_t)pkt->data[3] << 24);
 }
 
+/*
+ * \brief leave CRYPT write mode, data of next session is not
+ *        decrypted by counter block of previous one
+ */
+static void btl_crypt_end(btl_if_t *bi)
+{
+#ifdef BTL_ENCRYPT
+	bi->ec.active = 0;
+#else
+	(void)bi;
+#endif
+}
+
+#ifdef BTL_BUS
+/*
+ * \brief collect address header in front of packet
+ * \return 1 if byte belongs to header
+ */
+static int btl_bus_byte(btl_if_t *bi, uint8_t c)
+{
+	btl_addr_hdr_t *h = (btl_addr_hdr_t *)bi->ahdr;
+	uint64_t id;
+	int i, all = 1, me = 1;
+
+	if (bi->alen == 0 && c != BTL_PKT_ADDR_PREFIX) {
+		bi->to = BTL_TO_NONE;
+		return 0;
+	}
+
+	/* header complete, packet follows */
+	if (bi->alen == BTL_ADDR_HDR_SIZE)
+		return 0;
+
+	bi->ahdr[bi->alen++] = c;
+	if (bi->alen < BTL_ADDR_HDR_SIZE)
+		return 1;
+
+	if (!btl_addr_valid(h)) {
+		bi->alen = 0;
+		return 1;
+	}
+
+	id = taget_get_id();
+	for (i = 0; i < (int)sizeof(h->eui); i++) {
+		if (h->eui[i] != 0xff)
+			all = 0;
+		if (h->eui[i] != (uint8_t)(id >> (8 * i)))
+			me = 0;
+	}
+
+	bi->to = me ? BTL_TO_ME : all ? BTL_TO_ALL : BTL_TO_OTHER;
+	return 1;
+}
+
+/*
+ * \brief bitmap bit of written block, NULL if out of session
+ */
+static uint8_t *btl_bitmap_bit(btl_if_t *bi, uint32_t addr, uint8_t *mask)
+{
+	uint32_t n;
+
+	if (!bi->bm.open || addr < bi->bm.start || addr >= bi->bm.end)
+		return NULL;
+
+	n = (addr - bi->bm.start) / BTL_MAX_DATA_SIZE;
+	*mask = 1 << (n & 7);
+	return &bi->bm.map[n >> 3];
+}
+
+static int btl_cmd_bitmap(btl_if_t *bi)
+{
+	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+	uint32_t len = btl_get_u32(pkt);
+	uint32_t off = pkt->addr;
+
+	if (pkt->size >= 4) {
+		if (len > BTL_BITMAP_RANGE)
+			return -1;
+
+		bi->bm.open = 1;
+		bi->bm.start = pkt->addr;
+		bi->bm.end = pkt->addr + len;
+		memset(bi->bm.map, 0, sizeof(bi->bm.map));
+		return 0;
+	}
+
+	if (off >= BTL_BITMAP_SIZE)
+		return -1;
+
+	len = BTL_BITMAP_SIZE - off;
+	if (len > BTL_MAX_DATA_SIZE)
+		len = BTL_MAX_DATA_SIZE;
+
+	memcpy(pkt->data, &bi->bm.map[off], len);
+	return len;
+}
+#else
+static inline int btl_bus_byte(btl_if_t *bi, uint8_t c)
+{
+	(void)bi;
+	(void)c;
+	return 0;
+}
+
+static int btl_cmd_bitmap(btl_if_t *bi)
+{
+	(void)bi;
+	return -1;
+}
+#endif
+
 /*
  * Command handlers
  */
@@ -59,37 +203,258 @@ static int btl_cmd_info(btl_if_t *bi)
 	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
 	int size = sizeof(BTL_VERSION_STR);
 
+	btl_crypt_end(bi);
 	memcpy(pkt->data, BTL_VERSION_STR, size);
 	return size;
 }
 
+/*
+ * Device EUI48 as little endian u64
+ */
+static int btl_cmd_id(btl_if_t *bi)
+{
+	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+	uint64_t id = taget_get_id();
+
+	/* every session of console tool starts here */
+	btl_crypt_end(bi);
+	memcpy(pkt->data, &id, sizeof(id));
+	return sizeof(id);
+}
+
+/*
+ * Optional payload is u32 length, up to BTL_MAX_DATA_SIZE
+ */
 static int btl_cmd_read(btl_if_t *bi)
 {
 	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
-	return flash_read(pkt->addr, pkt->data, BTL_MAX_DATA_SIZE);
+	uint32_t len = BTL_MAX_DATA_SIZE;
+
+	if (pkt->size >= 4 && btl_get_u32(pkt) < len)
+		len = btl_get_u32(pkt);
+
+	if (!btl_read_area(pkt->addr, len))
+		return -1;
+
+	return flash_read(pkt->addr, pkt->data, len);
+}
+
+static int btl_cmd_sread(btl_if_t *bi)
+{
+	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+	uint32_t len = btl_get_u32(pkt);
+	uint32_t credit;
+
+	memcpy(&credit, &pkt->data[4], sizeof(credit));
+
+	bi->rd.active = len != 0;
+	bi->rd.id = pkt->status;
+	bi->rd.addr = pkt->addr;
+	bi->rd.end = pkt->addr + len;
+	bi->rd.credit = pkt->addr + credit;
+	return 0;
+}
+
+static int btl_cmd_credit(btl_if_t *bi)
+{
+	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+
+	if (bi->rd.active && pkt->status == bi->rd.id)
+		bi->rd.credit = pkt->addr;
+	return 0;
+}
+
+int btl_data_frame(btl_if_t *bi, uint8_t *buf)
+{
+	btl_packet_t *pkt = (btl_packet_t *)buf;
+	uint32_t len = bi->rd.end - bi->rd.addr;
+
+	if (!bi->rd.active || (int32_t)(bi->rd.credit - bi->rd.addr) <= 0)
+		return 0;
+
+	if (len > BTL_MAX_DATA_SIZE)
+		len = BTL_MAX_DATA_SIZE;
+
+	flash_read(bi->rd.addr, pkt->data, len);
+	btl_encode(pkt, BTL_CMD_DATA | BTL_PKT_REPLY, bi->rd.id, bi->rd.addr, pkt->data, len);
+
+	bi->rd.addr += len;
+	if (bi->rd.addr == bi->rd.end)
+		bi->rd.active = 0;
+
+	return btl_size_pkt(pkt);
+}
+
+#ifdef BTL_ENCRYPT
+/* image key, 16 bytes list from Makefile */
+static const uint8_t btl_enc_key[AES_KEY_SIZE] = { BTL_ENC_KEY };
+static struct aes_ctx btl_aes;
+#endif
+
+#ifdef BTL_SIGN
+/* public key of image signer, 32 bytes list from Makefile */
+static const uint8_t btl_sign_key[ED25519_KEY_SIZE] = { BTL_SIGN_KEY };
+#endif
+
+/*
+ * \brief start digest of COMMIT range over from addr
+ */
+static void btl_commit_restart(btl_if_t *bi, uint32_t addr)
+{
+	bi->cm.addr = addr;
+	bi->cm.crc = 0;
+#ifdef BTL_SIGN
+	sha256_init(&bi->cm.sha);
+#endif
+}
+
+/*
+ * \brief open COMMIT session of range
+ */
+static void btl_commit_open(btl_if_t *bi, uint32_t start, uint32_t end)
+{
+	bi->cm.open = 1;
+	bi->cm.start = start;
+	bi->cm.end = end;
+	bi->cm.limit = start;
+	bi->cm.bad = BTL_COMMIT_NO_PAGE;
+	btl_commit_restart(bi, start);
+}
+
+/*
+ * \brief digest next len bytes of COMMIT range
+ */
+static void btl_commit_digest(btl_if_t *bi, uint32_t len)
+{
+	const void *p = (const void *)(uintptr_t)bi->cm.addr;
+
+	bi->cm.crc = crc32_calc(bi->cm.crc, p, len);
+#ifdef BTL_SIGN
+	sha256_update(&bi->cm.sha, p, len);
+#endif
+	bi->cm.addr += len;
+}
+
+/*
+ * \brief account written packet in COMMIT session
+ */
+static void btl_commit_write(btl_if_t *bi, uint32_t addr, const void *data, uint32_t len)
+{
+	uint32_t page = addr & ~(BTL_FLASH_PAGE_SIZE - 1);
+
+	if (!bi->cm.open || addr < bi->cm.start || addr >= bi->cm.end)
+		return;
+
+	if (memcmp((const void *)(uintptr_t)addr, data, len) && page < bi->cm.bad)
+		bi->cm.bad = page;
+
+	/* late packet of page already digested */
+	if (addr < bi->cm.addr)
+		btl_commit_restart(bi, bi->cm.start);
+
+	/* packets of selective repeat may still come one page behind */
+	if (page >= bi->cm.start + BTL_FLASH_PAGE_SIZE &&
+	    page - BTL_FLASH_PAGE_SIZE > bi->cm.limit)
+		bi->cm.limit = page - BTL_FLASH_PAGE_SIZE;
 }
 
 static int btl_cmd_write(btl_if_t *bi)
 {
 	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+#ifdef BTL_BUS
+	uint8_t *bit, mask;
+
+	/* block of broadcast session is written once */
+	bit = btl_bitmap_bit(bi, pkt->addr, &mask);
+	if (bit && (*bit & mask))
+		return 0;
+#endif
+
+#ifdef BTL_ENCRYPT
+	/* in place, next packet is received by interrupt meanwhile */
+	if (bi->ec.active)
+		aes_ctr(&btl_aes, bi->ec.iv, pkt->addr, pkt->data, pkt->size);
+#endif
 
-	if (btl_area(pkt->addr, pkt->size))
+#ifdef BTL_SIGN
+	/* range is not bootable until it is signed again */
+	if (bootlog_change(pkt->addr, pkt->size) < 0)
 		return -1;
+#endif
 
 	if (flash_write(pkt->addr, pkt->data, pkt->size) < 0)
 		return -1;
 
+	btl_commit_write(bi, pkt->addr, pkt->data, pkt->size);
+#ifdef BTL_BUS
+	if (bit)
+		*bit |= mask;
+#endif
 	return 0;
 }
 
-static int btl_cmd_verify(btl_if_t *bi)
+/*
+ * \brief list missing sequence numbers of SWRITE window
+ */
+static int btl_sr_missing(btl_if_t *bi, uint8_t *data)
+{
+	uint8_t n = bi->sr.next - bi->sr.base;
+	int i, sz = 0;
+
+	for (i = 0; i < n; i++) {
+		if (!(bi->sr.rcvd & (1UL << i)))
+			data[sz++] = bi->sr.base + i;
+	}
+	return sz;
+}
+
+static int btl_cmd_swrite(btl_if_t *bi)
 {
-	uint8_t data[BTL_MAX_DATA_SIZE];
 	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+	uint8_t seq = pkt->status;
+	uint8_t d;
+
+	if (pkt->size == 0) {
+		/* open sequence */
+		bi->sr.active = 1;
+		bi->sr.base = seq;
+		bi->sr.next = seq;
+		bi->sr.rcvd = 0;
+		pkt->data[0] = seq;
+		return 1;
+	}
+
+	if (!bi->sr.active)
+		return -1;
 
-	if (btl_area(pkt->addr, pkt->size))
+	d = seq - bi->sr.base;
+	if (d >= BTL_SR_WINDOW && d < 0x80)
 		return -1;
 
+	/* frames behind window and duplicates are acknowledged again */
+	if (d < BTL_SR_WINDOW && !(bi->sr.rcvd & (1UL << d))) {
+		if (btl_cmd_write(bi) < 0)
+			return -1;
+
+		bi->sr.rcvd |= 1UL << d;
+		if (d >= (uint8_t)(bi->sr.next - bi->sr.base))
+			bi->sr.next = seq + 1;
+
+		while (bi->sr.rcvd & 1) {
+			bi->sr.rcvd >>= 1;
+			bi->sr.base++;
+		}
+	}
+
+	pkt->data[0] = seq;
+	return btl_sr_missing(bi, &pkt->data[1]) + 1;
+}
+
+static int btl_cmd_verify(btl_if_t *bi)
+{
+	uint8_t data[BTL_MAX_DATA_SIZE];
+	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+
 	if (flash_read(pkt->addr, data, pkt->size) < 0)
 		return -1;
 
@@ -99,22 +464,259 @@ static int btl_cmd_verify(btl_if_t *bi)
 	return 0;
 }
 
+/*
+ * \brief account erased range in COMMIT session
+ */
+static void btl_erased(btl_if_t *bi, uint32_t addr, uint32_t size)
+{
+	/* digest of COMMIT session covers erased pages */
+	if (addr < bi->cm.addr && addr + size > bi->cm.start)
+		btl_commit_restart(bi, bi->cm.start);
+}
+
 static int btl_cmd_erase(btl_if_t *bi)
 {
 	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
 	uint32_t size = btl_get_u32(pkt);
+	uint32_t step;
 
-	if (size == 0)
-		return 0;
+	if (size == 0) {
+		/* cancel background erase */
+		bi->er.active = 0;
+		memcpy(pkt->data, &bi->er.addr, sizeof(bi->er.addr));
+		return sizeof(bi->er.addr);
+	}
 
-	if (btl_area(pkt->addr, size))
+#ifdef BTL_SIGN
+	/* repeated request finds its pages changed already */
+	if (bootlog_change(pkt->addr, size) < 0)
 		return -1;
+#endif
+
+	/* broadcast erase is not reported */
+	if (pkt->size >= 8 && bi->to != BTL_TO_ALL) {
+		memcpy(&step, &pkt->data[4], sizeof(step));
+		if (!step)
+			return -1;
+
+		if (bi->er.active) {
+			/* reply was lost and request is sent again, erase goes on */
+			if (pkt->addr == bi->er.start && pkt->addr + size == bi->er.end)
+				return 0;
+			return -1;
+		}
+
+		bi->er.active = 1;
+		bi->er.start = pkt->addr;
+		bi->er.addr = pkt->addr & ~(BTL_FLASH_PAGE_SIZE - 1);
+		bi->er.end = pkt->addr + size;
+		bi->er.step = step;
+		bi->er.count = 0;
+		bi->er.report = 0;
+		bi->er.err = 0;
+		return 0;
+	}
 
 	if (flash_erase(pkt->addr, size) < 0)
 		return -1;
 
+	btl_erased(bi, pkt->addr, size);
+	return 0;
+}
+
+/*
+ * \brief erase next page of background erase
+ */
+static void btl_erase_step(btl_if_t *bi)
+{
+	if (flash_erase(bi->er.addr, BTL_FLASH_PAGE_SIZE) < 0) {
+		bi->er.err = 1;
+		bi->er.active = 0;
+		bi->er.report = 1;
+		return;
+	}
+
+	btl_erased(bi, bi->er.addr, BTL_FLASH_PAGE_SIZE);
+	bi->er.addr += BTL_FLASH_PAGE_SIZE;
+
+	if (bi->er.addr >= bi->er.end) {
+		bi->er.active = 0;
+		bi->er.report = 1;
+	} else if (++bi->er.count == bi->er.step) {
+		bi->er.count = 0;
+		bi->er.report = 1;
+	}
+}
+
+int btl_progress_frame(btl_if_t *bi, uint8_t *buf)
+{
+	btl_packet_t *pkt = (btl_packet_t *)buf;
+	uint32_t left = 0;
+
+	if (!bi->er.report)
+		return 0;
+	bi->er.report = 0;
+
+	if (bi->er.addr < bi->er.end)
+		left = bi->er.end - bi->er.addr;
+
+	return btl_encode(pkt, BTL_CMD_PROGRESS | BTL_PKT_REPLY,
+			bi->er.err ? BTL_STATUS_ERROR : BTL_STATUS_OK,
+			bi->er.addr, &left, sizeof(left));
+}
+
+/*
+ * CRC-32 of flash range, size in payload
+ */
+static int btl_cmd_digest(btl_if_t *bi)
+{
+	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+	uint32_t size = btl_get_u32(pkt);
+	uint32_t crc;
+
+	/* main loop is not held for longer than a page */
+	if (size > BTL_DIGEST_MAX)
+		return -1;
+
+	crc = crc32_calc(0, (const void *)(uintptr_t)pkt->addr, size);
+	memcpy(pkt->data, &crc, sizeof(crc));
+	return sizeof(crc);
+}
+
+#ifdef BTL_ENCRYPT
+static int btl_cmd_crypt(btl_if_t *bi)
+{
+	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+
+	if (pkt->size == 0) {
+		btl_crypt_end(bi);
+		return 0;
+	}
+
+	if (pkt->size != BTL_CRYPT_IV_SIZE)
+		return -1;
+
+	aes_init(&btl_aes, btl_enc_key);
+	memcpy(bi->ec.iv, pkt->data, BTL_CRYPT_IV_SIZE);
+	bi->ec.active = 1;
 	return 0;
 }
+#else
+static int btl_cmd_crypt(btl_if_t *bi)
+{
+	(void)bi;
+	return -1;
+}
+#endif
+
+#ifdef BTL_SIGN
+static int btl_cmd_sign(btl_if_t *bi)
+{
+	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+
+	memcpy(bi->sg.sig, pkt->data, BTL_SIGN_SIZE);
+	bi->sg.addr = pkt->addr;
+	bi->sg.valid = 1;
+	return 0;
+}
+
+/*
+ * \brief finish SHA-256 of COMMIT range and check its signature
+ * \return 0 if signature is valid
+ */
+static int btl_commit_verify(btl_if_t *bi, uint32_t start, uint32_t end)
+{
+	struct btl_sign_msg_s msg;
+	int valid = bi->sg.valid && bi->sg.addr == start;
+
+	msg.addr = start;
+	msg.size = end - start;
+	sha256_final(&bi->cm.sha, msg.digest);
+
+	bi->sg.valid = 0;
+	if (!valid)
+		return -1;
+
+	return ed25519_verify(bi->sg.sig, btl_sign_key, &msg, sizeof(msg));
+}
+#else
+static int btl_cmd_sign(btl_if_t *bi)
+{
+	(void)bi;
+	return -1;
+}
+#endif
+
+static int btl_cmd_commit(btl_if_t *bi)
+{
+	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+	struct btl_commit_s *cm = (struct btl_commit_s *)pkt->data;
+	uint32_t end = pkt->addr + btl_get_u32(pkt);
+	uint32_t crc;
+
+	if (pkt->size == 4) {
+		btl_commit_open(bi, pkt->addr, end);
+		return 0;
+	}
+
+	if (pkt->size < 8)
+		return -1;
+
+	memcpy(&crc, &pkt->data[4], sizeof(crc));
+
+	/* range of no session is digested from its start */
+	if (!bi->cm.open || pkt->addr != bi->cm.start || end != bi->cm.end)
+		btl_commit_open(bi, pkt->addr, end);
+
+	/* the whole range is written, the rest is digested while line is idle */
+	bi->cm.limit = end;
+	if (end - bi->cm.addr > BTL_DIGEST_MAX) {
+		cm->result = BTL_COMMIT_BUSY;
+		cm->crc = 0;
+		cm->page = bi->cm.addr;
+		return sizeof(struct btl_commit_s);
+	}
+
+	btl_commit_digest(bi, end - bi->cm.addr);
+	bi->cm.open = 0;
+	/* ranges are written before they are committed */
+	btl_crypt_end(bi);
+
+	cm->result = (bi->cm.crc == crc && bi->cm.bad == BTL_COMMIT_NO_PAGE) ?
+		BTL_COMMIT_PASS : BTL_COMMIT_FAIL;
+#ifdef BTL_SIGN
+	/* unauthenticated range is not left bootable */
+	if (cm->result == BTL_COMMIT_PASS && btl_commit_verify(bi, pkt->addr, end) < 0) {
+		cm->result = BTL_COMMIT_SIGN;
+		flash_erase(pkt->addr & ~(BTL_FLASH_PAGE_SIZE - 1), BTL_FLASH_PAGE_SIZE);
+	} else if (cm->result == BTL_COMMIT_PASS &&
+		   bootlog_sign(pkt->addr, end - pkt->addr) < 0) {
+		cm->result = BTL_COMMIT_FAIL;
+	}
+#endif
+	cm->crc = bi->cm.crc;
+	cm->page = bi->cm.bad;
+	return sizeof(struct btl_commit_s);
+}
+
+void btl_idle(btl_if_t *bi)
+{
+	uint32_t len = bi->cm.limit - bi->cm.addr;
+
+	/* one page at a time, frames go out between pages */
+	if (bi->er.active && !bi->er.report) {
+		btl_erase_step(bi);
+		return;
+	}
+
+	if (!bi->cm.open || bi->cm.limit <= bi->cm.addr)
+		return;
+
+	if (len > BTL_DIGEST_STEP)
+		len = BTL_DIGEST_STEP;
+
+	btl_commit_digest(bi, len);
+}
 
 static int btl_cmd_baud(btl_if_t *bi)
 {
@@ -134,85 +736,235 @@ static int btl_cmd_baud(btl_if_t *bi)
 		default:
 			return -1;
 	}
+
+	/* applied after reply is sent */
+	bi->baud = baud;
 	return 0;
 }
 
+static int btl_cmd_stats(btl_if_t *bi)
+{
+	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+	struct btl_stats_s *st = (struct btl_stats_s *)pkt->data;
+	int clear = pkt->addr & BTL_STATS_CLEAR;
+	struct usart_stats us;
+	struct flash_stats fs;
+
+	usart_get_stats(bi->port, &us, clear);
+	flash_get_stats(&fs, clear);
+
+	st->rx_bytes = us.rx_bytes;
+	st->tx_bytes = us.tx_bytes;
+	st->frames = bi->stats.frames;
+	st->crc_err = bi->stats.crc_err;
+	st->size_err = bi->stats.size_err;
+	st->timeout = bi->stats.timeout;
+	st->rx_overrun = us.rx_overrun;
+	st->rx_drop = us.rx_drop;
+	st->tx_drop = us.tx_drop;
+	st->erase_time = fs.erase_time;
+	st->erase_max = fs.erase_max;
+	st->write_time = fs.write_time;
+	st->write_max = fs.write_max;
+	st->write_rate = fs.write_time ?
+		(uint32_t)((uint64_t)fs.write_bytes * 1000 / fs.write_time) : 0;
+
+	if (clear)
+		memset(&bi->stats, 0, sizeof(bi->stats));
+
+	return sizeof(struct btl_stats_s);
+}
+
+static int btl_cmd_profile(btl_if_t *bi)
+{
+	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+
+	return prof_get(pkt->addr & ~BTL_PROF_CLEAR,
+			(struct btl_prof_s *)pkt->data,
+			!!(pkt->addr & BTL_PROF_CLEAR));
+}
+
+static int btl_cmd_bridge(btl_if_t *bi)
+{
+	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+
+	if (pkt->data[0] > BTL_BRIDGE_FRAME)
+		return -1;
+
+	bi->br.req = 1;
+	bi->br.mode = pkt->data[0];
+	bi->br.baud = pkt->addr;
+	return 0;
+}
+
+static int btl_cmd_forward(btl_if_t *bi)
+{
+	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+
+	if (bi->br.fwd)
+		usart_write_buf_timeout(btl_downstream(bi), pkt->data, pkt->size,
+				BTL_FORWARD_TIMEOUT_MS);
+	return 0;
+}
+
+int btl_forward_frame(btl_if_t *bi, uint8_t *buf)
+{
+	btl_packet_t *pkt = (btl_packet_t *)buf;
+	int len;
+
+	if (!bi->br.fwd)
+		return 0;
+
+	len = usart_read_buf(btl_downstream(bi), pkt->data, BTL_MAX_DATA_SIZE);
+	if (len <= 0)
+		return 0;
+
+	return btl_encode(pkt, BTL_CMD_FORWARD | BTL_PKT_REPLY, BTL_STATUS_OK, 0,
+			pkt->data, len);
+}
+
 static int btl_cmd_reset(btl_if_t *bi)
 {
 	bi->reset = 1;
 	return 0;
 }
 
-int btl_handle_packet(btl_if_t *bi)
+int btl_nack(btl_if_t *bi)
 {
 	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
-	uint8_t crc = crc8_cal_buf(btl_start_crc(pkt), btl_size_crc(pkt));
-	int sz = -1;
+	int sz;
+
+	if (!bi->sr.active || bi->to == BTL_TO_ALL || bi->to == BTL_TO_OTHER)
+		return 0;
+
+	sz = btl_sr_missing(bi, pkt->data);
+	pkt->data[sz++] = bi->sr.next;
+
+	return btl_encode(pkt, BTL_CMD_NACK | BTL_PKT_REPLY, BTL_STATUS_OK, 0,
+			pkt->data, sz);
+}
+
+#define BTL_CMD_HANDLER(name, handler, op, ...) \
+	[btl_cmd_slot(op)] = btl_cmd_##handler,
+
+static const struct btl_cmd_desc btl_cmds[BTL_CMD_SLOTS] = {
+	BTL_COMMANDS(BTL_CMD_DESC)
+};
 
-	if (crc != btl_packet_crc(pkt))
+static int (*const btl_handlers[BTL_CMD_SLOTS])(btl_if_t *bi) = {
+	BTL_COMMANDS(BTL_CMD_HANDLER)
+};
+
+/*
+ * \brief payload and address rules of command table
+ */
+static int btl_check(const struct btl_cmd_desc *d, btl_packet_t *pkt)
+{
+	if (pkt->size < d->min || pkt->size > d->max)
 		return -1;
 
-	switch (pkt->cmd) {
-		case BTL_CMD_INFO:
-			sz = btl_cmd_info(bi);
-			break;
-		case BTL_CMD_READ:
-			sz = btl_cmd_read(bi);
-			break;
-		case BTL_CMD_WRITE:
-			sz = btl_cmd_write(bi);
-			break;
-		case BTL_CMD_ERASE:
-			sz = btl_cmd_erase(bi);
-			break;
-		case BTL_CMD_VERIFY:
-			sz = btl_cmd_verify(bi);
-			break;
-		case BTL_CMD_RESET:
-			sz = btl_cmd_reset(bi);
-			break;
-		case BTL_CMD_BAUD:
-			sz = btl_cmd_baud(bi);
-			break;
+	switch (d->check) {
+		case BTL_CHECK_DATA:
+			return btl_area(pkt->addr, pkt->size) ? -1 : 0;
+		case BTL_CHECK_LEN:
+			return btl_area(pkt->addr, btl_get_u32(pkt)) ? -1 : 0;
+		case BTL_CHECK_APP:
+			return btl_app_area(pkt->addr, btl_get_u32(pkt)) ? 0 : -1;
+		case BTL_CHECK_READ:
+			return btl_read_area(pkt->addr, btl_get_u32(pkt)) ? 0 : -1;
 		default:
-			break;
+			return 0;
 	}
-
-	if (sz < 0)
-		btl_make_header(pkt, BTL_STATUS_ERROR, 0);
-	else
-		btl_make_header(pkt, BTL_STATUS_OK, sz);
-
-	btl_packet_crc(pkt) = crc8_cal_buf(btl_start_crc(pkt), btl_size_crc(pkt));
-	return btl_size_pkt(pkt);
 }
 
-int btl_read_byte(btl_if_t *bi, char c)
+static int btl_packet(btl_if_t *bi)
 {
 	btl_packet_t *pkt = (btl_packet_t *)bi->buf;
+	const struct btl_cmd_desc *d;
+	int flags, sz = -1;
 
-	bi->buf[bi->len++] = c;
-
-	if (bi->len == 1) {
-		/* prefix */
-		if (c != BTL_PKT_PREXIX)
-			bi->len = 0;
+	/* packet of other device on bus */
+	if (bi->to == BTL_TO_OTHER)
 		return 0;
+
+	bi->stats.frames++;
+
+	d = btl_cmd_find(btl_cmds, pkt->cmd);
+	flags = d ? d->flags : 0;
+
+	/* streams are closed by any other command */
+	if (!(flags & BTL_CF_SR))
+		bi->sr.active = 0;
+	if (!(flags & BTL_CF_RD))
+		bi->rd.active = 0;
+	if (!(flags & BTL_CF_FWD))
+		bi->br.fwd = 0;
+
+	if (d && btl_check(d, pkt) == 0) {
+		sz = btl_handlers[btl_cmd_slot(pkt->cmd)](bi);
+		if (sz > d->reply)
+			sz = -1;
 	}
 
-	if (bi->len < sizeof(btl_packet_t)) /* header */
+	/* flow control and bridged data */
+	if (flags & BTL_CF_NOREPLY)
 		return 0;
 
-	if (pkt->size > BTL_MAX_DATA_SIZE) {
-		/* Invalid packet size */
-		bi->len = 0;
+	/* broadcast is not answered */
+	if (bi->to == BTL_TO_ALL)
 		return 0;
+
+	if (sz < 0)
+		return btl_encode(pkt, pkt->cmd | BTL_PKT_REPLY, BTL_STATUS_ERROR,
+				pkt->addr, NULL, 0);
+
+	return btl_encode(pkt, pkt->cmd | BTL_PKT_REPLY, BTL_STATUS_OK,
+			pkt->addr, pkt->data, sz);
+}
+
+static int btl_parse_byte(btl_if_t *bi, int c)
+{
+	int res;
+
+	if (c < 0)
+		res = btl_decode(&bi->dec);
+	else if (bi->dec.len == 0 && btl_bus_byte(bi, c))
+		return BTL_DEC_MORE;
+	else
+		res = btl_decode_byte(&bi->dec, c);
+
+	switch (res) {
+		case BTL_DEC_FRAME:
+			memcpy(bi->buf, bi->dec.buf, btl_size_pkt(btl_decoder_pkt(&bi->dec)));
+			break;
+		case BTL_DEC_ESIZE:
+			bi->stats.size_err++;
+			/* address header of dropped frame */
+			bi->alen = 0;
+			break;
+		case BTL_DEC_ECRC:
+			bi->stats.crc_err++;
+			bi->alen = 0;
+			break;
 	}
+	return res;
+}
 
-	if (bi->len < btl_size_pkt(pkt))
-		return 0;
+int btl_handle_packet(btl_if_t *bi)
+{
+	PROF_START(t);
+	int len = btl_packet(bi);
 
-	/* packet complete */
-	return 1;
+	PROF_END(BTL_PROF_PACKET, t);
+	return len;
+}
+
+int btl_read_byte(btl_if_t *bi, int c)
+{
+	PROF_START(t);
+	int err = btl_parse_byte(bi, c);
+
+	PROF_END(BTL_PROF_READ_BYTE, t);
+	return err;
 }
 
@@ -0,0 +1,582 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Ed25519 signatures, small and slow field arithmetic of TweetNaCl
+ * with 16 limbs of 16 bits. Signing is only linked into host tool.
+ */
+
+#include <string.h>
+
+#include "ed25519.h"
+
+/*
+ * SHA-512, used by Ed25519 on short messages only
+ */
+struct sha512_ctx {
+	uint64_t state[8];
+	uint8_t buf[128];
+	uint32_t len;
+};
+
+static const uint64_t sha512_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL,
+	0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+	0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+	0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL,
+	0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+	0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL,
+	0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL,
+	0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+	0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL,
+	0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL,
+	0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+	0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL,
+	0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+	0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+	0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL,
+	0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL,
+	0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+	0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+	0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL,
+	0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+	0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+#define ror64(x, n)	(((x) >> (n)) | ((x) << (64 - (n))))
+
+static void sha512_block(uint64_t *state, const uint8_t *p)
+{
+	uint64_t w[80], s[8], t1, t2;
+	int i, j;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = 0;
+		for (j = 0; j < 8; j++)
+			w[i] = w[i] << 8 | *p++;
+	}
+	for (; i < 80; i++) {
+		t1 = ror64(w[i - 2], 19) ^ ror64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+		t2 = ror64(w[i - 15], 1) ^ ror64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+		w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+	}
+
+	memcpy(s, state, sizeof(s));
+	for (i = 0; i < 80; i++) {
+		t1 = s[7] + (ror64(s[4], 14) ^ ror64(s[4], 18) ^ ror64(s[4], 41)) +
+			((s[4] & s[5]) ^ (~s[4] & s[6])) + sha512_k[i] + w[i];
+		t2 = (ror64(s[0], 28) ^ ror64(s[0], 34) ^ ror64(s[0], 39)) +
+			((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(&s[1], &s[0], 7 * sizeof(s[0]));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++)
+		state[i] += s[i];
+}
+
+static void sha512_init(struct sha512_ctx *ctx)
+{
+	static const uint64_t init[8] = {
+		0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+		0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+		0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+		0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+	};
+
+	memcpy(ctx->state, init, sizeof(ctx->state));
+	ctx->len = 0;
+}
+
+static void sha512_update(struct sha512_ctx *ctx, const void *data, uint32_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		ctx->buf[ctx->len++ % sizeof(ctx->buf)] = *p++;
+		if (ctx->len % sizeof(ctx->buf) == 0)
+			sha512_block(ctx->state, ctx->buf);
+	}
+}
+
+static void sha512_final(struct sha512_ctx *ctx, uint8_t *digest)
+{
+	uint64_t bits = (uint64_t)ctx->len * 8;
+	uint32_t used = ctx->len % sizeof(ctx->buf);
+	int i;
+
+	ctx->buf[used++] = 0x80;
+	if (used > sizeof(ctx->buf) - 16) {
+		memset(ctx->buf + used, 0, sizeof(ctx->buf) - used);
+		sha512_block(ctx->state, ctx->buf);
+		used = 0;
+	}
+	memset(ctx->buf + used, 0, sizeof(ctx->buf) - used);
+	for (i = 0; i < 8; i++)
+		ctx->buf[sizeof(ctx->buf) - 1 - i] = bits >> (i * 8);
+	sha512_block(ctx->state, ctx->buf);
+
+	for (i = 0; i < 64; i++)
+		digest[i] = ctx->state[i / 8] >> (56 - 8 * (i % 8));
+}
+
+/*
+ * GF(2^255 - 19) elements, 16 signed limbs of 16 bits
+ */
+typedef int64_t gf[16];
+
+static const gf gf0;
+static const gf gf1 = { 1 };
+/* -121665 / 121666 */
+static const gf gf_d = {
+	0x78a3, 0x1359, 0x4dca, 0x75eb, 0xd8ab, 0x4141, 0x0a4d, 0x0070,
+	0xe898, 0x7779, 0x4079, 0x8cc7, 0xfe73, 0x2b6f, 0x6cee, 0x5203,
+};
+static const gf gf_d2 = {
+	0xf159, 0x26b2, 0x9b94, 0xebd6, 0xb156, 0x8283, 0x149a, 0x00e0,
+	0xd130, 0xeef3, 0x80f2, 0x198e, 0xfce7, 0x56df, 0xd9dc, 0x2406,
+};
+/* sqrt(-1) */
+static const gf gf_i = {
+	0xa0b0, 0x4a0e, 0x1b27, 0xc4ee, 0xe478, 0xad2f, 0x1806, 0x2f43,
+	0xd7a7, 0x3dfb, 0x0099, 0x2b4d, 0xdf0b, 0x4fc1, 0x2480, 0x2b83,
+};
+/* base point */
+static const gf gf_x = {
+	0xd51a, 0x8f25, 0x2d60, 0xc956, 0xa7b2, 0x9525, 0xc760, 0x692c,
+	0xdc5c, 0xfdd6, 0xe231, 0xc0a4, 0x53fe, 0xcd6e, 0x36d3, 0x2169,
+};
+static const gf gf_y = {
+	0x6658, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+	0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+};
+
+/* group order L */
+static const int64_t ed_l[32] = {
+	0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58,
+	0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0x10,
+};
+
+static void gf_set(gf r, const gf a)
+{
+	memcpy(r, a, sizeof(gf));
+}
+
+static void gf_carry(gf o)
+{
+	int64_t c;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		o[i] += (int64_t)1 << 16;
+		c = o[i] >> 16;
+		if (i < 15)
+			o[i + 1] += c - 1;
+		else
+			o[0] += 38 * (c - 1);
+		o[i] -= c << 16;
+	}
+}
+
+/* swap p and q if b is 1, without branch */
+static void gf_swap(gf p, gf q, int b)
+{
+	int64_t t, c = ~(b - 1);
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		t = c & (p[i] ^ q[i]);
+		p[i] ^= t;
+		q[i] ^= t;
+	}
+}
+
+static void gf_pack(uint8_t *o, const gf n)
+{
+	gf m, t;
+	int i, j, b;
+
+	gf_set(t, n);
+	gf_carry(t);
+	gf_carry(t);
+	gf_carry(t);
+	for (j = 0; j < 2; j++) {
+		m[0] = t[0] - 0xffed;
+		for (i = 1; i < 15; i++) {
+			m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+			m[i - 1] &= 0xffff;
+		}
+		m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+		b = (m[15] >> 16) & 1;
+		m[14] &= 0xffff;
+		gf_swap(t, m, 1 - b);
+	}
+	for (i = 0; i < 16; i++) {
+		o[2 * i] = t[i] & 0xff;
+		o[2 * i + 1] = t[i] >> 8;
+	}
+}
+
+static void gf_unpack(gf o, const uint8_t *n)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		o[i] = n[2 * i] + ((int64_t)n[2 * i + 1] << 8);
+	o[15] &= 0x7fff;
+}
+
+static int gf_neq(const gf a, const gf b)
+{
+	uint8_t c[32], d[32];
+
+	gf_pack(c, a);
+	gf_pack(d, b);
+	return memcmp(c, d, sizeof(c)) != 0;
+}
+
+static int gf_parity(const gf a)
+{
+	uint8_t d[32];
+
+	gf_pack(d, a);
+	return d[0] & 1;
+}
+
+static void gf_add(gf o, const gf a, const gf b)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		o[i] = a[i] + b[i];
+}
+
+static void gf_sub(gf o, const gf a, const gf b)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		o[i] = a[i] - b[i];
+}
+
+static void gf_mul(gf o, const gf a, const gf b)
+{
+	int64_t t[31];
+	int i, j;
+
+	memset(t, 0, sizeof(t));
+	for (i = 0; i < 16; i++) {
+		for (j = 0; j < 16; j++)
+			t[i + j] += a[i] * b[j];
+	}
+	for (i = 0; i < 15; i++)
+		t[i] += 38 * t[i + 16];
+	memcpy(o, t, sizeof(gf));
+	gf_carry(o);
+	gf_carry(o);
+}
+
+static void gf_sqr(gf o, const gf a)
+{
+	gf_mul(o, a, a);
+}
+
+/* a^(p - 2) */
+static void gf_inv(gf o, const gf a)
+{
+	gf c;
+	int i;
+
+	gf_set(c, a);
+	for (i = 253; i >= 0; i--) {
+		gf_sqr(c, c);
+		if (i != 2 && i != 4)
+			gf_mul(c, c, a);
+	}
+	gf_set(o, c);
+}
+
+/* a^((p - 5) / 8) */
+static void gf_pow2523(gf o, const gf a)
+{
+	gf c;
+	int i;
+
+	gf_set(c, a);
+	for (i = 250; i >= 0; i--) {
+		gf_sqr(c, c);
+		if (i != 1)
+			gf_mul(c, c, a);
+	}
+	gf_set(o, c);
+}
+
+/*
+ * Points in extended coordinates X, Y, Z, T
+ */
+static void ed_add(gf p[4], gf q[4])
+{
+	gf a, b, c, d, t, e, f, g, h;
+
+	gf_sub(a, p[1], p[0]);
+	gf_sub(t, q[1], q[0]);
+	gf_mul(a, a, t);
+	gf_add(b, p[0], p[1]);
+	gf_add(t, q[0], q[1]);
+	gf_mul(b, b, t);
+	gf_mul(c, p[3], q[3]);
+	gf_mul(c, c, gf_d2);
+	gf_mul(d, p[2], q[2]);
+	gf_add(d, d, d);
+	gf_sub(e, b, a);
+	gf_sub(f, d, c);
+	gf_add(g, d, c);
+	gf_add(h, b, a);
+
+	gf_mul(p[0], e, f);
+	gf_mul(p[1], h, g);
+	gf_mul(p[2], g, f);
+	gf_mul(p[3], e, h);
+}
+
+static void ed_swap(gf p[4], gf q[4], int b)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		gf_swap(p[i], q[i], b);
+}
+
+static void ed_pack(uint8_t *r, gf p[4])
+{
+	gf tx, ty, zi;
+
+	gf_inv(zi, p[2]);
+	gf_mul(tx, p[0], zi);
+	gf_mul(ty, p[1], zi);
+	gf_pack(r, ty);
+	r[31] ^= gf_parity(tx) << 7;
+}
+
+/* p = s * q, q is destroyed */
+static void ed_scalarmult(gf p[4], gf q[4], const uint8_t *s)
+{
+	int i, b;
+
+	gf_set(p[0], gf0);
+	gf_set(p[1], gf1);
+	gf_set(p[2], gf1);
+	gf_set(p[3], gf0);
+	for (i = 255; i >= 0; i--) {
+		b = (s[i / 8] >> (i & 7)) & 1;
+		ed_swap(p, q, b);
+		ed_add(q, p);
+		ed_add(p, p);
+		ed_swap(p, q, b);
+	}
+}
+
+static void ed_scalarbase(gf p[4], const uint8_t *s)
+{
+	gf q[4];
+
+	gf_set(q[0], gf_x);
+	gf_set(q[1], gf_y);
+	gf_set(q[2], gf1);
+	gf_mul(q[3], gf_x, gf_y);
+	ed_scalarmult(p, q, s);
+}
+
+/* decode point and negate it */
+static int ed_unpackneg(gf r[4], const uint8_t *p)
+{
+	gf t, chk, num, den, den2, den4, den6;
+
+	gf_set(r[2], gf1);
+	gf_unpack(r[1], p);
+	gf_sqr(num, r[1]);
+	gf_mul(den, num, gf_d);
+	gf_sub(num, num, r[2]);
+	gf_add(den, r[2], den);
+
+	gf_sqr(den2, den);
+	gf_sqr(den4, den2);
+	gf_mul(den6, den4, den2);
+	gf_mul(t, den6, num);
+	gf_mul(t, t, den);
+
+	gf_pow2523(t, t);
+	gf_mul(t, t, num);
+	gf_mul(t, t, den);
+	gf_mul(t, t, den);
+	gf_mul(r[0], t, den);
+
+	gf_sqr(chk, r[0]);
+	gf_mul(chk, chk, den);
+	if (gf_neq(chk, num))
+		gf_mul(r[0], r[0], gf_i);
+
+	gf_sqr(chk, r[0]);
+	gf_mul(chk, chk, den);
+	if (gf_neq(chk, num))
+		return -1;
+
+	if (gf_parity(r[0]) == (p[31] >> 7))
+		gf_sub(r[0], gf0, r[0]);
+
+	gf_mul(r[3], r[0], r[1]);
+	return 0;
+}
+
+/* r = x mod L, x is destroyed */
+static void ed_mod_l(uint8_t *r, int64_t x[64])
+{
+	int64_t carry;
+	int i, j;
+
+	for (i = 63; i >= 32; i--) {
+		carry = 0;
+		for (j = i - 32; j < i - 12; j++) {
+			x[j] += carry - 16 * x[i] * ed_l[j - (i - 32)];
+			carry = (x[j] + 128) >> 8;
+			x[j] -= carry * 256;
+		}
+		x[j] += carry;
+		x[i] = 0;
+	}
+	carry = 0;
+	for (j = 0; j < 32; j++) {
+		x[j] += carry - (x[31] >> 4) * ed_l[j];
+		carry = x[j] >> 8;
+		x[j] &= 255;
+	}
+	for (j = 0; j < 32; j++)
+		x[j] -= carry * ed_l[j];
+	for (i = 0; i < 32; i++) {
+		x[i + 1] += x[i] >> 8;
+		r[i] = x[i] & 255;
+	}
+}
+
+static void ed_reduce(uint8_t *r)
+{
+	int64_t x[64];
+	int i;
+
+	for (i = 0; i < 64; i++)
+		x[i] = r[i];
+	memset(r, 0, 64);
+	ed_mod_l(r, x);
+}
+
+/* h = SHA-512(a | b | msg) mod L */
+static void ed_hash(uint8_t *h, const uint8_t *a, const uint8_t *b,
+		    const void *msg, uint32_t len)
+{
+	struct sha512_ctx ctx;
+
+	sha512_init(&ctx);
+	sha512_update(&ctx, a, 32);
+	if (b)
+		sha512_update(&ctx, b, 32);
+	sha512_update(&ctx, msg, len);
+	sha512_final(&ctx, h);
+	ed_reduce(h);
+}
+
+int ed25519_verify(const uint8_t *sig, const uint8_t *pub,
+		   const void *msg, uint32_t len)
+{
+	uint8_t h[64], t[32];
+	gf p[4], q[4];
+
+	/* S must be below L */
+	if (sig[63] & 0xe0)
+		return -1;
+
+	if (ed_unpackneg(q, pub))
+		return -1;
+
+	ed_hash(h, sig, pub, msg, len);
+	ed_scalarmult(p, q, h);
+	ed_scalarbase(q, sig + 32);
+	ed_add(p, q);
+	ed_pack(t, p);
+
+	return memcmp(sig, t, sizeof(t)) ? -1 : 0;
+}
+
+/* clamped scalar and prefix of secret seed */
+static void ed_expand(uint8_t *d, const uint8_t *seed)
+{
+	struct sha512_ctx ctx;
+
+	sha512_init(&ctx);
+	sha512_update(&ctx, seed, ED25519_KEY_SIZE);
+	sha512_final(&ctx, d);
+	d[0] &= 248;
+	d[31] &= 127;
+	d[31] |= 64;
+}
+
+void ed25519_public(uint8_t *pub, const uint8_t *seed)
+{
+	uint8_t d[64];
+	gf p[4];
+
+	ed_expand(d, seed);
+	ed_scalarbase(p, d);
+	ed_pack(pub, p);
+}
+
+void ed25519_sign(uint8_t *sig, const uint8_t *seed,
+		  const void *msg, uint32_t len)
+{
+	uint8_t d[64], r[64], h[64], pub[32];
+	int64_t x[64];
+	gf p[4];
+	int i, j;
+
+	ed_expand(d, seed);
+	ed_scalarbase(p, d);
+	ed_pack(pub, p);
+
+	/* r = H(prefix | msg) */
+	ed_hash(r, d + 32, NULL, msg, len);
+	ed_scalarbase(p, r);
+	ed_pack(sig, p);
+
+	/* S = r + H(R | A | msg) * a */
+	ed_hash(h, sig, pub, msg, len);
+	memset(x, 0, sizeof(x));
+	for (i = 0; i < 32; i++)
+		x[i] = r[i];
+	for (i = 0; i < 32; i++) {
+		for (j = 0; j < 32; j++)
+			x[i + j] += h[i] * (int64_t)d[j];
+	}
+	ed_mod_l(sig + 32, x);
+}
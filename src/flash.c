@@ -10,10 +10,37 @@
 #include <em_msc.h>
 
 #include "target.h"
+#include "flash.h"
+#include "profile.h"
+
+/* LDMA channel feeding flash writes */
+#define FLASH_DMA_CH		0
+/* shorter writes are not worth LDMA setup, bytes */
+#define FLASH_DMA_MIN		16
+
+static struct flash_stats flash_stats;
+
+static void flash_stats_time(uint32_t *total, uint32_t *max, uint32_t start)
+{
+	uint32_t t = timer_get_us() - start;
+
+	*total += t;
+	if (t > *max)
+		*max = t;
+}
+
+void flash_get_stats(struct flash_stats *st, int clear)
+{
+	*st = flash_stats;
+	if (clear)
+		memset(&flash_stats, 0, sizeof(flash_stats));
+}
 
 int flash_erase(unsigned int addr, unsigned int len)
 {
 	int err = 0;
+	uint32_t start = timer_get_us();
+	PROF_START(t);
 
 	addr &= ~(FLASH_PAGE_SIZE - 1);
 
@@ -31,22 +58,86 @@ int flash_erase(unsigned int addr, unsigned int len)
 		addr += FLASH_PAGE_SIZE;
 	}
 	led_flash_off();
+	flash_stats_time(&flash_stats.erase_time, &flash_stats.erase_max, start);
+	PROF_END(BTL_PROF_FLASH_ERASE, t);
 	return err;
 }
 
+/*
+ * \brief program word aligned range, LDMA feeds the data when source
+ *        is word aligned too, interrupts stay enabled while it runs.
+ */
+static msc_Return_TypeDef flash_write_words(uint32_t *addr, const void *data, uint32_t len)
+{
+#ifndef FLASH_WRITE_WORD
+	if (len >= FLASH_DMA_MIN && !((uintptr_t)data & 3)) {
+		CMU_ClockEnable(cmuClock_LDMA, true);
+		return MSC_WriteWordDma(FLASH_DMA_CH, addr, data, len);
+	}
+#endif
+#ifdef FLASH_WRITE_FAST
+	return MSC_WriteWordFast(addr, data, len);
+#else
+	return MSC_WriteWord(addr, data, len);
+#endif
+}
+
+/*
+ * \brief program \len bytes at offset \off of word \addr,
+ *        other bytes of the word keep flash contents.
+ */
+static msc_Return_TypeDef flash_write_merge(uint32_t addr, unsigned int off,
+		const uint8_t *data, unsigned int len)
+{
+	uint32_t word = *(const volatile uint32_t *)addr;
+
+	memcpy((uint8_t *)&word + off, data, len);
+	return MSC_WriteWord((uint32_t *)addr, &word, sizeof(word));
+}
+
 int flash_write(unsigned int addr, const void *data, unsigned int len)
 {
-	msc_Return_TypeDef err;
+	msc_Return_TypeDef err = mscReturnOk;
+	const uint8_t *p = data;
+	unsigned int head = addr & 3;
+	unsigned int total = len;
+	unsigned int n;
+	uint32_t start = timer_get_us();
+	PROF_START(t);
 
 	led_flash_on();
 	MSC_Init();
-	err = MSC_WriteWord((uint32_t *)addr, data, len);
+
+	if (head && len) {
+		n = 4 - head;
+		if (n > len)
+			n = len;
+		err = flash_write_merge(addr - head, head, p, n);
+		addr += n;
+		p += n;
+		len -= n;
+	}
+
+	n = len & ~3U;
+	if (err == mscReturnOk && n) {
+		err = flash_write_words((uint32_t *)addr, p, n);
+		addr += n;
+		p += n;
+		len -= n;
+	}
+
+	if (err == mscReturnOk && len)
+		err = flash_write_merge(addr, 0, p, len);
+
 	MSC_Deinit();
 	led_flash_off();
+	flash_stats_time(&flash_stats.write_time, &flash_stats.write_max, start);
+	flash_stats.write_bytes += total;
+	PROF_END(BTL_PROF_FLASH_WRITE, t);
 
 	if (err != mscReturnOk)
 		return -1;
-	return len;
+	return total;
 }
 
 
@@ -23,6 +23,9 @@
 #include "timer.h"
 #include "flash.h"
 #include "btl.h"
+#include "btlport.h"
+#include "profile.h"
+#include "bootlog.h"
 
 #define CMD_BUF_LEN		256
 
@@ -32,6 +35,10 @@
 #define USART0_BAUD_RATE		115200
 /* Deafult baud rate for FC side */
 #define USART1_BAUD_RATE		420000
+/* Single wire FC port, selected by JP2 jumper */
+#define USART_HALF_DUPLEX_PORT		1
+/* install progress is logged every n pages */
+#define BOOTLOG_STEP_PAGES		8
 
 static const uint32_t usart_baud_rate_default[] = {
 	USART0_BAUD_RATE,
@@ -44,11 +51,7 @@ __attribute__((__noreturn__)) void boot_app(void);
 struct bootloader_s {
 	struct timer *timer;
 	struct btl_info_s *info;
-	struct boot_port {
-		uint32_t baud;
-		uint32_t last_time;
-		btl_if_t iface;
-	} usart[USART_NUM];
+	struct boot_ports ports;
 	uint32_t clock;
 };
 
@@ -61,7 +64,7 @@ static int led_timer(void *arg)
 
 static void usart_puts(int num, const char *str)
 {
-	usart_write_buf(num, str, strlen(str));
+	usart_write_buf_timeout(num, str, strlen(str), USART_TX_TIMEOUT_MS);
 }
 
 /*
@@ -75,22 +78,15 @@ static void usart_puth(int num, uint64_t d)
 	const char *hextab = "0123456789ABCDEF";
 	int i;
 
-	buf[0] = '0';
-	buf[1] = '\0';
-
-	i = 0;
-	while (d) {
-		buf[i] = hextab[d & 0xf];
-		i++;
+	/* fill digits from the end */
+	i = sizeof(buf) - 1;
+	buf[i] = '\0';
+	do {
+		buf[--i] = hextab[d & 0xf];
 		d >>= 4;
-	}
+	} while (d);
 
-	if (i == 0) {
-		usart_puts(num, buf);
-	} else {
-		while (i)
-			usart_write(num, buf[--i]);
-	}
+	usart_puts(num, &buf[i]);
 }
 
 /*
@@ -103,24 +99,15 @@ static void usart_putd(int num, unsigned int d)
 	char buf[16];
 	int i;
 
-	buf[0] = '0';
-	buf[1] = '\0';
-
-	/* reverse digits */
-	i = 0;
-	while (d) {
-		buf[i] = (d % 10) + '0';
-		i++;
+	/* fill digits from the end */
+	i = sizeof(buf) - 1;
+	buf[i] = '\0';
+	do {
+		buf[--i] = (d % 10) + '0';
 		d /= 10;
-	}
-	if (i == 0) {
-		usart_puts(num, buf);
-	} else {
-		while (i) {
-			usart_write(num, buf[i - 1]);
-			i--;
-		}
-	}
+	} while (d);
+
+	usart_puts(num, &buf[i]);
 }
 
 static void system_failure(void)
@@ -142,64 +129,21 @@ static void system_init(struct bootloader_s *bt)
 	bt->info = (struct btl_info_s *)__btl_info_start__;
 
 	for (i = 0; i < USART_NUM; i++) {
+		bt->ports.usart[i].iface.port = i;
 		usart_init(i, USART0_BUF_LEN, USART0_BUF_LEN);
-		usart_set_baudrate(i, bt->usart[i].baud);
-		bt->usart[i].baud = usart_get_baudrate(i);
+		usart_set_baudrate(i, bt->ports.usart[i].baud);
+		bt->ports.usart[i].baud = usart_get_baudrate(i);
 	}
+
+	if (jp2_value() == 0)
+		usart_set_half_duplex(USART_HALF_DUPLEX_PORT, 1);
 	bt->clock = SystemCoreClockGet();
 
 	bt->timer = timer_create();
 
-	timer_add(bt->timer, led_timer, bt, TIMER_MS(500), true);
-}
-
-static void usart_handle(struct bootloader_s *bt, int port)
-{
-	int len;
-	int err;
-	int c = usart_read(port);
-	uint32_t ms = timer_get_ms();
-	struct boot_port *bp = &bt->usart[port];
-
-	if (c < 0) {
-		if ((ms - bp->last_time) > 1) {
-			/* reset input bytes by 1 mS timeout */
-			bp->last_time = ms;
-			bp->iface.len = 0;
-		}
-		return;
-	}
-	bp->last_time = ms;
-
-	err = btl_read_byte(&bp->iface, c);
-	if (err < 0) {
-		bp->iface.len = 0;
-		return;
-	}
-
-	if (err == 0)
-		return;
-
-	/* complete */
-	len = btl_handle_packet(&bp->iface);
-	if (len > 0)
-		usart_write_buf(port, bp->iface.buf, len);
-
-	if (bp->iface.reset) {
-		/* system reset requested */
-		timer_sleep_ms(20);
-		__NVIC_SystemReset();
-	}
-
-	if (bp->iface.baud) {
-		/* change baud rate requested */
-		timer_sleep_ms(20);
-		usart_set_baudrate(port, bp->iface.baud);
-	}
+	bootlog_init();
 
-	bp->iface.baud = 0;
-	bp->iface.reset = 0;
-	bp->iface.len = 0;
+	timer_add(bt->timer, led_timer, bt, TIMER_MS(500), true);
 }
 
 static void usart_handle_all(struct bootloader_s *bt)
@@ -207,7 +151,7 @@ static void usart_handle_all(struct bootloader_s *bt)
 	int i;
 
 	for (i = 0; i < USART_NUM; i++)
-		usart_handle(bt, i);
+		btl_port_handle(&bt->ports, i);
 }
 
 static void usart_puts_all(const char *str)
@@ -235,7 +179,7 @@ static void btl_print_info(struct bootloader_s *bt, int port)
 	usart_putd(port, bt->clock);
 	usart_puts(port, ", ");
 	usart_puts(port, "BAUD: ");
-	usart_putd(port, bt->usart[port].baud);
+	usart_putd(port, bt->ports.usart[port].baud);
 	usart_puts(port, "\r\n");
 }
 
@@ -249,22 +193,64 @@ static void btl_print_info_all(struct bootloader_s *bt)
 
 /*
  * \brief copying the flash memory used for temporary recording
- *        of the application to the main area.
- *        No checksums are used.
- *        It is assumed that the bootloader emergency mode will
- *        be activated at startup if the button is pressed
+ *        of the application to the main area, page by page from
+ *        \from bytes. Progress is logged in boot journal, so copying
+ *        interrupted by power loss is resumed on the next start.
+ *        Copy is validated by CRC-32 of both areas. Signed build
+ *        copies only copy with all changed pages signed.
  */
-static int btl_flash_app(struct bootloader_s *bt)
+static int btl_flash_app(struct bootloader_s *bt, uint32_t from)
 {
+	uint32_t digest = bootlog_get()->digest;
+	/* application at address 0 is not a null pointer to compiler */
+	volatile uintptr_t app = BTL_APP_ADDR;
+	uint32_t addr, crc;
 	(void)bt;
 
-	if (flash_erase(0, BTL_APP_SIZE) < 0)
+#ifdef BTL_SIGN
+	if (!bootlog_signed(BTL_FLASH_APP_ADDR)) {
+		/* request is dropped, application is left as it is */
+		usart_puts_all("copy not signed\r\n");
+		bootlog_put(0, from, digest);
 		return -1;
+	}
+#endif
+
+	for (addr = from; addr < BTL_APP_SIZE; addr += BTL_FLASH_PAGE_SIZE) {
+		if (flash_erase(addr, BTL_FLASH_PAGE_SIZE) < 0)
+			return -1;
+
+		if (flash_write(addr, (void *)(BTL_FLASH_APP_ADDR + addr),
+				BTL_FLASH_PAGE_SIZE) < 0)
+			return -1;
 
-	if (flash_write(0, (void *)BTL_FLASH_APP_ADDR, BTL_APP_SIZE) < 0)
+		if ((addr / BTL_FLASH_PAGE_SIZE + 1) % BOOTLOG_STEP_PAGES == 0)
+			bootlog_put(BTL_FLASH_APP, addr + BTL_FLASH_PAGE_SIZE, digest);
+	}
+
+	crc = crc32_calc(0, (const void *)app, BTL_APP_SIZE);
+	if (crc != crc32_calc(0, (const void *)BTL_FLASH_APP_ADDR, BTL_APP_SIZE)) {
+		/* copy again from the start on the next attempt */
+		bootlog_put(BTL_FLASH_APP, 0, digest);
 		return -1;
+	}
 
-	return 0;
+	return bootlog_install(crc);
+}
+
+/*
+ * \brief application may be started, signed build starts it only
+ *        if all its changed pages are signed
+ */
+static int btl_app_bootable(void)
+{
+#ifdef BTL_SIGN
+	if (!bootlog_signed(BTL_APP_ADDR)) {
+		usart_puts_all("application not signed\r\n");
+		return 0;
+	}
+#endif
+	return 1;
 }
 
 static void btl_usart_enable(struct bootloader_s *bt)
@@ -283,26 +269,35 @@ static void btl_usart_enable(struct bootloader_s *bt)
 static void system_run(struct bootloader_s *bt)
 {
 	uint32_t magic = bt->info->magic;
+	const struct bootlog_rec *log;
 
 	btl_print_info_all(bt);
 
+	/* request in RAM is lost on power loss, journal keeps it */
+	if (magic == BTL_MAGIC && bt->info->target == BTL_FLASH_APP) {
+		bt->info->target = 0;
+		bootlog_put(BTL_FLASH_APP, 0, bootlog_get()->digest);
+	}
+	log = bootlog_get();
+
 	usart_puts_all("Reboot cause: ");
-	if (magic == BTL_MAGIC || boot_pin() == 0) {
-		usart_puts_all("soft");
+	if (log->target == BTL_FLASH_APP) {
+		usart_puts_all(log->progress ? "resume flash app\r\n" : "flash app\r\n");
 		bt->info->magic = 0;
-		if (bt->info->target == BTL_FLASH_APP) {
-			bt->info->target = 0;
-			usart_puts_all(", flash app\r\n");
-			if (btl_flash_app(bt) == 0) {
-				timer_sleep_ms(30);
-				boot_app();
-			}
+		if (btl_flash_app(bt, log->progress) == 0 && btl_app_bootable()) {
+			timer_sleep_ms(30);
+			boot_app();
 		}
+	} else if (magic == BTL_MAGIC || boot_pin() == 0) {
+		usart_puts_all("soft");
+		bt->info->magic = 0;
 	} else {
 		usart_puts_all("hard\r\n");
-		timer_sleep_ms(30);
-		/* boot application */
-		boot_app();
+		if (btl_app_bootable()) {
+			timer_sleep_ms(30);
+			/* boot application */
+			boot_app();
+		}
 	}
 
 	usart_puts_all("\r\n");
@@ -313,7 +308,8 @@ static void system_run(struct bootloader_s *bt)
 	btl_usart_enable(bt);
 
 	for (;;) {
-		usart_handle_all(bt);
+		if (!bt->ports.bridge)
+			usart_handle_all(bt);
 
 		timer_handle(bt->timer);
 	}
@@ -332,6 +328,8 @@ int main(void)
 
 	target_init();
 
+	prof_init();
+
 	bt = malloc(sizeof(struct bootloader_s));
 	if (!bt)
 		system_failure();
@@ -339,7 +337,7 @@ int main(void)
 	memset(bt, 0, sizeof(struct bootloader_s));
 
 	for (i = 0; i < USART_NUM; i++)
-		bt->usart[i].baud = usart_baud_rate_default[i];
+		bt->ports.usart[i].baud = usart_baud_rate_default[i];
 
 	system_init(bt);
 
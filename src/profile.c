@@ -0,0 +1,86 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Cycle counter profiling
+ */
+
+#include <string.h>
+
+#include <em_core.h>
+
+#include "profile.h"
+
+#ifdef BTL_PROFILE
+
+struct prof_probe {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum;
+	uint16_t hist[BTL_PROF_HIST];
+};
+
+static struct prof_probe prof_probes[BTL_PROF_NUM];
+
+void prof_init(void)
+{
+	memset(prof_probes, 0, sizeof(prof_probes));
+
+	/* enable DWT cycle counter */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+RAMFUNC void prof_add(int probe, uint32_t cycles)
+{
+	struct prof_probe *p = &prof_probes[probe];
+	int n = cycles ? 32 - __builtin_clz(cycles) : 0;
+
+	/* n is bit length, samples below 2^SHIFT go to bucket 0 */
+	n -= BTL_PROF_HIST_SHIFT;
+	if (n < 0)
+		n = 0;
+	else if (n >= BTL_PROF_HIST)
+		n = BTL_PROF_HIST - 1;
+
+	if (p->hist[n] != UINT16_MAX)
+		p->hist[n]++;
+
+	if (p->count == 0 || cycles < p->min)
+		p->min = cycles;
+	if (cycles > p->max)
+		p->max = cycles;
+
+	p->sum += cycles;
+	p->count++;
+}
+
+int prof_get(int probe, struct btl_prof_s *bp, int clear)
+{
+	struct prof_probe p;
+	CORE_DECLARE_IRQ_STATE;
+
+	if (probe < 0 || probe >= BTL_PROF_NUM)
+		return -1;
+
+	/* probes are updated from interrupts, snapshot and clear together */
+	CORE_ENTER_ATOMIC();
+	p = prof_probes[probe];
+	if (clear)
+		memset(&prof_probes[probe], 0, sizeof(p));
+	CORE_EXIT_ATOMIC();
+
+	bp->count = p.count;
+	bp->min = p.min;
+	bp->max = p.max;
+	bp->avg = p.count ? p.sum / p.count : 0;
+	memcpy(bp->hist, p.hist, sizeof(bp->hist));
+
+	return sizeof(struct btl_prof_s);
+}
+
+#endif
@@ -9,7 +9,7 @@
 
 #include "queue.h"
 
-int queue_read(queue_t *q)
+RAMFUNC int queue_read(queue_t *q)
 {
 	uint8_t d;
 
@@ -37,7 +37,7 @@ int queue_read_buf(queue_t *q, void *buf, size_t len)
 	return count;
 }
 
-int queue_write(queue_t *q, uint8_t d)
+RAMFUNC int queue_write(queue_t *q, uint8_t d)
 {
 	if (queue_full(q))
 		return -1;
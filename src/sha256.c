@@ -0,0 +1,219 @@
+/*
+ * Bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * SHA-256 (FIPS 180-4)
+ */
+
+#include <string.h>
+
+#include "sha256.h"
+
+#if defined(__arm__)
+#include "em_device.h"
+#endif
+
+#if defined(CRYPTO_PRESENT)
+#include "em_cmu.h"
+#include "em_crypto.h"
+#endif
+
+static const uint32_t sha256_init_state[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ror32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_sw(uint32_t *state, const uint8_t *p, uint32_t n)
+{
+	uint32_t w[64], s[8], t1, t2;
+	int i;
+
+	while (n--) {
+		for (i = 0; i < 16; i++, p += 4)
+			w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+				(uint32_t)p[2] << 8 | p[3];
+		for (; i < 64; i++) {
+			t1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			t2 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+		}
+
+		memcpy(s, state, sizeof(s));
+		for (i = 0; i < 64; i++) {
+			t1 = s[7] + (ror32(s[4], 6) ^ ror32(s[4], 11) ^ ror32(s[4], 25)) +
+				((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+			t2 = (ror32(s[0], 2) ^ ror32(s[0], 13) ^ ror32(s[0], 22)) +
+				((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+			memmove(&s[1], &s[0], 7 * sizeof(s[0]));
+			s[4] += t1;
+			s[0] = t1 + t2;
+		}
+		for (i = 0; i < 8; i++)
+			state[i] += s[i];
+	}
+}
+
+#if defined(CRYPTO_PRESENT)
+
+/*
+ * \brief compress n blocks by the CRYPTO engine, state is loaded and
+ *        read back every call, so the engine is free between calls.
+ *        Same sequence as CRYPTO_SHA_256() of emlib, which is one shot only.
+ */
+static void sha256_blocks_hw(uint32_t *state, const uint8_t *p, uint32_t n)
+{
+	CMU_ClockEnable(cmuClock_CRYPTO, true);
+
+	CRYPTO->CTRL = CRYPTO_CTRL_SHA_SHA2;
+	CRYPTO->SEQCTRL = 0;
+	CRYPTO->SEQCTRLB = 0;
+	CRYPTO_ResultWidthSet(CRYPTO, cryptoResult256Bits);
+
+	CRYPTO_DDataWrite(&CRYPTO->DDATA1, state);
+	CRYPTO_EXECUTE_2(CRYPTO,
+			 CRYPTO_CMD_INSTR_DDATA1TODDATA0,
+			 CRYPTO_CMD_INSTR_SELDDATA0DDATA1);
+
+	while (n--) {
+		CRYPTO_QDataWrite(&CRYPTO->QDATA1BIG, (uint32_t *)p);
+		CRYPTO_EXECUTE_3(CRYPTO,
+				 CRYPTO_CMD_INSTR_SHA,
+				 CRYPTO_CMD_INSTR_MADD32,
+				 CRYPTO_CMD_INSTR_DDATA0TODDATA1);
+		p += SHA256_BLOCK_SIZE;
+	}
+
+	CRYPTO_DDataRead(&CRYPTO->DDATA0, state);
+}
+
+/*
+ * \brief known answer of the engine, state after "abc" block (FIPS 180-4)
+ * \return 1 if engine sequence gives the digest of software compression
+ */
+static int sha256_hw_check(void)
+{
+	static const uint8_t abc[SHA256_BLOCK_SIZE] __attribute__((__aligned__(4))) = {
+		'a', 'b', 'c', 0x80, [SHA256_BLOCK_SIZE - 1] = 24,
+	};
+	static const uint32_t abc_state[8] = {
+		0xba7816bf, 0x8f01cfea, 0x414140de, 0x5dae2223,
+		0xb00361a3, 0x96177a9c, 0xb410ff61, 0xf20015ad,
+	};
+	uint32_t state[8];
+
+	memcpy(state, sha256_init_state, sizeof(state));
+	sha256_blocks_hw(state, abc, 1);
+	return !memcmp(state, abc_state, sizeof(state));
+}
+
+/* engine is used once it passed known answer check, -1 not checked yet */
+static int sha256_hw = -1;
+
+static void sha256_blocks(uint32_t *state, const uint8_t *p, uint32_t n)
+{
+	if (sha256_hw)
+		sha256_blocks_hw(state, p, n);
+	else
+		sha256_blocks_sw(state, p, n);
+}
+
+#else
+
+#define sha256_blocks		sha256_blocks_sw
+
+#endif
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+#if defined(CRYPTO_PRESENT)
+	if (sha256_hw < 0)
+		sha256_hw = sha256_hw_check();
+#endif
+	memcpy(ctx->state, sha256_init_state, sizeof(ctx->state));
+	ctx->len = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, uint32_t len)
+{
+	const uint8_t *p = data;
+	uint32_t used = ctx->len % SHA256_BLOCK_SIZE;
+	uint32_t n;
+
+	ctx->len += len;
+
+	if (used) {
+		n = SHA256_BLOCK_SIZE - used;
+		if (n > len)
+			n = len;
+		memcpy((uint8_t *)ctx->buf + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < SHA256_BLOCK_SIZE)
+			return;
+		sha256_blocks(ctx->state, (const uint8_t *)ctx->buf, 1);
+	}
+
+	/* word aligned input, flash pages in bootloader, is not copied */
+	n = len / SHA256_BLOCK_SIZE;
+	if (n && ((uintptr_t)p & 3) == 0) {
+		sha256_blocks(ctx->state, p, n);
+		p += n * SHA256_BLOCK_SIZE;
+		len -= n * SHA256_BLOCK_SIZE;
+	}
+	for (; len >= SHA256_BLOCK_SIZE; len -= SHA256_BLOCK_SIZE) {
+		memcpy(ctx->buf, p, SHA256_BLOCK_SIZE);
+		sha256_blocks(ctx->state, (const uint8_t *)ctx->buf, 1);
+		p += SHA256_BLOCK_SIZE;
+	}
+
+	memcpy(ctx->buf, p, len);
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t *digest)
+{
+	uint8_t *buf = (uint8_t *)ctx->buf;
+	uint32_t used = ctx->len % SHA256_BLOCK_SIZE;
+	uint64_t bits = ctx->len * 8;
+	int i;
+
+	buf[used++] = 0x80;
+	if (used > SHA256_BLOCK_SIZE - 8) {
+		memset(buf + used, 0, SHA256_BLOCK_SIZE - used);
+		sha256_blocks(ctx->state, buf, 1);
+		used = 0;
+	}
+	memset(buf + used, 0, SHA256_BLOCK_SIZE - 8 - used);
+	for (i = 0; i < 8; i++)
+		buf[SHA256_BLOCK_SIZE - 1 - i] = bits >> (i * 8);
+	sha256_blocks(ctx->state, buf, 1);
+
+	for (i = 0; i < 8; i++) {
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = ctx->state[i] >> 16;
+		digest[i * 4 + 2] = ctx->state[i] >> 8;
+		digest[i * 4 + 3] = ctx->state[i];
+	}
+}
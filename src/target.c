@@ -9,6 +9,7 @@
 
 #include <em_device.h>
 #include <em_chip.h>
+#include <em_core.h>
 #include <em_emu.h>
 #include <em_cmu.h>
 #include <em_usart.h>
@@ -16,6 +17,7 @@
 
 #include "usart.h"
 #include "target.h"
+#include "profile.h"
 
 static usart_hw_t usart_hw[2] = {
 	/* USART0 */
@@ -36,6 +38,18 @@ static usart_hw_t usart_hw[2] = {
 			.port = USART0_PORT_TX,
 			.pin = USART0_PIN_TX,
 		},
+#if defined(USART_FLOW_CONTROL) && defined(USART0_PORT_CTS)
+		.flow = 1,
+		.cts = {
+			.route = USART0_ROUTE_CTS,
+			.port = USART0_PORT_CTS,
+			.pin = USART0_PIN_CTS,
+		},
+		.rts = {
+			.port = USART0_PORT_RTS,
+			.pin = USART0_PIN_RTS,
+		},
+#endif
 	},
 	/* USART1 */
 	{
@@ -58,29 +72,45 @@ static usart_hw_t usart_hw[2] = {
 	},
 };
 
-static inline void USART_RX_IRQHandler(USART_TypeDef *usart, int num)
+/* vector table copy in RAM, aligned to its size rounded up to power of 2 */
+#define VECTORS_NUM		(16 + EXT_IRQ_COUNT)
+#define VECTORS_ALIGN		512
+
+static uint32_t vectors_ram[VECTORS_NUM] __attribute__((__aligned__(VECTORS_ALIGN)));
+
+_Static_assert(sizeof(vectors_ram) <= VECTORS_ALIGN, "vector table alignment");
+
+static RAMFUNC void USART_RX_IRQHandler(USART_TypeDef *usart, int num)
 {
+	PROF_START(t);
 	uint32_t flags = USART_IntGetEnabled(usart);
 
+	if (flags & USART_IEN_RXOF) {
+		USART_IntClear(usart, USART_IF_RXOF);
+		usart_rx_overrun_irq(num);
+	}
 	if (flags & USART_IEN_RXDATAV)
 		usart_rx_irq(num);
 	//USART_IntClear(usart, flags);
+	PROF_END(BTL_PROF_USART_RX_IRQ, t);
 }
 
-static inline void USART_TX_IRQHandler(USART_TypeDef *usart, int num)
+static RAMFUNC void USART_TX_IRQHandler(USART_TypeDef *usart, int num)
 {
+	PROF_START(t);
 	uint32_t flags = USART_IntGetEnabled(usart);
 
 	if (flags & USART_IEN_TXBL)
 		usart_tx_irq(num);
 	if (flags & USART_IEN_TXC)
 		usart_tx_complete_irq(num);
+	PROF_END(BTL_PROF_USART_TX_IRQ, t);
 }
 
 /*
  * The USART0 receive interrupt
  */
-void USART0_RX_IRQHandler(void)
+RAMFUNC void USART0_RX_IRQHandler(void)
 {
 	USART_RX_IRQHandler(USART0, 0);
 }
@@ -88,7 +118,7 @@ void USART0_RX_IRQHandler(void)
 /*
  * The USART1 receive interrupt
  */
-void USART1_RX_IRQHandler(void)
+RAMFUNC void USART1_RX_IRQHandler(void)
 {
 	USART_RX_IRQHandler(USART1, 1);
 }
@@ -97,7 +127,7 @@ void USART1_RX_IRQHandler(void)
  *
  * The USART0 transmit interrupt
  */
-void USART0_TX_IRQHandler(void)
+RAMFUNC void USART0_TX_IRQHandler(void)
 {
 	USART_TX_IRQHandler(USART0, 0);
 }
@@ -106,7 +136,7 @@ void USART0_TX_IRQHandler(void)
  *
  * The USART1 transmit interrupt
  */
-void USART1_TX_IRQHandler(void)
+RAMFUNC void USART1_TX_IRQHandler(void)
 {
 	USART_TX_IRQHandler(USART1, 1);
 }
@@ -123,26 +153,60 @@ static void usart_configure_pins(usart_hw_t *hw)
 
 	// Enable VCOM connection to board controller
 	//GPIO_PinModeSet(BSP_BCC_ENABLE_PORT, BSP_BCC_ENABLE_PIN, gpioModePushPull, 1);
+
+	if (!hw->flow)
+		return;
+
+	/* CTS input, RTS output asserted */
+	GPIO_PinModeSet(hw->cts.port, hw->cts.pin, gpioModeInput, 0);
+	GPIO_PinModeSet(hw->rts.port, hw->rts.pin, gpioModePushPull, 0);
 }
 
-void usart_hw_half_duplex_tx(usart_hw_t *hw)
+/*
+ * \brief GPIO_PinModeSet() placed in RAM, line is turned around
+ *        by TX complete interrupt while flash is busy
+ */
+static RAMFUNC void usart_hw_pin_mode(GPIO_Port_TypeDef port, unsigned int pin,
+		GPIO_Mode_TypeDef mode, unsigned int out)
+{
+	volatile uint32_t *reg = pin < 8 ? &GPIO->P[port].MODEL : &GPIO->P[port].MODEH;
+	unsigned int shift = (pin & 7) * 4;
+
+	/* output level is set before pin drives line */
+	if (out)
+		GPIO_PinOutSet(port, pin);
+	else
+		GPIO_PinOutClear(port, pin);
+
+	*reg = (*reg & ~(0xfu << shift)) | ((uint32_t)mode << shift);
+}
+
+/*
+ * Single wire line, receiver is blocked while transmitting,
+ * so own data is not echoed into RX queue.
+ */
+RAMFUNC void usart_hw_half_duplex_tx(usart_hw_t *hw)
 {
-	GPIO_PinModeSet(hw->rx.port, hw->rx.pin, gpioModePushPull, 1);
-	GPIO_PinModeSet(hw->tx.port, hw->tx.pin, gpioModeInput, 0);
+	hw->regs->CMD = USART_CMD_RXBLOCKEN;
+
+	usart_hw_pin_mode(hw->rx.port, hw->rx.pin, gpioModePushPull, 1);
+	usart_hw_pin_mode(hw->tx.port, hw->tx.pin, gpioModeInput, 0);
 
 	hw->regs->ROUTEPEN &= ~(USART_ROUTEPEN_RXPEN | USART_ROUTEPEN_TXPEN);
 	hw->regs->ROUTELOC0 = hw->rx.half_route | hw->tx.half_route;
 	hw->regs->ROUTEPEN |= USART_ROUTEPEN_RXPEN | USART_ROUTEPEN_TXPEN;
 }
 
-void usart_hw_half_duplex_rx(usart_hw_t *hw)
+RAMFUNC void usart_hw_half_duplex_rx(usart_hw_t *hw)
 {
-	GPIO_PinModeSet(hw->tx.port, hw->tx.pin, gpioModePushPull, 1);
-	GPIO_PinModeSet(hw->rx.port, hw->rx.pin, gpioModeInput, 0);
+	usart_hw_pin_mode(hw->tx.port, hw->tx.pin, gpioModePushPull, 1);
+	usart_hw_pin_mode(hw->rx.port, hw->rx.pin, gpioModeInput, 0);
 
 	hw->regs->ROUTEPEN &= ~(USART_ROUTEPEN_RXPEN | USART_ROUTEPEN_TXPEN);
 	hw->regs->ROUTELOC0 = hw->rx.route | hw->tx.route;
 	hw->regs->ROUTEPEN |= USART_ROUTEPEN_RXPEN | USART_ROUTEPEN_TXPEN;
+
+	hw->regs->CMD = USART_CMD_RXBLOCKDIS | USART_CMD_CLEARRX;
 }
 
 usart_hw_t *usart_hw_init(int num)
@@ -176,6 +240,14 @@ usart_hw_t *usart_hw_init(int num)
 	hw->regs->ROUTELOC0 = hw->rx.route | hw->tx.route;
 	hw->regs->ROUTEPEN |= USART_ROUTEPEN_RXPEN | USART_ROUTEPEN_TXPEN;
 
+	/* Hardware CTS stops transmitter, RTS is driven by software
+	 * from RX queue fill level */
+	if (hw->flow) {
+		hw->regs->CTRLX |= USART_CTRLX_CTSEN;
+		hw->regs->ROUTELOC1 = hw->cts.route;
+		hw->regs->ROUTEPEN |= USART_ROUTEPEN_CTSPEN;
+	}
+
 	return hw;
 }
 
@@ -257,7 +329,7 @@ void timer_sleep_ms(uint32_t ms)
 	while ((timer_get_ms() - start) < ms);
 }
 
-void TIMER0_IRQHandler(void)
+RAMFUNC void TIMER0_IRQHandler(void)
 {
 	uint16_t flags = TIMER_IntGet(TIMER0);
 
@@ -304,8 +376,33 @@ uint64_t taget_get_id(void)
 		DEVINFO->EUI48L;
 }
 
+/*
+ * \brief move vector table to RAM, interrupts are taken
+ *        while flash is busy with erase or write
+ */
+static void vectors_init(void)
+{
+	const uint32_t *vt = (const uint32_t *)SCB->VTOR;
+	int i;
+	CORE_DECLARE_IRQ_STATE;
+
+	for (i = 0; i < VECTORS_NUM; i++)
+		vectors_ram[i] = vt[i];
+
+	CORE_ENTER_ATOMIC();
+	SCB->VTOR = (uint32_t)vectors_ram;
+	__DSB();
+	CORE_EXIT_ATOMIC();
+}
+
+void target_reset(void)
+{
+	__NVIC_SystemReset();
+}
+
 void target_init(void)
 {
+	vectors_init();
 	clocks_init();
 	gpio_init();
 	timer_init();
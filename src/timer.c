@@ -15,6 +15,7 @@
 #include "queue.h"
 #include "timer.h"
 #include "target.h"
+#include "profile.h"
 
 
 struct etimer {
@@ -77,6 +78,7 @@ void timer_set(struct etimer *et, uint32_t period)
  */
 int timer_handle(struct timer *t)
 {
+	PROF_START(t_prof);
 	uint32_t now = timer_get_us();
 	struct etimer *et, *ets;
 	int runs = 0;
@@ -88,6 +90,7 @@ int timer_handle(struct timer *t)
 			runs++;
 		}
 	}
+	PROF_END(BTL_PROF_TIMER, t_prof);
 	return runs;
 }
 
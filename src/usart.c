@@ -7,7 +7,11 @@
  * USART
  */
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <em_core.h>
 
 #include "usart.h"
 #include "queue.h"
@@ -21,40 +25,161 @@ struct usart {
 		void (*cb)(void *, uint8_t);
 		void *arg;
 	} rx, tx;
+	TAILQ_HEAD(usart_frames, usart_frame) frames;
+	/* RTS deasserted by RX queue fill level */
+	int rts_hold;
+	/* single wire line and its current direction */
+	int half;
+	volatile int half_tx;
+	/* raw bridge port whose RX fills TX queue, held by RTS */
+	struct usart *peer;
+	/* a byte was sent since reset, TXC is not set before */
+	volatile int tx_sent;
+	struct usart_stats stats;
 };
 
 static struct usart usart[2];
 
-void usart_tx_complete_irq(int num)
+RAMFUNC void usart_tx_complete_irq(int num)
 {
 	struct usart *u = &usart[num];
+
+	usart_hw_tx_complete_clear(u->hw);
+
+	if (u->half) {
+		/* stale flag or new data queued, wait for the real end */
+		if (!usart_hw_tx_complete(u->hw) || usart_tx_busy(num))
+			return;
+
+		/* last stop bit is out, release line at once */
+		usart_hw_half_duplex_rx(u->hw);
+		u->half_tx = 0;
+	}
+
 	if (u->tx.cb)
 		u->tx.cb(u->tx.arg, 0);
 	usart_hw_tx_complete_irq_disable(u->hw);
 }
 
-void usart_tx_irq(int num)
+/*
+ * \brief turn single wire line to transmit before data is queued,
+ *        raw bridge calls it from RX interrupt, CORE_ENTER_ATOMIC()
+ *        is a call into flash, PRIMASK is set inline instead
+ */
+static RAMFUNC void usart_half_tx(struct usart *u)
 {
-	struct usart *u = &usart[num];
-	int data = queue_read(&u->tx.queue);
+	uint32_t primask;
+
+	if (!u->half)
+		return;
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+	/* keep pending turnaround from releasing line under new data */
+	usart_hw_tx_complete_irq_disable(u->hw);
+	if (!u->half_tx) {
+		u->half_tx = 1;
+		usart_hw_half_duplex_tx(u->hw);
+	}
+	__set_PRIMASK(primask);
+}
 
-	if (data < 0) {
-		usart_hw_tx_irq_disable(u->hw);
+/*
+ * \brief assert RTS of raw bridge peer again when TX queue is drained
+ *        to low watermark
+ */
+static RAMFUNC void usart_bridge_release(struct usart *u)
+{
+	struct usart *src = u->peer;
+
+	if (!src || !src->rts_hold)
+		return;
+
+	if (queue_count(&u->tx.queue) > USART_RTS_LOW((size_t)u->tx.len))
+		return;
+
+	src->rts_hold = 0;
+	usart_hw_rts(src->hw, 1);
+}
+
+RAMFUNC void usart_tx_irq(int num)
+{
+	struct usart *u = &usart[num];
+	usart_frame_t *f = TAILQ_FIRST(&u->frames);
+	int data;
+
+	/* bytes queued before the first frame go out first */
+	if (!f || u->tx.queue.tail != f->mark) {
+		data = queue_read(&u->tx.queue);
+		usart_bridge_release(u);
+		if (data < 0) {
+			usart_hw_tx_irq_disable(u->hw);
+			/* line is turned around on TX complete */
+			if (u->half)
+				usart_hw_tx_complete_irq_enable(u->hw);
+			return;
+		}
+		usart_hw_tx(u->hw, data);
+		u->tx_sent = 1;
+		u->stats.tx_bytes++;
 		return;
 	}
 
-	usart_hw_tx(u->hw, data);
+	usart_hw_tx(u->hw, f->buf[f->pos++]);
+	u->tx_sent = 1;
+	u->stats.tx_bytes++;
+	if (f->pos < f->len)
+		return;
+
+	TAILQ_REMOVE(&u->frames, f, queue);
+	if (f->done)
+		f->done(f->arg, f);
 }
 
-void usart_rx_irq(int num)
+RAMFUNC void usart_rx_irq(int num)
 {
 	struct usart *u = &usart[num];
 	uint8_t data = usart_hw_rx(u->hw);
 
-	if (u->rx.cb)
+	u->stats.rx_bytes++;
+	if (u->rx.cb) {
 		u->rx.cb(u->rx.arg, data);
-	else if (u->rx.len)
-		queue_write(&u->rx.queue, data);
+		return;
+	}
+
+	if (!u->rx.len)
+		return;
+
+	if (queue_write(&u->rx.queue, data) < 0)
+		u->stats.rx_drop++;
+
+	if (u->hw->flow && !u->rts_hold &&
+	    queue_count(&u->rx.queue) >= USART_RTS_HIGH((size_t)u->rx.len)) {
+		u->rts_hold = 1;
+		usart_hw_rts(u->hw, 0);
+	}
+}
+
+RAMFUNC void usart_rx_overrun_irq(int num)
+{
+	struct usart *u = &usart[num];
+
+	u->stats.rx_overrun++;
+}
+
+/*
+ * \brief assert RTS again when RX queue is drained to low watermark
+ */
+static void usart_rx_release(struct usart *u)
+{
+	if (!u->rts_hold)
+		return;
+
+	if (queue_count(&u->rx.queue) > USART_RTS_LOW((size_t)u->rx.len))
+		return;
+
+	u->rts_hold = 0;
+	usart_hw_rts(u->hw, 1);
 }
 
 static int usart_queue_init(struct usart_queue *uq, int len)
@@ -86,6 +211,8 @@ int usart_init(int num, int rxlen, int txlen)
 	if (usart_queue_init(&u->rx, rxlen) < 0)
 		return -1;
 
+	TAILQ_INIT(&u->frames);
+
 	if (usart_queue_init(&u->tx, txlen) < 0) {
 		if (u->rx.buf)
 			free(u->rx.buf);
@@ -97,12 +224,15 @@ int usart_init(int num, int rxlen, int txlen)
 	return 0;
 }
 
-int usart_write(int num, char d)
+RAMFUNC int usart_write(int num, char d)
 {
 	struct usart *u = &usart[num];
 
-	if (queue_write(&u->tx.queue, (uint8_t)d) < 0)
+	usart_half_tx(u);
+	if (queue_write(&u->tx.queue, (uint8_t)d) < 0) {
+		u->stats.tx_drop++;
 		return -1;
+	}
 
 	usart_hw_tx_irq_enable(u->hw);
 	return 0;
@@ -114,6 +244,7 @@ int usart_write_buf(int num, const void *buf, int len)
 	const uint8_t *p = buf;
 	int sz = len;
 
+	usart_half_tx(u);
 	while (len) {
 		if (queue_write(&u->tx.queue, *p++) < 0)
 			break;
@@ -124,11 +255,94 @@ int usart_write_buf(int num, const void *buf, int len)
 	return sz - len;
 }
 
+/*
+ * \brief write buffer, wait for free space in TX queue
+ *        no longer than \ms milliseconds.
+ * \return number of bytes queued.
+ */
+int usart_write_buf_timeout(int num, const void *buf, int len, uint32_t ms)
+{
+	struct usart *u = &usart[num];
+	const uint8_t *p = buf;
+	uint32_t start = timer_get_ms();
+	int sz;
+
+	sz = usart_write_buf(num, p, len);
+	while (sz < len) {
+		if ((timer_get_ms() - start) > ms)
+			break;
+
+		__DMB();
+		if (queue_full(&u->tx.queue))
+			continue;
+
+		sz += usart_write_buf(num, p + sz, len - sz);
+	}
+	u->stats.tx_drop += len - sz;
+	return sz;
+}
+
+/*
+ * \brief queue frame for transmission without copying.
+ *        The frame is sent after all data written before,
+ *        \f->done is called from TX interrupt when the last byte is sent.
+ */
+int usart_write_frame(int num, usart_frame_t *f)
+{
+	struct usart *u = &usart[num];
+	CORE_DECLARE_IRQ_STATE;
+
+	f->pos = 0;
+	if (!f->len) {
+		if (f->done)
+			f->done(f->arg, f);
+		return 0;
+	}
+
+	usart_half_tx(u);
+
+	CORE_ENTER_ATOMIC();
+	f->mark = u->tx.queue.head;
+	TAILQ_INSERT_TAIL(&u->frames, f, queue);
+	CORE_EXIT_ATOMIC();
+
+	usart_hw_tx_irq_enable(u->hw);
+	return 0;
+}
+
+RAMFUNC int usart_tx_busy(int num)
+{
+	struct usart *u = &usart[num];
+
+	__DMB();
+	return !queue_empty(&u->tx.queue) || !TAILQ_EMPTY(&u->frames);
+}
+
+/*
+ * \brief wait until all queued data is shifted out,
+ *        no longer than \ms milliseconds.
+ *        Port which has not sent anything is flushed at once.
+ * \return 0 or -1 on timeout
+ */
+int usart_tx_flush(int num, uint32_t ms)
+{
+	struct usart *u = &usart[num];
+	uint32_t start = timer_get_ms();
+
+	while (usart_tx_busy(num) || (u->tx_sent && !usart_hw_tx_complete(u->hw))) {
+		if ((timer_get_ms() - start) > ms)
+			return -1;
+	}
+	return 0;
+}
+
 int usart_read(int num)
 {
 	struct usart *u = &usart[num];
+	int c = queue_read(&u->rx.queue);
 
-	return queue_read(&u->rx.queue);
+	usart_rx_release(u);
+	return c;
 }
 
 int usart_read_buf(int num, void *buf, int len)
@@ -146,9 +360,36 @@ int usart_read_buf(int num, void *buf, int len)
 		len--;
 	}
 
+	usart_rx_release(u);
 	return sz - len;
 }
 
+void usart_get_stats(int num, struct usart_stats *st, int clear)
+{
+	struct usart *u = &usart[num];
+	CORE_DECLARE_IRQ_STATE;
+
+	CORE_ENTER_ATOMIC();
+	*st = u->stats;
+	if (clear)
+		memset(&u->stats, 0, sizeof(u->stats));
+	CORE_EXIT_ATOMIC();
+}
+
+/*
+ * \brief single wire mode, line is driven only while data is sent
+ *        and turned back to receive by TX complete interrupt.
+ */
+void usart_set_half_duplex(int num, int on)
+{
+	struct usart *u = &usart[num];
+
+	usart_hw_tx_complete_clear(u->hw);
+	u->half = on;
+	u->half_tx = 0;
+	usart_hw_half_duplex_rx(u->hw);
+}
+
 void usart_half_duplex_tx(int num)
 {
 	struct usart *u = &usart[num];
@@ -196,6 +437,45 @@ void usart_rx_enable(int num)
 	usart_hw_rx_irq_enable(u->hw);
 }
 
+static RAMFUNC void usart_bridge_rx(void *arg, uint8_t data)
+{
+	int num = (int)(intptr_t)arg;
+	struct usart *u = &usart[num];
+	struct usart *src = u->peer;
+
+	/* byte lost on full queue is counted in tx_drop */
+	usart_write(num, data);
+
+	if (src->hw->flow && !src->rts_hold &&
+	    queue_count(&u->tx.queue) >= USART_RTS_HIGH((size_t)u->tx.len)) {
+		src->rts_hold = 1;
+		usart_hw_rts(src->hw, 0);
+	}
+}
+
+/*
+ * \brief pass received bytes of ports \a and \b to each other,
+ *        bytes go from RX interrupt directly into TX queue.
+ *        Port running faster than the other one is held by RTS while
+ *        TX queue of the other one is filled, without flow control
+ *        bytes not fitting into the queue are dropped.
+ */
+void usart_bridge(int a, int b)
+{
+	int c;
+
+	usart[a].peer = &usart[b];
+	usart[b].peer = &usart[a];
+	usart_rx_set_callback(a, usart_bridge_rx, (void *)(intptr_t)b);
+	usart_rx_set_callback(b, usart_bridge_rx, (void *)(intptr_t)a);
+
+	/* bytes received before */
+	while ((c = usart_read(a)) >= 0)
+		usart_write(b, c);
+	while ((c = usart_read(b)) >= 0)
+		usart_write(a, c);
+}
+
 void usart_rx_set_callback(int num, usart_cb cb, void *arg)
 {
 	struct usart *u = &usart[num];
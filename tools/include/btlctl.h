@@ -14,6 +14,7 @@
 #include "serial.h"
 
 #include "btlproto.h"
+#include "btlcodec.h"
 
 #ifdef DEBUG
 # define dbg			printf
@@ -24,9 +25,107 @@
 #endif
 
 
-int btl_write(serial_handle fd, uint8_t cmd, uint8_t status, uint32_t addr,
+#define BTL_RX_BUF_SIZE		4096
+
+/* lower bound of reply timeout, covers USB serial latency timers, mS */
+#define BTL_RTO_MIN		10
+
+/*
+ * Serial port with receive buffer,
+ * frames are parsed from bytes already read
+ */
+typedef struct btl_port_s {
+	serial_handle fd;
+	uint8_t buf[BTL_RX_BUF_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	/* bytes of frame being received */
+	struct btl_decoder dec;
+	/* upper bound and initial reply timeout, mS */
+	int timeout;
+	/* smoothed round trip time and its variation, uS */
+	long srtt;
+	long rttvar;
+	/* reply timeout derived from round trip time, mS */
+	int rto;
+	/* EUI48 of packets on shared bus, NULL on point to point link */
+	const uint8_t *dst;
+	/* single wire line, own data comes back and is dropped */
+	int echo;
+	/* bytes of echo still to be dropped */
+	unsigned long skip;
+	/* link to unit passing data in FORWARD frames, NULL if direct */
+	struct btl_port_s *via;
+} btl_port_t;
+
+extern const uint8_t btl_eui_broadcast[6];
+
+/*
+ * Precomputed packet sequence in one continuous buffer,
+ * consecutive packets are sent with single write
+ */
+typedef struct btl_stream_s {
+	uint8_t *buf;
+	/* packet offsets in buffer, count + 1 entries */
+	size_t *off;
+	/* packet addresses */
+	uint32_t *addr;
+	unsigned int count;
+	/* EUI48 of address header in front of every packet or NULL */
+	const uint8_t *dst;
+} btl_stream_t;
+
+#define BTL_STREAM_GROW		1024
+
+#define btl_stream_hdr(st)	((st)->dst ? BTL_ADDR_HDR_SIZE : 0)
+#define btl_stream_size(st, i)	((st)->off[(i) + 1] - (st)->off[i] - \
+				 btl_stream_hdr(st) - BTL_HEADER_SIZE - 1)
+
+void btl_port_init(btl_port_t *port, serial_handle fd, int timeout);
+
+/*
+ * \brief command table entry of request opcode, NULL if unknown
+ */
+const struct btl_cmd_desc *btl_cmd(uint8_t cmd);
+
+long btl_time_us(void);
+
+/*
+ * \brief update round trip time estimation with measured \us,
+ *        only replies to packets sent once are measured.
+ */
+void btl_rtt_sample(btl_port_t *port, long us);
+
+/*
+ * \brief double reply timeout after lost reply
+ */
+void btl_rto_backoff(btl_port_t *port);
+
+/*
+ * \brief discard received data until the line is quiet for \ms milliseconds
+ */
+void btl_flush(btl_port_t *port, int ms);
+
+int btl_stream_add(btl_stream_t *st, uint8_t cmd, uint8_t status, uint32_t addr,
 		const void *data, unsigned int len);
 
-int btl_read(serial_handle fd, uint8_t *cmd, uint8_t *status, uint32_t *addr, void *data);
+int btl_stream_write(btl_port_t *port, const btl_stream_t *st,
+		unsigned int first, unsigned int n);
+
+void btl_stream_free(btl_stream_t *st);
+
+int btl_write(btl_port_t *port, uint8_t cmd, uint8_t status, uint32_t addr,
+		const void *data, unsigned int len);
+
+/*
+ * \brief read packet, wait no longer than \timeout milliseconds
+ */
+int btl_read_timeout(btl_port_t *port, int timeout, uint8_t *cmd, uint8_t *status,
+		uint32_t *addr, void *data);
+
+/*
+ * \brief read packet, wait no longer than reply timeout
+ */
+int btl_read(btl_port_t *port, uint8_t *cmd, uint8_t *status, uint32_t *addr, void *data);
 
 #endif
@@ -0,0 +1,75 @@
+/*
+ * Console tool for bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Emulated bootloader, protocol of device build on host
+ */
+
+#ifndef _EMU_H_
+#define _EMU_H_
+
+#include <stdint.h>
+
+/*
+ * Flash of emulated device, mapped at the same addresses,
+ * the first 64 KB are below lowest address user space can map
+ */
+#define EMU_FLASH_START		0x10000
+#define EMU_FLASH_END		0x80000
+/* USER_DATA page keeps boot journal */
+#define EMU_USERDATA_START	0x0fe00000
+#define EMU_USERDATA_SIZE	2048
+
+#define EMU_RX_BUF_LEN		512
+
+/* EUI48 of emulated device */
+#define EMU_ID			0x0000b71e5a3c0001ULL
+
+/*
+ * Port of emulated device, bytes are passed to link
+ */
+struct emu_ops {
+	void (*tx)(void *arg, const void *buf, int len);
+	/* bytes still waiting for transmission */
+	unsigned int (*tx_queued)(void *arg);
+	/* baud rate set by BAUD command, after reply */
+	void (*baud)(void *arg, uint32_t baud);
+	void *arg;
+};
+
+struct emu_stats {
+	/* packets handled, dropped frames and truncated frames */
+	uint32_t frames;
+	uint32_t crc_err;
+	uint32_t size_err;
+	uint32_t timeout;
+	/* RX buffer overflows */
+	uint32_t rx_drop;
+	/* bytes passed to flash write and bytes programmed first time since erase */
+	uint32_t written;
+	uint32_t programmed;
+	uint32_t erased;
+};
+
+/*
+ * \brief map flash and start bootloader, flash is erased
+ * \return 0 or -1 if flash can't be mapped
+ */
+int emu_init(const struct emu_ops *ops);
+
+/*
+ * \brief byte delivered by link to RX buffer
+ */
+void emu_rx(uint8_t c);
+
+/*
+ * \brief run port as bootloader main loop does, until all received
+ *        bytes are parsed, \ms is time of device clock
+ */
+void emu_poll(uint32_t ms);
+
+void emu_get_stats(struct emu_stats *st, int clear);
+
+#endif
@@ -0,0 +1,18 @@
+/*
+ * Console tool for bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Host build of bootloader protocol for link simulator,
+ * declarations of Gecko SDK used by target.h only
+ */
+
+#ifndef _EMU_EM_CHIP_H_
+#define _EMU_EM_CHIP_H_
+
+#include <stdint.h>
+
+typedef int IRQn_Type;
+
+#endif
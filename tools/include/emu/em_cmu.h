@@ -0,0 +1,17 @@
+/*
+ * Console tool for bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ */
+
+#ifndef _EMU_EM_CMU_H_
+#define _EMU_EM_CMU_H_
+
+typedef enum {
+	cmuClock_USART0,
+	cmuClock_USART1,
+} CMU_Clock_TypeDef;
+
+#endif
@@ -0,0 +1,34 @@
+/*
+ * Console tool for bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ */
+
+#ifndef _EMU_EM_GPIO_H_
+#define _EMU_EM_GPIO_H_
+
+typedef enum {
+	gpioPortA,
+	gpioPortB,
+	gpioPortC,
+	gpioPortD,
+	gpioPortE,
+	gpioPortF,
+} GPIO_Port_TypeDef;
+
+/* no pins on host */
+static inline void GPIO_PinOutSet(GPIO_Port_TypeDef port, unsigned int pin)
+{
+	(void)port;
+	(void)pin;
+}
+
+static inline void GPIO_PinOutClear(GPIO_Port_TypeDef port, unsigned int pin)
+{
+	(void)port;
+	(void)pin;
+}
+
+#endif
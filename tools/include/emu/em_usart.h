@@ -0,0 +1,77 @@
+/*
+ * Console tool for bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ */
+
+#ifndef _EMU_EM_USART_H_
+#define _EMU_EM_USART_H_
+
+#include <stdint.h>
+
+/* registers of target.h helpers, emulated port does not use them */
+typedef struct {
+	volatile uint32_t CTRL;
+	volatile uint32_t CMD;
+	volatile uint32_t STATUS;
+	volatile uint32_t RXDATA;
+	volatile uint32_t TXDATA;
+	volatile uint32_t IEN;
+	uint32_t baud;
+} USART_TypeDef;
+
+#define USART_CTRL_MSBF		(1 << 10)
+#define USART_CTRL_RXINV	(1 << 14)
+#define USART_CTRL_TXINV	(1 << 15)
+#define USART_CMD_RXEN		(1 << 0)
+#define USART_CMD_TXEN		(1 << 2)
+#define USART_STATUS_TXC	(1 << 5)
+#define USART_IEN_TXC		(1 << 0)
+#define USART_IEN_TXBL		(1 << 1)
+#define USART_IEN_RXDATAV	(1 << 2)
+#define USART_IEN_RXOF		(1 << 5)
+#define USART_IF_TXC		USART_IEN_TXC
+#define USART_IF_RXOF		USART_IEN_RXOF
+
+typedef enum {
+	usartOVS16,
+} USART_OVS_TypeDef;
+
+static inline void USART_IntEnable(USART_TypeDef *usart, uint32_t flags)
+{
+	usart->IEN |= flags;
+}
+
+static inline void USART_IntDisable(USART_TypeDef *usart, uint32_t flags)
+{
+	usart->IEN &= ~flags;
+}
+
+static inline void USART_IntClear(USART_TypeDef *usart, uint32_t flags)
+{
+	(void)usart;
+	(void)flags;
+}
+
+static inline uint32_t USART_IntGet(USART_TypeDef *usart)
+{
+	(void)usart;
+	return 0;
+}
+
+static inline uint32_t USART_BaudrateGet(USART_TypeDef *usart)
+{
+	return usart->baud;
+}
+
+static inline void USART_BaudrateAsyncSet(USART_TypeDef *usart, uint32_t ref,
+		uint32_t baud, USART_OVS_TypeDef ovs)
+{
+	(void)ref;
+	(void)ovs;
+	usart->baud = baud;
+}
+
+#endif
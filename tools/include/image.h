@@ -0,0 +1,63 @@
+/*
+ * Console tool for bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Flash image files
+ */
+
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include <stdint.h>
+
+/*
+ * Continuous populated memory range
+ */
+struct image_seg {
+	uint32_t addr;
+	uint32_t len;
+	uint8_t *data;
+};
+
+/*
+ * Image segments sorted by address, adjacent ranges merged
+ */
+struct image {
+	struct image_seg *segs;
+	int nsegs;
+	/* populated bytes */
+	uint32_t size;
+	/* mapped file, binary segment data points into it */
+	void *map;
+	size_t map_len;
+};
+
+/*
+ * \brief load image from Intel HEX, Motorola SREC, ELF or binary file.
+ *        Binary file is placed at address \addr.
+ */
+int image_load(struct image *img, const char *path, uint32_t addr);
+
+void image_free(struct image *img);
+
+/*
+ * \brief copy image data of range to \buf, unpopulated bytes
+ *        are filled with erased flash value 0xff.
+ */
+void image_fill(const struct image *img, uint32_t addr, uint32_t len, uint8_t *buf);
+
+/*
+ * \brief CRC-32 of segment addresses, sizes and data
+ */
+uint32_t image_digest(const struct image *img);
+
+/*
+ * \brief call \cb for each run of consecutive flash pages
+ *        covering populated ranges.
+ */
+int image_pages(const struct image *img, uint32_t page_size,
+		int (*cb)(void *arg, uint32_t addr, uint32_t len), void *arg);
+
+#endif
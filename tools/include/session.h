@@ -0,0 +1,44 @@
+/*
+ * Console tool for bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Flashing session journal
+ */
+
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <stdint.h>
+
+/*
+ * Journal of one device flashing, stored in file <dir>/<EUI48>.session
+ */
+struct session {
+	char *path;
+	uint64_t id;
+	/* digest of image */
+	uint32_t image;
+	/* all packets below address are acknowledged */
+	uint32_t addr;
+	/* journal of the same image and device is found */
+	int valid;
+};
+
+/*
+ * \brief open journal of device \id in directory \dir,
+ *        previous session is valid if it was for the same image.
+ */
+int session_open(struct session *s, const char *dir, uint64_t id, uint32_t image);
+
+int session_save(struct session *s, uint32_t addr);
+
+/*
+ * \brief remove journal of completed session
+ */
+void session_done(struct session *s);
+
+void session_close(struct session *s);
+
+#endif
@@ -6,34 +6,36 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
+#ifndef __MINGW32__
+#include <poll.h>
+#endif
 
 #include "btlproto.h"
 
 #include "serial.h"
 
+#include "btlctl.h"
+
 #include "dump_hex.h"
 
-#ifdef DEBUG
-# define dbg			printf
-# define dbg_dump_hex		dump_hex
-#else
-# define dbg(...)
-# define dbg_dump_hex(...)
-#endif
+/* inter-byte gap after which incomplete packet is dropped, mS */
+#define BTL_GAP_TIMEOUT		20
 
-static uint8_t crc8_cal_buf(const void *data, int len)
-{
-	int i;
-	uint8_t crc = 0;
-	const uint8_t *p = data;
+const uint8_t btl_eui_broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 
-	for (i = 0; i < len; i++)
-		crc = crc8_calc(crc, *p++, BTL_CRC_POLY);
+static const struct btl_cmd_desc btl_cmds[BTL_CMD_SLOTS] = {
+	BTL_COMMANDS(BTL_CMD_DESC)
+};
 
-	return crc;
+const struct btl_cmd_desc *btl_cmd(uint8_t cmd)
+{
+	return btl_cmd_find(btl_cmds, cmd);
 }
 
 static void btl_dump_pkt(const char *prefix, const btl_packet_t *pkt)
@@ -47,92 +49,349 @@ static void btl_dump_pkt(const char *prefix, const btl_packet_t *pkt)
 	dbg("CRC     : %02x\n", btl_packet_crc(pkt));
 }
 
-int btl_write(serial_handle fd, uint8_t cmd, uint8_t status, uint32_t addr,
-		const void *data, unsigned int len)
+void btl_port_init(btl_port_t *port, serial_handle fd, int timeout)
 {
-	uint8_t buf[BTL_MAX_PKT_SIZE];
-	btl_packet_t *pkt = (btl_packet_t *)buf;
+	port->fd = fd;
+	port->head = port->tail = 0;
+	btl_decoder_reset(&port->dec);
+	port->timeout = timeout;
+	port->srtt = 0;
+	port->rttvar = 0;
+	port->rto = timeout;
+	port->dst = NULL;
+	port->echo = 0;
+	port->skip = 0;
+	port->via = NULL;
+}
 
-	pkt->prefix = BTL_PKT_PREXIX;
-	pkt->size = len;
-	pkt->cmd = cmd;
-	pkt->status = 0;
-	pkt->addr = addr;
+static long btl_time_ms(void)
+{
+	struct timespec ts;
 
-	if (len > BTL_MAX_DATA_SIZE)
-		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long btl_time_us(void)
+{
+	struct timespec ts;
 
-	if (data && len)
-		memcpy(pkt->data, data, len);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	btl_packet_crc(pkt) = crc8_cal_buf(btl_start_crc(pkt), btl_size_crc(pkt));
+static void btl_rto_set(btl_port_t *port, long ms)
+{
+	if (ms < BTL_RTO_MIN)
+		ms = BTL_RTO_MIN;
+	if (ms > port->timeout)
+		ms = port->timeout;
+	port->rto = ms;
+}
+
+/*
+ * Estimation as in TCP (RFC 6298), gains 1/8 and 1/4
+ */
+void btl_rtt_sample(btl_port_t *port, long us)
+{
+	long err;
+
+	if (us < 1)
+		us = 1;
+
+	if (!port->srtt) {
+		port->srtt = us;
+		port->rttvar = us / 2;
+	} else {
+		err = us - port->srtt;
+		if (err < 0)
+			err = -err;
+		port->rttvar += (err - port->rttvar) / 4;
+		port->srtt += (us - port->srtt) / 8;
+	}
+
+	btl_rto_set(port, (port->srtt + 4 * port->rttvar + 999) / 1000);
+}
+
+void btl_rto_backoff(btl_port_t *port)
+{
+	btl_rto_set(port, 2L * port->rto);
+}
+
+/*
+ * \brief build packet in \buf.
+ * \return packet size or -1 if data does not fit
+ *         or breaks payload rules of command table.
+ */
+static int btl_make_packet(void *buf, uint8_t cmd, uint8_t status, uint32_t addr,
+		const void *data, unsigned int len)
+{
+	const struct btl_cmd_desc *d = btl_cmd(cmd);
+	btl_packet_t *pkt = buf;
+
+	if (len > BTL_MAX_DATA_SIZE || (d && (len < d->min || len > d->max))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	btl_encode(pkt, cmd, status, addr, data, len);
 
 	btl_dump_pkt("TX", pkt);
 	dbg_dump_hex(pkt, btl_size_pkt(pkt), 0);
 
-	return serial_write(fd, pkt, btl_size_pkt(pkt));
+	return btl_size_pkt(pkt);
 }
 
-static int btl_read_byte(serial_handle fd, void *buf, unsigned int len)
+/*
+ * \brief build address header in \buf if \dst is set
+ * \return header size
+ */
+static int btl_make_addr(void *buf, const uint8_t *dst)
 {
-	uint8_t c, crc;
-	uint8_t *p = buf;
-	btl_packet_t *pkt = buf;
-	int err;
+	if (!dst)
+		return 0;
 
-	if ((err = serial_read(fd, &c, 1)) != 1)
-		return err;
+	return btl_encode_addr(buf, dst);
+}
 
-	p[len] = c;
-	dbg("R: %02x\n", c);
+/*
+ * \brief write to serial port, on single wire line the same
+ *        number of received bytes is own echo.
+ */
+static int btl_send(btl_port_t *port, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t n;
+	int sz;
 
-	if (len == 0) {
-		/* prefix */
-		if (c != BTL_PKT_PREXIX)
-			return 0;
-		return 1;
+	if (port->via) {
+		for (sz = 0; (size_t)sz < len; sz += n) {
+			n = len - sz;
+			if (n > BTL_MAX_DATA_SIZE)
+				n = BTL_MAX_DATA_SIZE;
+			if (btl_write(port->via, BTL_CMD_FORWARD, 0, 0, &p[sz], n) < 0)
+				return -1;
+		}
+		return sz;
 	}
 
-	len++;
-	if (len < sizeof(btl_packet_t)) {
-		/* header */
-		return len;
+	sz = serial_write(port->fd, buf, len);
+
+	if (sz > 0 && port->echo)
+		port->skip += sz;
+	return sz;
+}
+
+int btl_write(btl_port_t *port, uint8_t cmd, uint8_t status, uint32_t addr,
+		const void *data, unsigned int len)
+{
+	uint8_t buf[BTL_ADDR_HDR_SIZE + BTL_MAX_PKT_SIZE];
+	int hdr, sz;
+
+	hdr = btl_make_addr(buf, port->dst);
+	if ((sz = btl_make_packet(&buf[hdr], cmd, status, addr, data, len)) < 0)
+		return -1;
+
+	return btl_send(port, buf, hdr + sz);
+}
+
+int btl_stream_add(btl_stream_t *st, uint8_t cmd, uint8_t status, uint32_t addr,
+		const void *data, unsigned int len)
+{
+	void *p;
+	int hdr, sz;
+
+	if ((st->count & (BTL_STREAM_GROW - 1)) == 0) {
+		p = realloc(st->buf, (st->count + BTL_STREAM_GROW) *
+				(BTL_ADDR_HDR_SIZE + BTL_MAX_PKT_SIZE));
+		if (!p)
+			return -1;
+		st->buf = p;
+
+		p = realloc(st->off, (st->count + BTL_STREAM_GROW + 1) * sizeof(st->off[0]));
+		if (!p)
+			return -1;
+		st->off = p;
+		st->off[0] = 0;
+
+		p = realloc(st->addr, (st->count + BTL_STREAM_GROW) * sizeof(st->addr[0]));
+		if (!p)
+			return -1;
+		st->addr = p;
 	}
 
-	if (len < btl_size_pkt(pkt))
+	hdr = btl_make_addr(&st->buf[st->off[st->count]], st->dst);
+	sz = btl_make_packet(&st->buf[st->off[st->count] + hdr], cmd, status, addr, data, len);
+	if (sz < 0)
+		return -1;
+	sz += hdr;
+
+	st->addr[st->count] = addr;
+	st->count++;
+	st->off[st->count] = st->off[st->count - 1] + sz;
+	return 0;
+}
+
+int btl_stream_write(btl_port_t *port, const btl_stream_t *st,
+		unsigned int first, unsigned int n)
+{
+	return btl_send(port, &st->buf[st->off[first]],
+			st->off[first + n] - st->off[first]);
+}
+
+void btl_stream_free(btl_stream_t *st)
+{
+	free(st->buf);
+	free(st->off);
+	free(st->addr);
+	memset(st, 0, sizeof(btl_stream_t));
+}
+
+/*
+ * \brief read data of FORWARD frames from unit into receive buffer
+ * \return number of bytes read, 0 on timeout.
+ */
+static int btl_fill_via(btl_port_t *port, long ms)
+{
+	uint8_t cmd;
+	int len;
+
+	do {
+		len = btl_read_timeout(port->via, ms, &cmd, NULL, NULL,
+				&port->buf[port->head]);
+		if (len < 0)
+			return errno == ETIMEDOUT ? 0 : len;
+	} while (cmd != (BTL_CMD_FORWARD | BTL_PKT_REPLY) || !len);
+
+	port->head += len;
+	return len;
+}
+
+/*
+ * \brief read all bytes available on serial port into receive buffer,
+ *        wait for data no longer than \ms milliseconds.
+ * \return number of bytes read, 0 on timeout.
+ */
+static int btl_fill(btl_port_t *port, long ms)
+{
+	int len, sz;
+
+	if (port->tail == port->head) {
+		port->tail = port->head = 0;
+	} else if (port->head > sizeof(port->buf) - BTL_MAX_DATA_SIZE) {
+		memmove(port->buf, &port->buf[port->tail], port->head - port->tail);
+		port->head -= port->tail;
+		port->tail = 0;
+	}
+
+	if (port->via)
+		return btl_fill_via(port, ms);
+
+again:
+#ifdef __MINGW32__
+	(void)ms;
+	len = serial_read(port->fd, &port->buf[port->head], 1);
+#else
+	struct pollfd pfd = {
+		.fd = port->fd,
+		.events = POLLIN,
+	};
+
+	if ((len = poll(&pfd, 1, ms)) <= 0)
 		return len;
 
-	/* packet complete */
-	btl_dump_pkt("RX", pkt);
-	dbg_dump_hex(pkt, btl_size_pkt(pkt), 0);
+	len = read(port->fd, &port->buf[port->head], sizeof(port->buf) - port->head);
+	if (len == 0) {
+		/* port closed */
+		errno = EIO;
+		return -1;
+	}
+#endif
+	if (len < 0)
+		return len;
 
-	crc = crc8_cal_buf(btl_start_crc(pkt), btl_size_crc(pkt));
-	if (btl_packet_crc(pkt) != crc) {
-		dbg("CRC %02x invalid, calc %02x\n", btl_packet_crc(pkt), crc);
-		return 0;
+	/* drop echo, it comes before any reply to it */
+	if (port->skip) {
+		sz = (unsigned long)len < port->skip ? len : (int)port->skip;
+		memmove(&port->buf[port->head], &port->buf[port->head + sz], len - sz);
+		port->skip -= sz;
+		len -= sz;
+		if (!len)
+			goto again;
 	}
 
-	return 256;
+	dbg("R: %d bytes\n", len);
+	port->head += len;
+	return len;
 }
 
-int btl_read(serial_handle fd, uint8_t *cmd, uint8_t *status, uint32_t *addr, void *data)
+/*
+ * \brief feed received bytes to frame decoder
+ * \return packet or NULL if more data is required.
+ */
+static btl_packet_t *btl_parse(btl_port_t *port)
 {
-	int len;
-	int fail;
-	int sz;
-	uint8_t buf[BTL_MAX_PKT_SIZE];
-	btl_packet_t *pkt = (btl_packet_t *)buf;
-
-	sz = len = 0;
-	fail = 0;
-	while ((sz = btl_read_byte(fd, buf, len)) != 256) {
-		if (sz < 0)
-			return sz;
-
-		len = sz;
-		if (sz == 0) {
-			if (++fail > 3)
-				return -1;
+	btl_packet_t *pkt = btl_decoder_pkt(&port->dec);
+	unsigned int used;
+	int res;
+
+	while ((res = btl_decode_feed(&port->dec, &port->buf[port->tail],
+				port->head - port->tail, &used)) < 0) {
+		port->tail += used;
+		dbg("Frame dropped, %s invalid\n", res == BTL_DEC_ECRC ? "CRC" : "size");
+	}
+	port->tail += used;
+
+	if (res == BTL_DEC_MORE)
+		return NULL;
+
+	btl_dump_pkt("RX", pkt);
+	dbg_dump_hex(pkt, btl_size_pkt(pkt), 0);
+	return pkt;
+}
+
+void btl_flush(btl_port_t *port, int ms)
+{
+	port->head = port->tail = 0;
+	btl_decoder_reset(&port->dec);
+	while (btl_fill(port, ms) > 0)
+		port->head = port->tail = 0;
+	/* line is quiet, echo lost on it is not waited for */
+	port->skip = 0;
+}
+
+int btl_read_timeout(btl_port_t *port, int timeout, uint8_t *cmd, uint8_t *status,
+		uint32_t *addr, void *data)
+{
+	btl_packet_t *pkt;
+	long deadline = btl_time_ms() + timeout;
+	long ms;
+	int err;
+
+	while ((pkt = btl_parse(port)) == NULL) {
+		ms = deadline - btl_time_ms();
+		if (ms < 0)
+			ms = 0;
+
+		/* incomplete packet waits for the rest no longer than gap */
+		if (port->dec.len && ms > BTL_GAP_TIMEOUT)
+			ms = BTL_GAP_TIMEOUT;
+
+		if ((err = btl_fill(port, ms)) < 0)
+			return err;
+
+		if (err)
+			continue;
+
+		if (port->dec.len) {
+			/* false prefix or truncated packet, resync */
+			btl_decode_skip(&port->dec);
+			continue;
+		}
+
+		if (btl_time_ms() >= deadline) {
+			errno = ETIMEDOUT;
+			return -1;
 		}
 	}
 
@@ -148,3 +407,8 @@ int btl_read(serial_handle fd, uint8_t *cmd, uint8_t *status, uint32_t *addr, vo
 	return pkt->size;
 }
 
+int btl_read(btl_port_t *port, uint8_t *cmd, uint8_t *status, uint32_t *addr, void *data)
+{
+	return btl_read_timeout(port, port->rto, cmd, status, addr, data);
+}
+
@@ -0,0 +1,705 @@
+/*
+ * Console tool for bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Link simulator, emulated bootloader behind pseudo terminal,
+ * bytes of both directions pass a serial line model with faults
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+
+#include "failure.h"
+#include "progopt.h"
+#include "btlproto.h"
+#include "btlcodec.h"
+#include "emu.h"
+
+#define XINTSTR(s)			INTSTR(s)
+#define INTSTR(s)			#s
+
+#define BAUD_RATE_DEFAULT		115200
+/* mean length of error burst, bytes */
+#define LINK_BURST_LEN			8
+/* bytes in flight of one direction */
+#define LINK_QUEUE_LEN			65536
+/* start, data and stop bits */
+#define LINK_BYTE_BITS			10
+/* device loop runs at least every mS, as gap timer needs */
+#define SIM_TICK_NS			1000000L
+/* poll interval while no terminal is connected */
+#define SIM_HUP_NS			10000000L
+
+/*
+ * One direction of serial line, faults of every byte are drawn from
+ * own generator in fixed count, so the same byte of a run is hit
+ * on every run with the same seed.
+ */
+struct link {
+	const char *name;
+	/* byte time on line */
+	int64_t byte_ns;
+	/* thresholds of 32 bit random numbers */
+	uint32_t ber;
+	uint32_t burst;
+	uint32_t drop;
+	unsigned int burst_len;
+	int64_t latency;
+	uint32_t jitter;
+	uint32_t rnd;
+	/* bytes left of current burst */
+	unsigned int in_burst;
+	/* line is busy until */
+	int64_t busy;
+	/* delivery time of last byte, bytes are not reordered */
+	int64_t last;
+	struct {
+		int64_t due;
+		uint8_t c;
+	} q[LINK_QUEUE_LEN];
+	unsigned int head;
+	unsigned int tail;
+	struct {
+		unsigned long bytes;
+		unsigned long corrupt;
+		unsigned long bits;
+		unsigned long dropped;
+		unsigned long bursts;
+	} st;
+};
+
+struct btlsim_conf {
+	int help;
+	int baud;
+	char *ber;
+	char *burst;
+	int burst_len;
+	char *drop;
+	int latency;
+	int jitter;
+	int seed;
+	int miss;
+	char *path;
+	int selftest;
+};
+
+#define BTLSIM_OPT(s, l, d, t, o, v) \
+		PROG_OPT(s, l, d, t, struct btlsim_conf, o, v)
+
+#define BTLSIM_OPT_NO(s, l, d, o, v)		BTLSIM_OPT(s, l, d, OPT_NO, o, v)
+#define BTLSIM_OPT_INT(s, l, d, o)		BTLSIM_OPT(s, l, d, OPT_INT, o, 0)
+#define BTLSIM_OPT_STR(s, l, d, o)		BTLSIM_OPT(s, l, d, OPT_STRING, o, 0)
+
+static struct prog_option btlsim_options[] = {
+	BTLSIM_OPT_NO('h', "help", "help usage", help, 1),
+	BTLSIM_OPT_INT('b', "baud", "line baud rate, default " XINTSTR(BAUD_RATE_DEFAULT)
+				    ",\n\t\tBAUD command of btlctl changes it", baud),
+	BTLSIM_OPT_STR('e', "ber", "bit error rate, e.g. 1e-5", ber),
+	BTLSIM_OPT_STR('B', "burst", "probability of error burst start per byte,\n"
+				     "\t\tbits of burst are random", burst),
+	BTLSIM_OPT_INT('L', "burst-len", "mean burst length in bytes, default "
+					 XINTSTR(LINK_BURST_LEN), burst_len),
+	BTLSIM_OPT_STR('x', "drop", "probability of byte loss", drop),
+	BTLSIM_OPT_INT('l', "latency", "one-way latency, uS", latency),
+	BTLSIM_OPT_INT('j', "jitter", "random addition to latency up to uS", jitter),
+	BTLSIM_OPT_INT('s', "seed", "seed of fault generators, default 1", seed),
+	BTLSIM_OPT_INT('m', "miss", "every n-th WRITE or SWRITE frame of host loses\n"
+				    "\t\ta data byte which CRC-8 does not catch", miss),
+	BTLSIM_OPT_STR('p', "path", "symbolic link to pseudo terminal for btlctl -d", path),
+	BTLSIM_OPT_NO('Y', "selftest", "pass AES-128-CTR vectors through CRYPT and WRITE\n"
+				       "\t\tand check READ and SREAD of key are refused\n"
+				       "\t\ton device built with SIM_DEFS=\"-DBTL_ENCRYPT\n"
+				       "\t\t-DBTL_ENC_KEY=<2b7e151628aed2a6abf7158809cf4f3c>\"", selftest, 1),
+	PROG_END,
+};
+
+#define OPT_LEN		(sizeof(btlsim_options) / sizeof(btlsim_options[0]))
+
+static void usage(char *prog, struct prog_option *opt)
+{
+	fprintf(stderr, "Usage: %s [options]\n", prog);
+	prog_option_printf(stderr, opt);
+	exit(EXIT_FAILURE);
+}
+
+static int64_t sim_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift32 */
+static uint32_t link_rand(struct link *l)
+{
+	l->rnd ^= l->rnd << 13;
+	l->rnd ^= l->rnd >> 17;
+	l->rnd ^= l->rnd << 5;
+	return l->rnd;
+}
+
+static uint32_t link_prob(const char *name, const char *s)
+{
+	double p;
+	char *end;
+
+	if (!s)
+		return 0;
+
+	p = strtod(s, &end);
+	if (*end || p < 0 || p > 1)
+		failure(0, "Invalid %s probability %s", name, s);
+
+	return p >= 1 ? UINT32_MAX : (uint32_t)(p * 4294967296.0);
+}
+
+static void link_set_baud(struct link *l, uint32_t baud)
+{
+	l->byte_ns = LINK_BYTE_BITS * 1000000000LL / baud;
+}
+
+static void link_init(struct link *l, const char *name, const struct btlsim_conf *cfg,
+		uint32_t seed)
+{
+	memset(l, 0, sizeof(*l));
+	l->name = name;
+	link_set_baud(l, cfg->baud);
+	l->ber = link_prob("bit error", cfg->ber);
+	l->burst = link_prob("burst", cfg->burst);
+	l->drop = link_prob("drop", cfg->drop);
+	l->burst_len = cfg->burst_len;
+	l->latency = cfg->latency * 1000LL;
+	l->jitter = cfg->jitter;
+	/* zero state stays zero */
+	l->rnd = seed ? seed : 1;
+}
+
+/*
+ * \brief send byte at time \now, it is delivered after line time,
+ *        latency and jitter unless it is dropped
+ */
+static void link_put(struct link *l, uint8_t c, int64_t now)
+{
+	uint32_t drop = link_rand(l);
+	uint32_t burst = link_rand(l);
+	uint32_t len = link_rand(l);
+	uint32_t jitter = link_rand(l);
+	uint8_t err = 0;
+	int64_t due;
+	int i;
+
+	if (l->in_burst == 0 && burst < l->burst) {
+		l->in_burst = 1 + len % (2 * l->burst_len - 1);
+		l->st.bursts++;
+	}
+
+	for (i = 0; i < 8; i++) {
+		if (l->in_burst ? link_rand(l) & 1 : link_rand(l) < l->ber)
+			err |= 1 << i;
+	}
+	if (l->in_burst)
+		l->in_burst--;
+
+	if (l->busy < now)
+		l->busy = now;
+	l->busy += l->byte_ns;
+	l->st.bytes++;
+
+	if (err) {
+		c ^= err;
+		l->st.corrupt++;
+		l->st.bits += __builtin_popcount(err);
+	}
+
+	if (drop < l->drop || l->head - l->tail == LINK_QUEUE_LEN) {
+		l->st.dropped++;
+		return;
+	}
+
+	due = l->busy + l->latency;
+	if (l->jitter)
+		due += (jitter % (l->jitter + 1)) * 1000LL;
+	if (due < l->last)
+		due = l->last;
+	l->last = due;
+
+	l->q[l->head % LINK_QUEUE_LEN].due = due;
+	l->q[l->head % LINK_QUEUE_LEN].c = c;
+	l->head++;
+}
+
+/*
+ * \return byte delivered by time \now or -1
+ */
+static int link_get(struct link *l, int64_t now)
+{
+	if (l->head == l->tail || l->q[l->tail % LINK_QUEUE_LEN].due > now)
+		return -1;
+
+	return l->q[l->tail++ % LINK_QUEUE_LEN].c;
+}
+
+/*
+ * \brief time of next delivery, or \def if line is empty
+ */
+static int64_t link_next(struct link *l, int64_t def)
+{
+	if (l->head == l->tail)
+		return def;
+
+	return l->q[l->tail % LINK_QUEUE_LEN].due;
+}
+
+static void link_flush(struct link *l)
+{
+	l->tail = l->head;
+}
+
+static void link_report(struct link *l)
+{
+	printf("  %-15s: %lu bytes, %lu corrupted (%lu bits), %lu dropped, %lu bursts\n",
+	       l->name, l->st.bytes, l->st.corrupt, l->st.bits, l->st.dropped, l->st.bursts);
+	memset(&l->st, 0, sizeof(l->st));
+}
+
+static struct {
+	int fd;
+	uint32_t baud;
+	struct link up;
+	struct link down;
+	/* host frame held for -m fault, write frames seen and damaged */
+	uint8_t frame[BTL_MAX_PKT_SIZE];
+	unsigned int frame_len;
+	unsigned int miss;
+	unsigned long writes;
+	unsigned long missed;
+	/* terminal is open and bytes passed since it was opened */
+	int active;
+	int64_t start;
+	int64_t end;
+} sim;
+
+/*
+ * \brief send host byte, with -m complete frames are held and every n-th
+ *        write frame is damaged as by a lost data byte: data is shifted
+ *        by one, the next byte on line fills the gap and CRC-8 matches.
+ */
+static void sim_host_put(uint8_t c, int64_t now)
+{
+	btl_packet_t *pkt = (btl_packet_t *)sim.frame;
+	unsigned int i;
+
+	if (!sim.miss || (sim.frame_len == 0 && c != BTL_PKT_PREXIX)) {
+		link_put(&sim.up, c, now);
+		return;
+	}
+
+	sim.frame[sim.frame_len++] = c;
+	if (sim.frame_len <= offsetof(btl_packet_t, size) ||
+	    (pkt->size <= BTL_MAX_DATA_SIZE && sim.frame_len < btl_size_pkt(pkt)))
+		return;
+
+	if (pkt->size <= BTL_MAX_DATA_SIZE && pkt->size > 1 &&
+	    (pkt->cmd == BTL_CMD_WRITE || pkt->cmd == BTL_CMD_SWRITE) &&
+	    ++sim.writes % sim.miss == 0) {
+		memmove(pkt->data, pkt->data + 1, pkt->size - 1);
+		pkt->data[pkt->size - 1] = BTL_PKT_PREXIX;
+		btl_packet_crc(pkt) = btl_crc8(btl_start_crc(pkt), btl_size_crc(pkt));
+		sim.missed++;
+	}
+
+	for (i = 0; i < sim.frame_len; i++)
+		link_put(&sim.up, sim.frame[i], now);
+	sim.frame_len = 0;
+}
+
+static void sim_tx(void *arg, const void *buf, int len)
+{
+	const uint8_t *p = buf;
+	int64_t now = sim_time_ns();
+
+	(void)arg;
+	while (len--)
+		link_put(&sim.down, *p++, now);
+}
+
+/*
+ * \brief bytes not yet on line, as bytes of TX queue of device
+ */
+static unsigned int sim_tx_queued(void *arg)
+{
+	int64_t left = sim.down.busy - sim_time_ns();
+
+	(void)arg;
+	return left > 0 ? left / sim.down.byte_ns : 0;
+}
+
+/*
+ * \brief both ends switch after reply of BAUD command
+ */
+static void sim_baud(void *arg, uint32_t baud)
+{
+	(void)arg;
+	link_set_baud(&sim.up, baud);
+	link_set_baud(&sim.down, baud);
+	sim.baud = baud;
+}
+
+static const struct emu_ops sim_ops = {
+	.tx = sim_tx,
+	.tx_queued = sim_tx_queued,
+	.baud = sim_baud,
+};
+
+/*
+ * \brief goodput of session, bytes programmed first time per second,
+ *        and retransmit cost as flash writes over programmed bytes
+ */
+static void sim_report(void)
+{
+	struct emu_stats st;
+	double sec = (sim.end - sim.start) / 1e9;
+	double line = sim.baud / (double)LINK_BYTE_BITS;
+
+	emu_get_stats(&st, 1);
+
+	printf("Session %.3f s, %u baud\n", sec, sim.baud);
+	link_report(&sim.up);
+	link_report(&sim.down);
+	if (sim.miss) {
+		printf("  %-15s: %lu frames damaged past CRC-8\n", "write", sim.missed);
+		sim.missed = 0;
+	}
+	printf("  %-15s: %u frames, %u CRC errors, %u size errors, "
+	       "%u timeouts, %u RX drops\n", "device",
+	       st.frames, st.crc_err, st.size_err, st.timeout, st.rx_drop);
+	printf("  %-15s: %u bytes programmed, %u written, %.1f%% rewritten, %u erased\n",
+	       "flash", st.programmed, st.written,
+	       st.programmed ? 100.0 * (st.written - st.programmed) / st.programmed : 0,
+	       st.erased);
+	if (sec > 0)
+		printf("  %-15s: %.0f B/s, %.1f%% of line rate\n", "goodput",
+		       st.programmed / sec, 100.0 * st.programmed / sec / line);
+	fflush(stdout);
+}
+
+static void sim_sleep(int64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * \brief write all bytes, pseudo terminal buffer is drained by btlctl
+ */
+static void sim_write(const uint8_t *buf, int len)
+{
+	int n;
+
+	while (len > 0) {
+		n = write(sim.fd, buf, len);
+		if (n < 0) {
+			if (errno == EIO)
+				return;
+			if (errno != EAGAIN)
+				failure(errno, "Can't write to pseudo terminal");
+			sim_sleep(SIM_TICK_NS);
+			continue;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void sim_run(void)
+{
+	uint8_t buf[4096];
+	struct pollfd pfd;
+	int64_t now, next;
+	int i, n, c, hup;
+
+	for (;;) {
+		now = sim_time_ns();
+
+		/* host to device */
+		while ((n = read(sim.fd, buf, sizeof(buf))) > 0) {
+			if (!sim.active) {
+				sim.active = 1;
+				sim.start = now;
+			}
+			for (i = 0; i < n; i++)
+				sim_host_put(buf[i], now);
+		}
+
+		hup = n < 0 && errno == EIO;
+		if (hup) {
+			/* terminal is closed, session is over */
+			if (sim.active) {
+				sim.active = 0;
+				sim_report();
+			}
+			link_flush(&sim.down);
+			sim.frame_len = 0;
+		}
+
+		/* device main loop keeps up with line, bytes late by host
+		 * scheduling are not dropped by RX buffer */
+		i = 0;
+		while ((c = link_get(&sim.up, now)) >= 0) {
+			emu_rx(c);
+			if (++i % (EMU_RX_BUF_LEN / 2) == 0)
+				emu_poll(now / 1000000);
+		}
+
+		emu_poll(now / 1000000);
+
+		/* device to host */
+		n = 0;
+		while (n < (int)sizeof(buf) && (c = link_get(&sim.down, now)) >= 0)
+			buf[n++] = c;
+		if (n > 0 && sim.active) {
+			sim.end = now;
+			sim_write(buf, n);
+		}
+
+		if (hup) {
+			sim_sleep(SIM_HUP_NS);
+			continue;
+		}
+
+		next = link_next(&sim.up, now + SIM_TICK_NS);
+		if (link_next(&sim.down, next) < next)
+			next = link_next(&sim.down, next);
+		if (next > now + SIM_TICK_NS)
+			next = now + SIM_TICK_NS;
+
+		if (next > now) {
+			struct timespec ts = {
+				.tv_sec = 0,
+				.tv_nsec = next - now,
+			};
+
+			pfd.fd = sim.fd;
+			pfd.events = POLLIN;
+			ppoll(&pfd, 1, &ts, NULL);
+		}
+	}
+}
+
+static void sim_open(struct btlsim_conf *cfg)
+{
+	struct termios tio;
+	const char *name;
+
+	if ((sim.fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0 ||
+	    grantpt(sim.fd) < 0 || unlockpt(sim.fd) < 0 ||
+	    (name = ptsname(sim.fd)) == NULL)
+		failure(errno, "Can't open pseudo terminal");
+
+	/* no echo until btlctl sets up the port */
+	if (tcgetattr(sim.fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(sim.fd, TCSANOW, &tio);
+	}
+
+	if (cfg->path) {
+		unlink(cfg->path);
+		if (symlink(name, cfg->path) < 0)
+			failure(errno, "Can't link %s to %s", cfg->path, name);
+		name = cfg->path;
+	}
+
+	printf("Emulated bootloader at %s, %d baud\n", name, cfg->baud);
+	fflush(stdout);
+}
+
+/* reply of the last request to emulated device */
+static uint8_t selftest_reply[BTL_MAX_PKT_SIZE];
+
+static void selftest_tx(void *arg, const void *buf, int len)
+{
+	(void)arg;
+	if (len <= (int)sizeof(selftest_reply))
+		memcpy(selftest_reply, buf, len);
+}
+
+static unsigned int selftest_tx_queued(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+static void selftest_baud(void *arg, uint32_t baud)
+{
+	(void)arg;
+	(void)baud;
+}
+
+static const struct emu_ops selftest_ops = {
+	.tx = selftest_tx,
+	.tx_queued = selftest_tx_queued,
+	.baud = selftest_baud,
+};
+
+static void selftest_hex(uint8_t *out, const char *hex)
+{
+	unsigned int b;
+
+	for (; *hex; hex += 2) {
+		sscanf(hex, "%2x", &b);
+		*out++ = b;
+	}
+}
+
+/*
+ * \brief request to emulated device, frame is parsed at once
+ * \return 0 if device accepted it
+ */
+static int selftest_cmd(uint8_t cmd, uint32_t addr, const void *data, unsigned int len)
+{
+	uint8_t buf[BTL_MAX_PKT_SIZE];
+	btl_packet_t *pkt = (btl_packet_t *)selftest_reply;
+	int i, n;
+
+	memset(selftest_reply, 0, sizeof(selftest_reply));
+	n = btl_encode(buf, cmd, 0, addr, data, len);
+	for (i = 0; i < n; i++)
+		emu_rx(buf[i]);
+	emu_poll(0);
+
+	return pkt->cmd == (cmd | BTL_PKT_REPLY) && pkt->status == BTL_STATUS_OK ? 0 : -1;
+}
+
+static int selftest_result(const char *name, int pass)
+{
+	printf("%-28s %s\n", name, pass ? "ok" : "FAIL");
+	return pass ? 0 : -1;
+}
+
+/*
+ * \brief SP 800-38A F.5.1 ciphertext written by WRITE packets is
+ *        decrypted on device, counter block starts at the first block
+ *        of vector at flash address. CRYPT mode ends by empty CRYPT and INFO.
+ *        Bootloader area holding the key is not read.
+ */
+static int sim_selftest(void)
+{
+	static const char ctr_pt[] =
+		"6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+		"30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+	static const char ctr_ct[] =
+		"874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+		"5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee";
+	uint8_t iv[BTL_CRYPT_IV_SIZE], pt[64], ct[64], req[8];
+	uint32_t addr = EMU_FLASH_START, ctr;
+	const uint8_t *flash = (const uint8_t *)(uintptr_t)addr;
+	int err = 0;
+
+	selftest_hex(pt, ctr_pt);
+	selftest_hex(ct, ctr_ct);
+
+	/* device counts blocks from address 0 */
+	selftest_hex(iv, "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+	ctr = 0xfcfdfeff - addr / 16;
+	iv[12] = ctr >> 24;
+	iv[13] = ctr >> 16;
+	iv[14] = ctr >> 8;
+	iv[15] = ctr;
+
+	if (selftest_cmd(BTL_CMD_CRYPT, 0, iv, sizeof(iv)) < 0) {
+		printf("Emulated device has no encrypted write\n");
+		return -1;
+	}
+
+	/* unaligned pieces, as packets land on device */
+	selftest_cmd(BTL_CMD_WRITE, addr, ct, 7);
+	selftest_cmd(BTL_CMD_WRITE, addr + 7, ct + 7, 30);
+	selftest_cmd(BTL_CMD_WRITE, addr + 37, ct + 37, sizeof(ct) - 37);
+	err |= selftest_result("CRYPT WRITE AES-128-CTR", !memcmp(flash, pt, sizeof(pt)));
+
+	addr += sizeof(pt);
+	selftest_cmd(BTL_CMD_CRYPT, 0, NULL, 0);
+	selftest_cmd(BTL_CMD_WRITE, addr, ct, sizeof(ct));
+	err |= selftest_result("CRYPT off", !memcmp(flash + sizeof(pt), ct, sizeof(ct)));
+
+	addr += sizeof(ct);
+	selftest_cmd(BTL_CMD_CRYPT, 0, iv, sizeof(iv));
+	selftest_cmd(BTL_CMD_INFO, 0, NULL, 0);
+	selftest_cmd(BTL_CMD_WRITE, addr, ct, sizeof(ct));
+	err |= selftest_result("CRYPT ends on INFO",
+			       !memcmp(flash + sizeof(pt) + sizeof(ct), ct, sizeof(ct)));
+
+	/* no credit, DATA frames would hide reply of accepted SREAD */
+	memset(req, 0, sizeof(req));
+	req[0] = BTL_MAX_DATA_SIZE;
+	err |= selftest_result("READ of key refused",
+			       selftest_cmd(BTL_CMD_READ, BTL_ADDR, req, 4) < 0);
+	err |= selftest_result("SREAD of key refused",
+			       selftest_cmd(BTL_CMD_SREAD, BTL_ADDR, req, 8) < 0);
+
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	struct option opt[OPT_LEN + 1];
+	char optstr[2 * OPT_LEN + 1];
+	struct btlsim_conf conf;
+
+	memset(&conf, 0, sizeof(struct btlsim_conf));
+
+	/* set default values */
+	conf.baud = BAUD_RATE_DEFAULT;
+	conf.burst_len = LINK_BURST_LEN;
+	conf.seed = 1;
+
+	if (prog_option_make(btlsim_options, opt, optstr, OPT_LEN) < 0)
+		failure(0, "Invalid options");
+
+	if (prog_option_load(argc, argv, btlsim_options, opt, optstr, &conf) < 0)
+		usage(argv[0], btlsim_options);
+
+	if (conf.help)
+		usage(argv[0], btlsim_options);
+
+	if (conf.selftest) {
+		if (emu_init(&selftest_ops) < 0)
+			failure(errno, "Can't map flash of emulated device at 0x%x",
+				EMU_FLASH_START);
+		exit(sim_selftest() < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (conf.baud <= 0 || conf.burst_len <= 0 || conf.latency < 0 || conf.jitter < 0 ||
+	    conf.miss < 0)
+		failure(0, "Invalid line parameters");
+
+	/* directions have own generators */
+	link_init(&sim.up, "host -> device", &conf, conf.seed);
+	link_init(&sim.down, "device -> host", &conf, conf.seed ^ 0x9e3779b9);
+	sim.baud = conf.baud;
+	sim.miss = conf.miss;
+
+	if (emu_init(&sim_ops) < 0)
+		failure(errno, "Can't map flash of emulated device at 0x%x",
+			EMU_FLASH_START);
+
+	sim_open(&conf);
+	sim_run();
+
+	return 0;
+}
@@ -0,0 +1,349 @@
+/*
+ * Console tool for bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Emulated bootloader, protocol of device build on host
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "btl.h"
+#include "target.h"
+#include "flash.h"
+#include "usart.h"
+#include "bootlog.h"
+#include "btlport.h"
+
+#include "emu.h"
+
+#define EMU_FLASH_SIZE		(EMU_FLASH_END - EMU_FLASH_START)
+
+static struct {
+	const struct emu_ops *ops;
+	/* ports of bootloader, the only link is on port 0 */
+	struct boot_ports ports;
+	/* device clock, mS */
+	uint32_t ms;
+	uint32_t baud;
+	/* frames passed to link and not yet on line, bytes passed to link */
+	TAILQ_HEAD(, usart_frame) frames;
+	uint32_t tx_bytes;
+	/* RX buffer filled by link */
+	uint8_t rx[EMU_RX_BUF_LEN];
+	unsigned int head;
+	unsigned int tail;
+	/* flash bytes programmed since erase */
+	uint8_t *used;
+	struct emu_stats st;
+	struct usart_stats us;
+	struct flash_stats fs;
+} emu;
+
+uint64_t taget_get_id(void)
+{
+	return EMU_ID;
+}
+
+static int emu_flash_range(unsigned int addr, unsigned int len)
+{
+	return addr >= EMU_FLASH_START && addr <= EMU_FLASH_END &&
+		len <= EMU_FLASH_END - addr;
+}
+
+/* boot journal is out of statistics of flash */
+static int emu_userdata_range(unsigned int addr, unsigned int len)
+{
+	return addr >= EMU_USERDATA_START &&
+		addr <= EMU_USERDATA_START + EMU_USERDATA_SIZE &&
+		len <= EMU_USERDATA_START + EMU_USERDATA_SIZE - addr;
+}
+
+int flash_erase(unsigned int addr, unsigned int len)
+{
+	addr &= ~(BTL_FLASH_PAGE_SIZE - 1);
+	len = (len + BTL_FLASH_PAGE_SIZE - 1) & ~(BTL_FLASH_PAGE_SIZE - 1);
+	if (emu_userdata_range(addr, len)) {
+		memset((void *)(uintptr_t)addr, 0xff, len);
+		return 0;
+	}
+	if (!emu_flash_range(addr, len))
+		return -1;
+
+	memset((void *)(uintptr_t)addr, 0xff, len);
+	memset(&emu.used[addr - EMU_FLASH_START], 0, len);
+	emu.st.erased += len;
+	return 0;
+}
+
+int flash_write(unsigned int addr, const void *data, unsigned int len)
+{
+	uint8_t *p = (uint8_t *)(uintptr_t)addr;
+	const uint8_t *d = data;
+	unsigned int i;
+
+	if (emu_userdata_range(addr, len)) {
+		for (i = 0; i < len; i++)
+			p[i] &= d[i];
+		return len;
+	}
+	if (!emu_flash_range(addr, len))
+		return -1;
+
+	/* programming only clears bits */
+	for (i = 0; i < len; i++) {
+		p[i] &= d[i];
+		if (!emu.used[addr - EMU_FLASH_START + i]) {
+			emu.used[addr - EMU_FLASH_START + i] = 1;
+			emu.st.programmed++;
+		}
+	}
+
+	emu.st.written += len;
+	emu.fs.write_bytes += len;
+	return len;
+}
+
+void flash_get_stats(struct flash_stats *st, int clear)
+{
+	*st = emu.fs;
+	if (clear)
+		memset(&emu.fs, 0, sizeof(emu.fs));
+}
+
+void usart_get_stats(int num, struct usart_stats *st, int clear)
+{
+	(void)num;
+
+	*st = emu.us;
+	if (clear)
+		memset(&emu.us, 0, sizeof(emu.us));
+}
+
+static void emu_tx(const void *buf, int len)
+{
+	emu.us.tx_bytes += len;
+	emu.tx_bytes += len;
+	emu.ops->tx(emu.ops->arg, buf, len);
+}
+
+static int emu_read(void)
+{
+	if (emu.head == emu.tail)
+		return -1;
+
+	return emu.rx[emu.tail++ % EMU_RX_BUF_LEN];
+}
+
+/*
+ * \brief complete frames already on line, as TX interrupt does,
+ *        or all frames passed to link if \all
+ */
+static void emu_frames_done(int all)
+{
+	uint32_t sent = emu.tx_bytes - emu.ops->tx_queued(emu.ops->arg);
+	usart_frame_t *f;
+
+	while ((f = TAILQ_FIRST(&emu.frames)) != NULL) {
+		if (!all && (int32_t)(sent - (uint32_t)f->mark) < 0)
+			return;
+
+		TAILQ_REMOVE(&emu.frames, f, queue);
+		if (f->done)
+			f->done(f->arg, f);
+	}
+}
+
+/*
+ * Port driver of bootloader over link, port 1 has no line
+ */
+int usart_read(int num)
+{
+	return num == 0 ? emu_read() : -1;
+}
+
+int usart_write_frame(int num, usart_frame_t *f)
+{
+	f->pos = 0;
+	if (num != 0 || !f->len) {
+		if (f->done)
+			f->done(f->arg, f);
+		return 0;
+	}
+
+	emu_tx(f->buf, f->len);
+	/* frame is out when link has sent bytes up to its end */
+	f->mark = emu.tx_bytes;
+	TAILQ_INSERT_TAIL(&emu.frames, f, queue);
+	return 0;
+}
+
+/* bytes passed to link are timed by line, device does not wait */
+int usart_tx_flush(int num, uint32_t ms)
+{
+	(void)ms;
+
+	if (num == 0)
+		emu_frames_done(1);
+	return 0;
+}
+
+void usart_set_baudrate(int num, uint32_t baud)
+{
+	if (num != 0)
+		return;
+
+	emu.baud = baud;
+	emu.ops->baud(emu.ops->arg, baud);
+}
+
+uint32_t usart_get_baudrate(int num)
+{
+	return num == 0 ? emu.baud : 0;
+}
+
+/* emulated device has no downstream port, bridged data is lost */
+void usart_bridge(int a, int b)
+{
+	(void)a;
+	(void)b;
+}
+
+int usart_write_buf_timeout(int num, const void *buf, int len, uint32_t ms)
+{
+	(void)num;
+	(void)buf;
+	(void)ms;
+	return len;
+}
+
+int usart_read_buf(int num, void *buf, int len)
+{
+	(void)num;
+	(void)buf;
+	(void)len;
+	return 0;
+}
+
+uint32_t timer_get_ms(void)
+{
+	return emu.ms;
+}
+
+/*
+ * \brief bootloader restart, link counters of interface are kept
+ */
+static void emu_reset(void)
+{
+	btl_if_t *bi = &emu.ports.usart[0].iface;
+	int i;
+
+	emu.st.frames += bi->stats.frames;
+	emu.st.crc_err += bi->stats.crc_err;
+	emu.st.size_err += bi->stats.size_err;
+	emu.st.timeout += bi->stats.timeout;
+
+	/* frames of ports are cleared below */
+	emu_frames_done(1);
+	memset(&emu.ports, 0, sizeof(emu.ports));
+	for (i = 0; i < USART_NUM; i++) {
+		emu.ports.usart[i].iface.port = i;
+		btl_reset(&emu.ports.usart[i].iface);
+	}
+}
+
+/* application is not run, bootloader is entered again */
+void target_reset(void)
+{
+	emu_reset();
+}
+
+/*
+ * \brief map erased flash at address of device
+ */
+static int emu_map(uintptr_t addr, size_t size)
+{
+	void *p;
+
+	p = mmap((void *)addr, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	if (p != (void *)addr) {
+		munmap(p, size);
+		return -1;
+	}
+
+	memset(p, 0xff, size);
+	return 0;
+}
+
+int emu_init(const struct emu_ops *ops)
+{
+	/* bootloader area reads as erased, its code runs on host */
+	if (emu_map(EMU_FLASH_START, EMU_FLASH_SIZE) < 0 ||
+	    emu_map(EMU_USERDATA_START, EMU_USERDATA_SIZE) < 0 ||
+	    emu_map(BTL_ADDR, BTL_SIZE) < 0)
+		return -1;
+
+	if ((emu.used = calloc(1, EMU_FLASH_SIZE)) == NULL)
+		return -1;
+
+	bootlog_init();
+	TAILQ_INIT(&emu.frames);
+	emu.ops = ops;
+	emu_reset();
+	return 0;
+}
+
+void emu_rx(uint8_t c)
+{
+	if (emu.head - emu.tail == EMU_RX_BUF_LEN) {
+		emu.us.rx_drop++;
+		emu.st.rx_drop++;
+		return;
+	}
+
+	emu.rx[emu.head++ % EMU_RX_BUF_LEN] = c;
+	emu.us.rx_bytes++;
+}
+
+void emu_poll(uint32_t ms)
+{
+	struct boot_port *bp = &emu.ports.usart[0];
+	unsigned int tail;
+
+	emu.ms = ms;
+	do {
+		emu_frames_done(0);
+		if (emu.ports.bridge) {
+			/* raw bridge to missing downstream port */
+			emu.tail = emu.head;
+			return;
+		}
+
+		tail = emu.tail;
+		btl_port_handle(&emu.ports, 0);
+		/* main loop of bootloader runs on until input is parsed */
+	} while (emu.tail != tail || (btl_pending(&bp->iface) && !bp->reply_busy));
+}
+
+void emu_get_stats(struct emu_stats *st, int clear)
+{
+	btl_if_t *bi = &emu.ports.usart[0].iface;
+
+	*st = emu.st;
+	st->frames += bi->stats.frames;
+	st->crc_err += bi->stats.crc_err;
+	st->size_err += bi->stats.size_err;
+	st->timeout += bi->stats.timeout;
+
+	if (clear) {
+		memset(&emu.st, 0, sizeof(emu.st));
+		memset(&bi->stats, 0, sizeof(bi->stats));
+	}
+}
@@ -0,0 +1,533 @@
+/*
+ * Console tool for bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Flash image files: Intel HEX, Motorola SREC, ELF and binary
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+
+#include "image.h"
+#include "btlproto.h"
+
+#ifndef __MINGW32__
+# define O_BINARY		0
+#endif
+
+#define ELF_PT_LOAD		1
+
+static int image_add(struct image *img, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+	struct image_seg *seg;
+
+	if (!len)
+		return 0;
+
+	/* extend last segment by adjacent record */
+	seg = img->nsegs ? &img->segs[img->nsegs - 1] : NULL;
+	if (seg && seg->addr + seg->len == addr) {
+		uint8_t *d = realloc(seg->data, seg->len + len);
+		if (!d)
+			return -1;
+		memcpy(&d[seg->len], data, len);
+		seg->data = d;
+		seg->len += len;
+		return 0;
+	}
+
+	seg = realloc(img->segs, (img->nsegs + 1) * sizeof(struct image_seg));
+	if (!seg)
+		return -1;
+
+	img->segs = seg;
+	seg = &img->segs[img->nsegs];
+	if ((seg->data = malloc(len)) == NULL)
+		return -1;
+
+	memcpy(seg->data, data, len);
+	seg->addr = addr;
+	seg->len = len;
+	img->nsegs++;
+	return 0;
+}
+
+static int image_seg_cmp(const void *a, const void *b)
+{
+	const struct image_seg *sa = a, *sb = b;
+
+	if (sa->addr < sb->addr)
+		return -1;
+	return sa->addr > sb->addr;
+}
+
+/*
+ * \brief sort segments by address and merge adjacent and overlapping ones,
+ *        data of later records overrides earlier.
+ */
+static int image_merge(struct image *img)
+{
+	struct image_seg *cur, *seg;
+	uint32_t end;
+	uint8_t *data;
+	int i, n;
+
+	/* stable order for overlapping records */
+	for (i = 1; i < img->nsegs; i++) {
+		struct image_seg tmp = img->segs[i];
+		for (n = i; n > 0 && image_seg_cmp(&img->segs[n - 1], &tmp) > 0; n--)
+			img->segs[n] = img->segs[n - 1];
+		img->segs[n] = tmp;
+	}
+
+	n = 0;
+	img->size = 0;
+	for (i = 0; i < img->nsegs; i++) {
+		seg = &img->segs[i];
+		cur = n ? &img->segs[n - 1] : NULL;
+
+		if (!cur || seg->addr > cur->addr + cur->len) {
+			img->segs[n++] = *seg;
+			continue;
+		}
+
+		end = seg->addr + seg->len;
+		if (end > cur->addr + cur->len) {
+			data = realloc(cur->data, end - cur->addr);
+			if (!data)
+				return -1;
+			cur->data = data;
+			cur->len = end - cur->addr;
+		}
+		memcpy(&cur->data[seg->addr - cur->addr], seg->data, seg->len);
+		free(seg->data);
+	}
+	img->nsegs = n;
+
+	for (i = 0; i < img->nsegs; i++)
+		img->size += img->segs[i].len;
+
+	return 0;
+}
+
+static int hex_byte(const char *p)
+{
+	int hi, lo;
+
+	if (!isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1]))
+		return -1;
+
+	hi = isdigit((unsigned char)p[0]) ? p[0] - '0' : (tolower((unsigned char)p[0]) - 'a' + 10);
+	lo = isdigit((unsigned char)p[1]) ? p[1] - '0' : (tolower((unsigned char)p[1]) - 'a' + 10);
+	return (hi << 4) | lo;
+}
+
+/*
+ * \brief decode hex digits of one line into \buf.
+ * \return number of bytes or -1 on invalid digits.
+ */
+static int hex_line(const char *p, const char *end, uint8_t *buf, int max)
+{
+	int n = 0;
+	int b;
+
+	while (p + 1 < end && isxdigit((unsigned char)*p)) {
+		if (n == max || (b = hex_byte(p)) < 0)
+			return -1;
+		buf[n++] = b;
+		p += 2;
+	}
+	return n;
+}
+
+static int image_load_ihex(struct image *img, const char *text, size_t size)
+{
+	const char *p = text, *end = text + size, *eol;
+	uint8_t rec[260];
+	uint32_t base = 0;
+	uint8_t sum;
+	int len, i;
+
+	for (; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+
+		while (p < eol && isspace((unsigned char)*p))
+			p++;
+		if (p == eol)
+			continue;
+
+		if (*p++ != ':')
+			return -1;
+
+		len = hex_line(p, eol, rec, sizeof(rec));
+		if (len < 5 || len != rec[0] + 5)
+			return -1;
+
+		for (sum = 0, i = 0; i < len; i++)
+			sum += rec[i];
+		if (sum)
+			return -1;
+
+		switch (rec[3]) {
+			case 0x00:
+				/* data */
+				if (image_add(img, base + ((rec[1] << 8) | rec[2]), &rec[4], rec[0]) < 0)
+					return -1;
+				break;
+			case 0x01:
+				/* end of file */
+				return 0;
+			case 0x02:
+				/* extended segment address */
+				base = ((rec[4] << 8) | rec[5]) << 4;
+				break;
+			case 0x04:
+				/* extended linear address */
+				base = ((uint32_t)rec[4] << 24) | ((uint32_t)rec[5] << 16);
+				break;
+			default:
+				/* start address */
+				break;
+		}
+	}
+	return 0;
+}
+
+static int image_load_srec(struct image *img, const char *text, size_t size)
+{
+	const char *p = text, *end = text + size, *eol;
+	uint8_t rec[260];
+	uint32_t addr;
+	uint8_t sum;
+	int len, alen, i;
+
+	for (; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+
+		while (p < eol && isspace((unsigned char)*p))
+			p++;
+		if (p == eol)
+			continue;
+
+		if (eol - p < 2 || p[0] != 'S')
+			return -1;
+
+		switch (p[1]) {
+			case '1':
+				alen = 2;
+				break;
+			case '2':
+				alen = 3;
+				break;
+			case '3':
+				alen = 4;
+				break;
+			case '7':
+			case '8':
+			case '9':
+				/* termination */
+				return 0;
+			default:
+				/* header, count */
+				continue;
+		}
+
+		len = hex_line(p + 2, eol, rec, sizeof(rec));
+		if (len < alen + 2 || len != rec[0] + 1)
+			return -1;
+
+		for (sum = 0, i = 0; i < len; i++)
+			sum += rec[i];
+		if (sum != 0xff)
+			return -1;
+
+		for (addr = 0, i = 0; i < alen; i++)
+			addr = (addr << 8) | rec[1 + i];
+
+		if (image_add(img, addr, &rec[1 + alen], rec[0] - alen - 1) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static uint32_t elf_u32(const uint8_t *p)
+{
+	return ((uint32_t)p[0]) | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t elf_u16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+/*
+ * \brief load PT_LOAD segments of 32 bit little endian ELF at physical address
+ */
+static int image_load_elf(struct image *img, const uint8_t *elf, size_t size)
+{
+	uint32_t phoff, offset, paddr, filesz;
+	unsigned int phentsize, phnum, i;
+	const uint8_t *ph;
+
+	/* ELFCLASS32, ELFDATA2LSB */
+	if (size < 52 || elf[4] != 1 || elf[5] != 1)
+		return -1;
+
+	phoff = elf_u32(&elf[28]);
+	phentsize = elf_u16(&elf[42]);
+	phnum = elf_u16(&elf[44]);
+
+	if (phentsize < 32 || phoff > size || (size - phoff) / phentsize < phnum)
+		return -1;
+
+	for (i = 0; i < phnum; i++) {
+		ph = &elf[phoff + i * phentsize];
+		if (elf_u32(&ph[0]) != ELF_PT_LOAD)
+			continue;
+
+		offset = elf_u32(&ph[4]);
+		paddr = elf_u32(&ph[12]);
+		filesz = elf_u32(&ph[16]);
+
+		if (offset > size || filesz > size - offset)
+			return -1;
+
+		if (image_add(img, paddr, &elf[offset], filesz) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+#ifdef __MINGW32__
+static void *image_map(const char *path, size_t *size)
+{
+	struct stat st;
+	uint8_t *buf;
+	size_t len;
+	ssize_t sz;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_BINARY)) < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || (buf = malloc(st.st_size + 1)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	for (len = 0; len < (size_t)st.st_size; len += sz) {
+		sz = read(fd, &buf[len], st.st_size - len);
+		if (sz <= 0) {
+			free(buf);
+			close(fd);
+			return NULL;
+		}
+	}
+	close(fd);
+
+	*size = len;
+	return buf;
+}
+
+static void image_unmap(void *map, size_t len)
+{
+	(void)len;
+	free(map);
+}
+#else
+static void *image_map(const char *path, size_t *size)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size == 0) {
+		errno = EINVAL;
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	*size = st.st_size;
+	return map;
+}
+
+static void image_unmap(void *map, size_t len)
+{
+	munmap(map, len);
+}
+#endif
+
+static int image_is_text(const uint8_t *data, size_t size, char start)
+{
+	size_t i;
+
+	for (i = 0; i < size && isspace(data[i]); i++)
+		;
+
+	if (i == size || data[i] != start)
+		return 0;
+
+	for (; i < size; i++) {
+		if (!isprint(data[i]) && !isspace(data[i]))
+			return 0;
+	}
+	return 1;
+}
+
+int image_load(struct image *img, const char *path, uint32_t addr)
+{
+	uint8_t *data;
+	size_t size;
+	int err;
+
+	memset(img, 0, sizeof(struct image));
+
+	if ((data = image_map(path, &size)) == NULL)
+		return -1;
+
+	img->map = data;
+	img->map_len = size;
+
+	if (size >= 4 && !memcmp(data, "\177ELF", 4)) {
+		err = image_load_elf(img, data, size);
+	} else if (image_is_text(data, size, ':')) {
+		err = image_load_ihex(img, (const char *)data, size);
+	} else if (image_is_text(data, size, 'S')) {
+		err = image_load_srec(img, (const char *)data, size);
+	} else {
+		/* binary is used in place, without copy */
+		err = 0;
+		img->segs = malloc(sizeof(struct image_seg));
+		if (img->segs) {
+			img->segs->addr = addr;
+			img->segs->len = size;
+			img->segs->data = data;
+			img->nsegs = 1;
+			img->size = size;
+			return 0;
+		}
+		err = -1;
+	}
+
+	if (err == 0)
+		err = image_merge(img);
+
+	if (err < 0) {
+		if (!errno)
+			errno = EINVAL;
+		image_free(img);
+		return -1;
+	}
+
+	/* parsed data is copied, file is not needed anymore */
+	image_unmap(img->map, img->map_len);
+	img->map = NULL;
+	return 0;
+}
+
+void image_free(struct image *img)
+{
+	uint8_t *map = img->map;
+	int i;
+
+	for (i = 0; i < img->nsegs; i++) {
+		if (map && img->segs[i].data >= map && img->segs[i].data < map + img->map_len)
+			continue;
+		free(img->segs[i].data);
+	}
+
+	free(img->segs);
+	if (map)
+		image_unmap(map, img->map_len);
+	memset(img, 0, sizeof(struct image));
+}
+
+void image_fill(const struct image *img, uint32_t addr, uint32_t len, uint8_t *buf)
+{
+	const struct image_seg *seg;
+	uint32_t s, e;
+	int i;
+
+	memset(buf, 0xff, len);
+
+	for (i = 0; i < img->nsegs; i++) {
+		seg = &img->segs[i];
+		s = seg->addr > addr ? seg->addr : addr;
+		e = seg->addr + seg->len < addr + len ? seg->addr + seg->len : addr + len;
+		if (s < e)
+			memcpy(&buf[s - addr], &seg->data[s - seg->addr], e - s);
+	}
+}
+
+uint32_t image_digest(const struct image *img)
+{
+	uint32_t crc = 0;
+	int i;
+
+	for (i = 0; i < img->nsegs; i++) {
+		crc = crc32_calc(crc, &img->segs[i].addr, sizeof(img->segs[i].addr));
+		crc = crc32_calc(crc, &img->segs[i].len, sizeof(img->segs[i].len));
+		crc = crc32_calc(crc, img->segs[i].data, img->segs[i].len);
+	}
+	return crc;
+}
+
+int image_pages(const struct image *img, uint32_t page_size,
+		int (*cb)(void *arg, uint32_t addr, uint32_t len), void *arg)
+{
+	uint32_t start = 0, end = 0, s, e;
+	int i, err;
+
+	for (i = 0; i < img->nsegs; i++) {
+		s = img->segs[i].addr & ~(page_size - 1);
+		e = (img->segs[i].addr + img->segs[i].len + page_size - 1) & ~(page_size - 1);
+
+		if (i && s <= end) {
+			if (e > end)
+				end = e;
+			continue;
+		}
+
+		if (i && (err = cb(arg, start, end - start)) < 0)
+			return err;
+
+		start = s;
+		end = e;
+	}
+
+	if (img->nsegs)
+		return cb(arg, start, end - start);
+
+	return 0;
+}
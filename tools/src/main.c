@@ -6,6 +6,11 @@
  * 2024  Andrey Mitrofanov <avmwww@gmail.com>
  *
  */
+#ifdef __MINGW32__
+/* rand_s() of system generator */
+#define _CRT_RAND_S
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,11 +19,24 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __MINGW32__
+#include <windows.h>
+#else
+#include <termios.h>
+#include <glob.h>
+#endif
 
 #include "failure.h"
 #include "progopt.h"
 #include "serial.h"
 #include "btlctl.h"
+#include "image.h"
+#include "session.h"
+#include "sha256.h"
+#include "ed25519.h"
+#include "aes.h"
 
 //#include "debug.h"
 
@@ -33,15 +51,88 @@
 #define BAUD_RATE_DEFAULT		115200
 
 #define BTL_RETRY			0
+/* packets sent without waiting for reply */
+#define BTL_WINDOW			4
+/* upper bound of reply timeout, mS */
+#define BTL_TIMEOUT			3000
+/* command execution time added to reply timeout, mS */
+#define BTL_ERASE_PAGE_TIME		40
+/* background erase reports progress every n pages */
+#define BTL_ERASE_REPORT		8
+/* lost progress reports recovered during one erase */
+#define BTL_ERASE_RETRY			8
+#define BTL_DIGEST_PAGE_TIME		10
+/* signature check at COMMIT close, ms */
+#define BTL_SIGN_TIME			2000
+/* retransmissions of one frame requested by NACK */
+#define BTL_NACK_RETRY			8
+/* streaming read credit ahead of received data, bytes */
+#define BTL_DUMP_CREDIT			(16 * BTL_MAX_DATA_SIZE)
+/* rounds of broadcast and bitmap poll on bus */
+#define BTL_BUS_ROUNDS			10
+/* session journal is saved every n acknowledged write packets */
+#define BTL_JOURNAL_FRAMES		32
+/* erase test range, filler bytes sent in bursts while it runs
+ * stay below device RX queue size */
+#define BTL_ERASE_TEST_SIZE		(128 * 1024)
+#define BTL_ERASE_TEST_BYTES		384
+#define BTL_ERASE_TEST_BURST		8
+#define BTL_ERASE_TEST_FILL		0x55
 
 #ifndef __MINGW32__
 # define O_BINARY		0
 #endif
 
+struct btlctl_conf;
+
+/*
+ * Device connected to one serial port
+ */
+struct btlctl_dev {
+	struct btlctl_conf *cfg;
+	char *name;
+	serial_handle fd;
+	btl_port_t port;
+	/* EUI48, 0 if unknown */
+	uint64_t id;
+	/* programmed bytes */
+	volatile int bytes;
+	volatile int done;
+	int err;
+	const char *msg;
+	double time;
+	struct session sess;
+	/* first page not confirmed by journal and page digests */
+	uint32_t resume;
+	/* bytes confirmed at resume */
+	int resumed;
+	/* device checks written range with COMMIT */
+	int commit;
+	/* first mismatched page found by COMMIT */
+	uint32_t bad;
+	/* erase progress, bytes */
+	volatile long erase_total;
+	volatile long erased;
+	/* EUI48 of device on shared bus */
+	uint8_t eui[6];
+	/* link to unit bridging frames to device */
+	btl_port_t link;
+	pthread_t thread;
+};
+
 struct btlctl_conf {
 	char *dev;
 	unsigned int baud;
-	serial_handle fd;
+	struct btlctl_dev *devs;
+	int ndevs;
+	/* flash image, read once and shared by all devices */
+	struct image image;
+	/* precomputed write packets of image */
+	btl_stream_t stream;
+	/* digest of image, identifies journal */
+	uint32_t digest;
+	char *journal;
+	int window;
 	int info;
 	int help;
 	char *flash;
@@ -49,6 +140,30 @@ struct btlctl_conf {
 	int skip;
 	int reset;
 	int retry;
+	int rtscts;
+	int stats;
+	int profile;
+	int nack;
+	char *dump;
+	int len;
+	/* EUI48 list of devices on shared bus */
+	char *bus;
+	/* broadcast packets on shared bus */
+	btl_port_t bcast;
+	int echo;
+	int bridge;
+	int frames;
+	int erase_test;
+	/* Ed25519 secret seed file, COMMIT ranges are signed */
+	char *key;
+	int pubkey;
+	uint8_t seed[ED25519_KEY_SIZE];
+	/* AES-128 key file, written data is encrypted */
+	char *enc;
+	struct aes_ctx aes;
+	uint8_t iv[BTL_CRYPT_IV_SIZE];
+	int selftest;
+	int bench;
 };
 
 #define BTLCTL_OPT(s, l, d, t, o, v) \
@@ -61,15 +176,52 @@ struct btlctl_conf {
 static struct prog_option btlctl_options[] = {
 	BTLCTL_OPT_NO('h', "help", "help usage", help, 1),
 	BTLCTL_OPT_NO('i', "info", "bootloader info", info, 1),
-	BTLCTL_OPT_STR('d', "device", "serial device, default " BTLCTL_DEVICE_DEFAULT, dev),
+	BTLCTL_OPT_STR('d', "device", "serial devices separated by comma or glob pattern,\n"
+				      "\t\tdevices are flashed in parallel, "
+				      "default " BTLCTL_DEVICE_DEFAULT, dev),
 	BTLCTL_OPT_INT('b', "baud", "baud rate, default " XINTSTR(BAUD_RATE_DEFAULT), baud),
-	BTLCTL_OPT_STR('f', "flash", "flash binary file", flash),
-	BTLCTL_OPT_INT('a', "addr", "address of flash offset, default 0", addr),
+	BTLCTL_OPT_STR('f', "flash", "flash Intel HEX, SREC, ELF or binary file", flash),
+	BTLCTL_OPT_INT('a', "addr", "address of binary file flash offset or dump start, default 0", addr),
+	BTLCTL_OPT_STR('D', "dump", "read flash range to file, file name gets EUI48 suffix\n"
+				    "\t\tif there are several devices", dump),
+	BTLCTL_OPT_INT('l', "len", "length of dump", len),
 	BTLCTL_OPT_NO('s', "skip", "skip erase of flash", skip, 1),
 	BTLCTL_OPT_NO('r', "reset", "reset bootloader and run app", reset, 1),
 	BTLCTL_OPT_INT('t', "retry", "retry transfer n times\n"
 				     "\t\tif a serial port transmission error "
 				     "is detected, default " XINTSTR(BTL_RETRY), retry),
+	BTLCTL_OPT_INT('w', "window", "number of write packets sent ahead of replies, "
+				      "default " XINTSTR(BTL_WINDOW), window),
+	BTLCTL_OPT_NO('S', "stats", "print bootloader link and flash statistics", stats, 1),
+	BTLCTL_OPT_NO('P', "profile", "print bootloader profiling data (profiling build)", profile, 1),
+	BTLCTL_OPT_NO('T', "erase-test", "erase 128 KB at addr, or at application copy without\n"
+					  "\t\taddr, while bursts of bytes are sent, passes if\n"
+					  "\t\tdevice has no RX overruns and drops", erase_test, 1),
+	BTLCTL_OPT_NO('c', "rtscts", "enable RTS/CTS hardware flow control", rtscts, 1),
+	BTLCTL_OPT_NO('N', "nack", "selective repeat of lost write packets reported by NACK,\n"
+				   "\t\twindow is limited to " XINTSTR(BTL_SR_WINDOW) " packets", nack, 1),
+	BTLCTL_OPT_NO('E', "echo", "single wire half-duplex line, "
+				   "drop echo of sent data,\n"
+				   "\t\tone write packet in flight", echo, 1),
+	BTLCTL_OPT_STR('B', "bus", "EUI48 list of devices sharing one serial port,\n"
+				   "\t\timage is broadcast to all of them at once", bus),
+	BTLCTL_OPT_INT('x', "bridge", "talk to device behind unit, its port runs at baud rate,\n"
+				      "\t\tunit passes all bytes until reset", bridge),
+	BTLCTL_OPT_NO('F', "frames", "bridge passes FORWARD frames only, "
+				     "unit stays reachable", frames, 1),
+	BTLCTL_OPT_STR('k', "key", "Ed25519 secret seed file of 32 bytes, written ranges\n"
+				   "\t\tare signed for bootloader built with SIGN=1", key),
+	BTLCTL_OPT_NO('K', "pubkey", "print public key of seed as SIGNKEY of bootloader build",
+		      pubkey, 1),
+	BTLCTL_OPT_STR('e', "encrypt", "AES-128 key file of 16 bytes, written data is encrypted\n"
+				       "\t\tfor bootloader built with ENCRYPT=1", enc),
+	BTLCTL_OPT_NO('Y', "selftest", "run known answer tests of AES-128-CTR, SHA-256 and Ed25519",
+		      selftest, 1),
+	BTLCTL_OPT_NO('Z', "bench", "measure frames per second parsed by frame decoder\n"
+				    "\t\tfrom clean and noisy streams", bench, 1),
+	BTLCTL_OPT_STR('J', "journal", "directory of flashing session journals,\n"
+				       "\t\tinterrupted flashing is resumed from the "
+				       "first unconfirmed page", journal),
 	PROG_END,
 };
 
@@ -82,17 +234,66 @@ static void usage(char *prog, struct prog_option *opt)
 	exit(EXIT_FAILURE);
 }
 
-static int btl_transfer_single(serial_handle fd, uint8_t cmd, uint32_t addr,
-		void *out, int out_len, void *in)
+#ifdef __MINGW32__
+static int serial_set_rtscts(serial_handle fd, int on)
+{
+	DCB dcb;
+
+	if (!GetCommState(fd, &dcb))
+		return -1;
+
+	dcb.fOutxCtsFlow = on ? TRUE : FALSE;
+	dcb.fRtsControl = on ? RTS_CONTROL_HANDSHAKE : RTS_CONTROL_ENABLE;
+
+	if (!SetCommState(fd, &dcb))
+		return -1;
+	return 0;
+}
+#else
+static int serial_set_rtscts(serial_handle fd, int on)
+{
+	struct termios tio;
+
+	if (tcgetattr(fd, &tio) < 0)
+		return -1;
+
+	if (on)
+		tio.c_cflag |= CRTSCTS;
+	else
+		tio.c_cflag &= ~CRTSCTS;
+
+	return tcsetattr(fd, TCSANOW, &tio);
+}
+#endif
+
+/*
+ * \brief wait until all written data is sent
+ */
+static int serial_drain(serial_handle fd)
+{
+#ifdef __MINGW32__
+	return FlushFileBuffers(fd) ? 0 : -1;
+#else
+	return tcdrain(fd);
+#endif
+}
+
+static int btl_transfer_single(btl_port_t *port, uint8_t cmd, uint32_t addr,
+		void *out, int out_len, void *in, int exec)
 {
-	uint8_t c, sz, st;
+	const struct btl_cmd_desc *d = btl_cmd(cmd);
+	uint8_t c, st;
 	uint32_t a;
+	int sz;
 
-	if (btl_write(fd, cmd, 0, addr, out, out_len) < 0)
+	if (btl_write(port, cmd, 0, addr, out, out_len) < 0)
 		return -1;
 
-	if ((sz = btl_read(fd, &c, &st, &a, in)) < 0)
+	if ((sz = btl_read_timeout(port, port->rto + exec, &c, &st, &a, in)) < 0) {
+		if (errno == ETIMEDOUT)
+			btl_rto_backoff(port);
 		return -1;
+	}
 
 	if ((c & 0x7f) != cmd)
 		return -1;
@@ -100,21 +301,42 @@ static int btl_transfer_single(serial_handle fd, uint8_t cmd, uint32_t addr,
 	if (st != BTL_STATUS_OK)
 		return -1;
 
+	/* reply longer than command table allows */
+	if (d && sz > d->reply)
+		return -1;
+
 	return sz;
 }
 
-static int btl_transfer(serial_handle fd, uint8_t cmd, uint32_t addr,
-		void *out, int out_len, void *in, int retry)
+/*
+ * \brief send command and wait reply no longer than reply timeout
+ *        plus command execution time \exec, mS. Round trip is measured
+ *        on commands without execution time answered at first try.
+ */
+static int btl_transfer_exec(btl_port_t *port, uint8_t cmd, uint32_t addr,
+		void *out, int out_len, void *in, int exec, int retry)
 {
-	int err;
+	long start = btl_time_us();
+	int err, first = 1;
 
-	while ((err = btl_transfer_single(fd, cmd, addr, out, out_len, in)) < 0) {
+	while ((err = btl_transfer_single(port, cmd, addr, out, out_len, in, exec)) < 0) {
 		if (retry-- == 0)
 			break;
+		first = 0;
 	}
+
+	if (err >= 0 && first && !exec)
+		btl_rtt_sample(port, btl_time_us() - start);
+
 	return err;
 }
 
+static int btl_transfer(btl_port_t *port, uint8_t cmd, uint32_t addr,
+		void *out, int out_len, void *in, int retry)
+{
+	return btl_transfer_exec(port, cmd, addr, out, out_len, in, 0, retry);
+}
+
 static void btl_set_u32(void *buf, uint32_t val)
 {
 	uint8_t *p = buf;
@@ -125,30 +347,67 @@ static void btl_set_u32(void *buf, uint32_t val)
 	p[3] = (uint8_t)(val >> 24);
 }
 
-static void bootloader_set_baud(struct btlctl_conf *cfg)
+static uint32_t btl_get_u32(const void *buf)
+{
+	const uint8_t *p = buf;
+
+	return ((uint32_t)p[0]) | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static double btl_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bootloader_set_baud(struct btlctl_dev *dev)
 {
 	int len;
 	uint8_t buf[4];
 
-	btl_set_u32(buf, cfg->baud);
+	btl_set_u32(buf, dev->cfg->baud);
 
-	if ((len = btl_transfer(cfg->fd, BTL_CMD_BAUD, 0, buf, 0, NULL, cfg->retry)) < 0)
+	if ((len = btl_transfer(&dev->port, BTL_CMD_BAUD, 0, buf, 4, NULL, dev->cfg->retry)) < 0)
 		failure(errno, "Bootloader set baud failed");
 }
 
-static void bootloader_reset(struct btlctl_conf *cfg)
+/*
+ * \brief connect to device behind unit, the following requests
+ *        go to the downstream device
+ */
+static void bootloader_bridge(struct btlctl_dev *dev)
+{
+	uint8_t mode = dev->cfg->frames ? BTL_BRIDGE_FRAME : BTL_BRIDGE_RAW;
+
+	if (btl_transfer(&dev->port, BTL_CMD_BRIDGE, dev->cfg->bridge, &mode, 1,
+			 NULL, dev->cfg->retry) < 0)
+		failure(errno, "Bridge to downstream device failed");
+
+	/* round trip time of downstream device is measured anew */
+	dev->link = dev->port;
+	btl_port_init(&dev->port, dev->fd, BTL_TIMEOUT);
+	if (mode == BTL_BRIDGE_FRAME)
+		dev->port.via = &dev->link;
+	else
+		dev->port.echo = dev->link.echo;
+}
+
+static void bootloader_reset(struct btlctl_dev *dev)
 {
 	printf("Reseting system ... ");
-	btl_write(cfg->fd, BTL_CMD_RESET, 0, 0, NULL, 0);
+	btl_write(&dev->port, BTL_CMD_RESET, 0, 0, NULL, 0);
 	printf("\nDone\n");
 }
 
-static void bootloader_info(struct btlctl_conf *cfg)
+static void bootloader_info(struct btlctl_dev *dev)
 {
 	char info[256];
 	int len;
 
-	if ((len = btl_transfer(cfg->fd, BTL_CMD_INFO, 0, NULL, 0, info, cfg->retry)) < 0)
+	if ((len = btl_transfer(&dev->port, BTL_CMD_INFO, 0, NULL, 0, info, dev->cfg->retry)) < 0)
 		failure(errno, "Request bootloader information failed");
 
 	printf("Bootloader information:\n");
@@ -156,112 +415,1904 @@ static void bootloader_info(struct btlctl_conf *cfg)
 	printf("%s\n", info);
 }
 
-static void flash_erase(struct btlctl_conf *cfg, int len)
+static void bootloader_get_stats(struct btlctl_dev *dev, struct btl_stats_s *st,
+		uint32_t flags)
+{
+	int len;
+
+	memset(st, 0, sizeof(*st));
+	if ((len = btl_transfer(&dev->port, BTL_CMD_STATS, flags, NULL, 0, st,
+				dev->cfg->retry)) < 0)
+		failure(errno, "Request bootloader statistics failed");
+
+	if (len < (int)sizeof(*st))
+		failure(0, "Invalid bootloader statistics size %d", len);
+}
+
+static void bootloader_stats(struct btlctl_dev *dev)
+{
+	struct btl_stats_s st;
+
+	bootloader_get_stats(dev, &st, 0);
+
+	printf("Bootloader statistics:\n");
+	printf("Received bytes     : %u\n", st.rx_bytes);
+	printf("Sent bytes         : %u\n", st.tx_bytes);
+	printf("Frames accepted    : %u\n", st.frames);
+	printf("CRC errors         : %u\n", st.crc_err);
+	printf("Size errors        : %u\n", st.size_err);
+	printf("Inter-byte timeouts: %u\n", st.timeout);
+	printf("RX overruns        : %u\n", st.rx_overrun);
+	printf("RX drops           : %u\n", st.rx_drop);
+	printf("TX drops           : %u\n", st.tx_drop);
+	printf("Erase time         : %u us, max %u us\n", st.erase_time, st.erase_max);
+	printf("Write time         : %u us, max %u us\n", st.write_time, st.write_max);
+	printf("Write rate         : %u bytes/ms\n", st.write_rate);
+}
+
+/*
+ * \brief erase BTL_ERASE_TEST_SIZE bytes at addr, bursts of filler bytes
+ *        are sent while device erases, device must take all of them.
+ *        Without addr the copy area is erased, not running application.
+ */
+static void bootloader_erase_test(struct btlctl_dev *dev)
 {
+	struct btlctl_conf *cfg = dev->cfg;
+	int pages = BTL_ERASE_TEST_SIZE / BTL_FLASH_PAGE_SIZE;
+	int bursts = BTL_ERASE_TEST_BYTES / BTL_ERASE_TEST_BURST;
+	uint8_t fill[BTL_ERASE_TEST_BURST];
+	struct btl_stats_s st;
 	uint8_t buf[4];
+	uint8_t cmd, status;
+	uint32_t addr = cfg->addr ? (uint32_t)cfg->addr : BTL_FLASH_APP_ADDR;
+	long gap;
+	int i;
 
-	/* Erase flash area */
-	printf("Erasing flash at address 0x%x, %d bytes ... ", cfg->addr, len);
-	fflush(stdout);
-	fflush(stderr);
-	/* address */
-	btl_set_u32(buf, len);
-	if (btl_transfer(cfg->fd, BTL_CMD_ERASE, cfg->addr, buf, 4, NULL, cfg->retry) < 0)
-		failure(errno, "\nFlash erase failed");
+	printf("Erase test %d KB at 0x%08x, %u baud\n", BTL_ERASE_TEST_SIZE / 1024,
+			addr, cfg->baud);
+	printf("Warning: flash 0x%08x - 0x%08x is erased\n", addr,
+			addr + BTL_ERASE_TEST_SIZE);
+
+	bootloader_get_stats(dev, &st, BTL_STATS_CLEAR);
+
+	btl_set_u32(buf, BTL_ERASE_TEST_SIZE);
+	if (btl_write(&dev->port, BTL_CMD_ERASE, 0, addr, buf, 4) < 0)
+		failure(errno, "Serial write failed");
+
+	/* bursts are spread over the first half of the expected erase time */
+	gap = 1000L * pages * BTL_ERASE_PAGE_TIME / 2 / bursts;
+	memset(fill, BTL_ERASE_TEST_FILL, sizeof(fill));
+	for (i = 0; i < bursts; i++) {
+		usleep(gap);
+		if (serial_write(dev->fd, fill, sizeof(fill)) < 0)
+			failure(errno, "Serial write failed");
+	}
+
+	do {
+		if (btl_read_timeout(&dev->port, pages * BTL_ERASE_PAGE_TIME + BTL_TIMEOUT,
+				     &cmd, &status, NULL, NULL) < 0)
+			failure(errno, "Erase reply failed");
+	} while (cmd != (BTL_CMD_ERASE | BTL_PKT_REPLY));
 
-	printf("Done\n");
+	if (status != BTL_STATUS_OK)
+		failure(EIO, "Erase failed");
+
+	btl_flush(&dev->port, dev->port.rto);
+	bootloader_get_stats(dev, &st, 0);
+
+	printf("Filler bytes       : %d\n", bursts * BTL_ERASE_TEST_BURST);
+	printf("RX overruns        : %u\n", st.rx_overrun);
+	printf("RX drops           : %u\n", st.rx_drop);
+	printf("Erase time         : %u us\n", st.erase_time);
+
+	if (st.rx_overrun || st.rx_drop)
+		failure(0, "Erase test FAIL");
+	printf("Erase test PASS\n");
 }
 
-static void flash_file(struct btlctl_conf *cfg)
+static const char *btl_prof_names[BTL_PROF_NUM] = {
+	[BTL_PROF_PACKET]	= "btl_handle_packet",
+	[BTL_PROF_READ_BYTE]	= "btl_read_byte",
+	[BTL_PROF_FLASH_ERASE]	= "flash_erase",
+	[BTL_PROF_FLASH_WRITE]	= "flash_write",
+	[BTL_PROF_USART_RX_IRQ]	= "usart rx irq",
+	[BTL_PROF_USART_TX_IRQ]	= "usart tx irq",
+	[BTL_PROF_TIMER]	= "timer_handle",
+};
+
+static void bootloader_profile(struct btlctl_dev *dev)
+{
+	struct btl_prof_s pr;
+	int i, n, len;
+
+	printf("Bootloader profile, CPU cycles:\n");
+	printf("%-18s %10s %10s %10s %10s\n", "probe", "count", "min", "avg", "max");
+	for (i = 0; i < BTL_PROF_NUM; i++) {
+		memset(&pr, 0, sizeof(pr));
+		len = btl_transfer(&dev->port, BTL_CMD_PROFILE, i, NULL, 0, &pr, dev->cfg->retry);
+		if (len < 0)
+			failure(errno, "Request bootloader profile failed, "
+				"is bootloader built with PROFILE=1?");
+
+		if (len < (int)sizeof(pr))
+			failure(0, "Invalid bootloader profile size %d", len);
+
+		printf("%-18s %10u %10u %10u %10u\n", btl_prof_names[i],
+				pr.count, pr.min, pr.avg, pr.max);
+		if (!pr.count)
+			continue;
+
+		printf("  log2 histogram:");
+		for (n = 0; n < BTL_PROF_HIST; n++)
+			printf(" %u", pr.hist[n]);
+		printf("\n");
+	}
+}
+
+/*
+ * \brief read device EUI48, older bootloaders without ID command
+ *        are reported as unknown.
+ */
+static uint64_t bootloader_id(struct btlctl_dev *dev)
 {
-	int len, sz;
 	uint8_t buf[BTL_MAX_DATA_SIZE];
-	uint32_t addr;
-	int bytes = 0;
-	struct stat stat;
-	int fd = open(cfg->flash, O_RDONLY | O_BINARY);
 
-	if (fd < 0)
-		failure(errno, "Can't open flash file %s", cfg->flash);
+	if (btl_transfer(&dev->port, BTL_CMD_ID, 0, NULL, 0, buf, dev->cfg->retry) < 8)
+		return 0;
+
+	return (uint64_t)btl_get_u32(buf) | ((uint64_t)btl_get_u32(buf + 4) << 32);
+}
+
+static const char *btl_id_str(uint64_t id, char *buf)
+{
+	if (id == 0)
+		return "unknown EUI48";
+
+	sprintf(buf, "%02x:%02x:%02x:%02x:%02x:%02x",
+			(unsigned int)(id >> 40) & 0xff, (unsigned int)(id >> 32) & 0xff,
+			(unsigned int)(id >> 24) & 0xff, (unsigned int)(id >> 16) & 0xff,
+			(unsigned int)(id >> 8) & 0xff, (unsigned int)id & 0xff);
+	return buf;
+}
+
+static int flash_fail(struct btlctl_dev *dev, const char *msg)
+{
+	dev->err = errno ? errno : EIO;
+	dev->msg = msg;
+	return -1;
+}
+
+/*
+ * \brief erase range in background, every PROGRESS frame extends the
+ *        deadline. Lost frames are recovered by cancel request telling
+ *        where erase stopped, the rest is erased again.
+ */
+static int flash_erase_run(struct btlctl_dev *dev, uint32_t addr, uint32_t len)
+{
+	btl_port_t *port = &dev->port;
+	uint32_t end = addr + len;
+	uint32_t a, left;
+	uint8_t buf[8];
+	uint8_t cmd, status;
+	int retry = BTL_ERASE_RETRY;
+	int sz;
+
+	for (;;) {
+		btl_set_u32(buf, end - addr);
+		btl_set_u32(&buf[4], BTL_ERASE_REPORT);
+		if (btl_transfer(port, BTL_CMD_ERASE, addr, buf, 8, NULL, dev->cfg->retry) < 0)
+			return flash_fail(dev, "flash erase failed");
+
+		do {
+			sz = btl_read_timeout(port, port->rto +
+					BTL_ERASE_REPORT * BTL_ERASE_PAGE_TIME,
+					&cmd, &status, &a, buf);
+			if (sz < 0 || cmd != (BTL_CMD_PROGRESS | BTL_PKT_REPLY) || sz < 4)
+				continue;
+
+			if (status != BTL_STATUS_OK) {
+				errno = EIO;
+				return flash_fail(dev, "flash erase failed");
+			}
+
+			left = btl_get_u32(buf);
+			dev->erased += a - addr;
+			addr = a;
+			if (!left)
+				return 0;
+		} while (sz >= 0);
+
+		/* progress is lost, find out where erase is */
+		btl_set_u32(buf, 0);
+		if (retry-- == 0 ||
+		    btl_transfer(port, BTL_CMD_ERASE, 0, buf, 4, buf, dev->cfg->retry) < 4)
+			return flash_fail(dev, "flash erase progress lost");
+
+		a = btl_get_u32(buf);
+		if (a > addr && a <= end) {
+			dev->erased += a - addr;
+			addr = a;
+		}
+		if (addr >= end)
+			return 0;
+	}
+}
+
+/*
+ * \brief image_pages callback, sum of bytes to erase
+ */
+static int flash_erase_size(void *arg, uint32_t addr, uint32_t len)
+{
+	struct btlctl_dev *dev = arg;
+
+	if (addr + len > dev->resume)
+		dev->erase_total += addr + len - (addr > dev->resume ? addr : dev->resume);
+	return 0;
+}
+
+static int flash_erase(void *arg, uint32_t addr, uint32_t len)
+{
+	struct btlctl_dev *dev = arg;
+
+	/* pages confirmed by previous session are kept */
+	if (addr + len <= dev->resume)
+		return 0;
+
+	if (addr < dev->resume) {
+		len -= dev->resume - addr;
+		addr = dev->resume;
+	}
+
+	return flash_erase_run(dev, addr, len);
+}
+
+/*
+ * \brief compare digest of device flash page with image page
+ */
+static int flash_page_match(struct btlctl_dev *dev, uint32_t addr)
+{
+	uint8_t page[BTL_FLASH_PAGE_SIZE];
+	uint8_t buf[BTL_MAX_DATA_SIZE];
+
+	btl_set_u32(buf, BTL_FLASH_PAGE_SIZE);
+	if (btl_transfer_exec(&dev->port, BTL_CMD_DIGEST, addr, buf, 4, buf,
+			      BTL_DIGEST_PAGE_TIME, dev->cfg->retry) < 4)
+		return 0;
 
-	if (fstat(fd, &stat) < 0)
-		failure(errno, "Can't get file %s size", cfg->flash);
+	image_fill(&dev->cfg->image, addr, BTL_FLASH_PAGE_SIZE, page);
 
-	len = stat.st_size;
+	return btl_get_u32(buf) == crc32_calc(0, page, BTL_FLASH_PAGE_SIZE);
+}
 
-	if (!cfg->skip)
-		flash_erase(cfg, len);
+/*
+ * \brief image_pages callback, pages below journal address
+ *        are confirmed until the first mismatch.
+ */
+static int flash_confirm(void *arg, uint32_t addr, uint32_t len)
+{
+	struct btlctl_dev *dev = arg;
+	uint32_t end = addr + len;
 
-	addr = cfg->addr;
+	/* stopped at earlier page */
+	if (dev->resume != UINT32_MAX)
+		return 0;
 
-	printf("Start programm %d bytes\n", len);
-	while (len > 0) {
-		sz = read(fd, buf, sizeof(buf));
-		if (sz <= 0)
+	for (; addr < end; addr += BTL_FLASH_PAGE_SIZE) {
+		if (addr + BTL_FLASH_PAGE_SIZE > dev->sess.addr ||
+		    !flash_page_match(dev, addr)) {
+			dev->resume = addr;
 			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * \brief find first write packet of resumed session. Packet crossing
+ *        resume page starts transfer, its head rewrites the same data
+ *        to the confirmed page.
+ */
+static unsigned int flash_resume(struct btlctl_dev *dev, const btl_stream_t *st)
+{
+	struct btlctl_conf *cfg = dev->cfg;
+	unsigned int i;
 
-		dbg("read from file %d bytes\n", sz);
-		if (btl_transfer(cfg->fd, BTL_CMD_WRITE, addr, buf, sz, NULL, cfg->retry) < 0)
-			failure(errno, "\nFlash write failed");
+	dev->resume = 0;
 
-		addr += sz;
-		len -= sz;
-		bytes += sz;
-		printf("%ld %%\r", (bytes * 100) / stat.st_size);
-		//printf("+");
-		fflush(stdout);
-		fflush(stderr);
+	if (!cfg->journal || !dev->id)
+		return 0;
+
+	if (session_open(&dev->sess, cfg->journal, dev->id, cfg->digest) < 0 ||
+	    !dev->sess.valid)
+		return 0;
+
+	dev->resume = UINT32_MAX;
+	image_pages(&cfg->image, BTL_FLASH_PAGE_SIZE, flash_confirm, dev);
+
+	for (i = 0; i < st->count; i++) {
+		if (st->addr[i] + btl_stream_size(st, i) > dev->resume)
+			break;
+		dev->bytes += btl_stream_size(st, i);
 	}
-	printf("\nDone\n");
+	dev->resumed = dev->bytes;
+	return i;
+}
+
+/*
+ * \brief send precomputed write packets, up to window packets
+ *        are in flight. On error transfer goes back to the first
+ *        packet without reply. One packet at a time is timed
+ *        for round trip estimation.
+ */
+static int flash_stream(struct btlctl_dev *dev, const btl_stream_t *st,
+		unsigned int first)
+{
+	struct btlctl_conf *cfg = dev->cfg;
+	unsigned int window = cfg->window > 0 ? cfg->window : 1;
+	unsigned int acked = first, sent = first, n;
+	int retry = cfg->retry;
+	int timed = -1;
+	long timed_us = 0;
+	uint8_t cmd, status;
+	uint32_t addr;
+	int err;
+
+	while (acked < st->count) {
+		n = acked + window - sent;
+		if (n > st->count - sent)
+			n = st->count - sent;
+
+		if (n && btl_stream_write(&dev->port, st, sent, n) < 0)
+			return flash_fail(dev, "serial write failed");
+
+		if (n && timed < 0) {
+			timed = sent;
+			timed_us = btl_time_us();
+		}
+		sent += n;
+
+		err = btl_read(&dev->port, &cmd, &status, &addr, NULL);
+		if (err >= 0) {
+			/* late reply of packet already confirmed */
+			if (addr < st->addr[acked])
+				continue;
+
+			if (cmd == (BTL_CMD_WRITE | BTL_PKT_REPLY) &&
+			    status == BTL_STATUS_OK && addr == st->addr[acked]) {
+				if ((int)acked == timed) {
+					btl_rtt_sample(&dev->port, btl_time_us() - timed_us);
+					timed = -1;
+				}
+				dev->bytes += btl_stream_size(st, acked);
+				acked++;
+				/* retries are counted per packet */
+				retry = cfg->retry;
+				if (acked < st->count && (acked % BTL_JOURNAL_FRAMES) == 0)
+					session_save(&dev->sess, st->addr[acked]);
+				continue;
+			}
+		}
+
+		/* mismatched reply is not a timeout */
+		if (err < 0 && errno == ETIMEDOUT)
+			btl_rto_backoff(&dev->port);
+
+		if (retry-- == 0) {
+			session_save(&dev->sess, st->addr[acked]);
+			return flash_fail(dev, "flash write failed");
+		}
 
-	bootloader_reset(cfg);
+		/* packets sent again are not timed */
+		timed = -1;
+		btl_flush(&dev->port, dev->port.rto);
+		sent = acked;
+	}
+	return 0;
 }
 
-int main(int argc, char **argv)
+/*
+ * Selective repeat state of write packet in flight
+ */
+struct flash_sr_frame {
+	/* transmission order of the last send */
+	unsigned int stamp;
+	int tries;
+	int acked;
+};
+
+/*
+ * \brief open SWRITE sequence starting from number of packet \first
+ */
+static int flash_sr_open(struct btlctl_dev *dev, unsigned int first)
 {
-	struct option opt[OPT_LEN + 1];
-	char optstr[2 * OPT_LEN + 1];
-	struct btlctl_conf conf;
+	int retry = dev->cfg->retry;
+	uint8_t cmd, status;
+	int err;
 
-	memset(&conf, 0, sizeof(struct btlctl_conf));
+	do {
+		if (btl_write(&dev->port, BTL_CMD_SWRITE, first & 0xff, 0, NULL, 0) < 0)
+			return -1;
 
-	/* set default values */
-	conf.dev = BTLCTL_DEVICE_DEFAULT;
-	conf.baud = BAUD_RATE_DEFAULT;
+		err = btl_read(&dev->port, &cmd, &status, NULL, NULL);
+		if (err >= 0 && cmd == (BTL_CMD_SWRITE | BTL_PKT_REPLY) &&
+		    status == BTL_STATUS_OK)
+			return 0;
 
-	if (prog_option_make(btlctl_options, opt, optstr, OPT_LEN) < 0)
-		failure(0, "Invalid options");
+		btl_flush(&dev->port, dev->port.rto);
+	} while (retry-- > 0);
 
-	if (prog_option_load(argc, argv, btlctl_options, opt, optstr, &conf) < 0)
-		usage(argv[0], btlctl_options);
+	return -1;
+}
 
-	if (conf.help)
-		usage(argv[0], btlctl_options);
+/*
+ * \brief packet index of sequence number in flight, -1 if not found
+ */
+static int flash_sr_index(unsigned int base, unsigned int next, uint8_t seq)
+{
+	unsigned int i = base + (uint8_t)(seq - base);
+
+	return i < next ? (int)i : -1;
+}
+
+static int flash_sr_send(struct btlctl_dev *dev, const btl_stream_t *st,
+		struct flash_sr_frame *fr, unsigned int i, unsigned int *stamp)
+{
+	fr[i % BTL_SR_WINDOW].stamp = ++(*stamp);
+	return btl_stream_write(&dev->port, st, i, 1);
+}
+
+/*
+ * \brief send write packets with selective repeat. Device reports
+ *        lost packets in replies and NACK frames, only those packets
+ *        are sent again while the rest of window keeps flowing.
+ *        Packet is sent again only if it was sent before the frame
+ *        which revealed the loss, repeated reports of the same loss
+ *        do not multiply retransmissions.
+ */
+static int flash_stream_sr(struct btlctl_dev *dev, const btl_stream_t *st,
+		unsigned int first)
+{
+	struct btlctl_conf *cfg = dev->cfg;
+	struct flash_sr_frame fr[BTL_SR_WINDOW], *f;
+	unsigned int window = cfg->window > 0 ? cfg->window : 1;
+	unsigned int base = first, next = first, n;
+	/* last transmission and the last acknowledged one */
+	unsigned int stamp = 0, last = 0, ref;
+	/* timed packet, its transmission order and time */
+	int timed = -1;
+	unsigned int timed_stamp = 0;
+	long timed_us = 0;
+	uint8_t data[BTL_MAX_DATA_SIZE], *miss;
+	int retry = cfg->retry;
+	uint8_t cmd, status;
+	int i, len;
+
+	if (window > BTL_SR_WINDOW)
+		window = BTL_SR_WINDOW;
+
+	if (first < st->count && flash_sr_open(dev, first) < 0)
+		return flash_fail(dev, "flash write sequence open failed");
+
+	while (base < st->count) {
+		n = base + window - next;
+		if (n > st->count - next)
+			n = st->count - next;
+
+		if (n && btl_stream_write(&dev->port, st, next, n) < 0)
+			return flash_fail(dev, "serial write failed");
+
+		if (n && timed < 0) {
+			timed = next;
+			timed_stamp = stamp + 1;
+			timed_us = btl_time_us();
+		}
+
+		for (; n; n--, next++) {
+			f = &fr[next % BTL_SR_WINDOW];
+			f->stamp = ++stamp;
+			f->tries = 0;
+			f->acked = 0;
+		}
+
+		len = btl_read(&dev->port, &cmd, &status, NULL, data);
+		if (len < 0 || status != BTL_STATUS_OK) {
+			if (len < 0 && errno == ETIMEDOUT)
+				btl_rto_backoff(&dev->port);
+
+			/* no reply or error, all packets in flight are sent again */
+			if (retry-- == 0) {
+				session_save(&dev->sess, st->addr[base]);
+				return flash_fail(dev, "flash write failed");
+			}
+
+			timed = -1;
+			btl_flush(&dev->port, dev->port.rto);
+			for (n = base; n < next; n++) {
+				if (!fr[n % BTL_SR_WINDOW].acked &&
+				    flash_sr_send(dev, st, fr, n, &stamp) < 0)
+					return flash_fail(dev, "serial write failed");
+			}
+			continue;
+		}
+
+		if (cmd == (BTL_CMD_SWRITE | BTL_PKT_REPLY)) {
+			if (len < 1 || (i = flash_sr_index(base, next, data[0])) < 0)
+				continue;
+
+			f = &fr[i % BTL_SR_WINDOW];
+			if (i == timed) {
+				/* packet sent again is not timed */
+				if (f->stamp == timed_stamp)
+					btl_rtt_sample(&dev->port, btl_time_us() - timed_us);
+				timed = -1;
+			}
+
+			if (!f->acked) {
+				f->acked = 1;
+				dev->bytes += btl_stream_size(st, i);
+				if (f->stamp > last)
+					last = f->stamp;
+			}
+			ref = f->stamp;
+			miss = &data[1];
+			len--;
+		} else if (cmd == (BTL_CMD_NACK | BTL_PKT_REPLY)) {
+			/* corrupted frame is most likely the one sent after last acknowledged */
+			ref = last + 2;
+			miss = data;
+		} else {
+			continue;
+		}
+
+		for (; len > 0; len--, miss++) {
+			if ((i = flash_sr_index(base, next, *miss)) < 0)
+				continue;
 
-	if ((conf.fd = serial_open(conf.dev)) < 0)
-		failure(errno, "Can't open serial port %s", conf.dev);
+			f = &fr[i % BTL_SR_WINDOW];
+			if (f->acked || f->stamp >= ref)
+				continue;
 
-	if (serial_setup(conf.fd, BAUD_RATE_DEFAULT) < 0)
-		failure(errno, "Can't set serial port %s parameters", conf.dev);
+			if (f->tries++ == BTL_NACK_RETRY) {
+				session_save(&dev->sess, st->addr[base]);
+				return flash_fail(dev, "flash write retransmission limit");
+			}
 
-	if (conf.baud != BAUD_RATE_DEFAULT) {
-		//bootloader_set_baud(&conf);
-		if (serial_setup(conf.fd, conf.baud) < 0)
-			failure(errno, "Can't set serial port %s parameters", conf.dev);
+			if (flash_sr_send(dev, st, fr, i, &stamp) < 0)
+				return flash_fail(dev, "serial write failed");
+		}
+
+		while (base < next && fr[base % BTL_SR_WINDOW].acked) {
+			base++;
+			/* retries are counted while window does not move */
+			retry = cfg->retry;
+			if (base < st->count && (base % BTL_JOURNAL_FRAMES) == 0)
+				session_save(&dev->sess, st->addr[base]);
+		}
 	}
+	return 0;
+}
 
-	serial_set_timeout(conf.fd, 3.0);
+struct flash_run {
+	uint32_t addr;
+	uint32_t len;
+};
 
-	if (conf.info)
-		bootloader_info(&conf);
+static int flash_run_first(void *arg, uint32_t addr, uint32_t len)
+{
+	struct flash_run *run = arg;
 
-	if (conf.flash)
-		flash_file(&conf);
+	if (!run->len) {
+		run->addr = addr;
+		run->len = len;
+	}
+	return 0;
+}
+
+/*
+ * \brief switch device to encrypted writes with counter block of session,
+ *        or to plain writes without key
+ */
+static int flash_crypt(struct btlctl_dev *dev)
+{
+	if (!dev->cfg->enc) {
+		/* bootloader without ENCRYPT rejects it and has plain writes only */
+		btl_transfer(&dev->port, BTL_CMD_CRYPT, 0, NULL, 0, NULL, dev->cfg->retry);
+		return 0;
+	}
 
-	if (conf.reset)
-		bootloader_reset(&conf);
+	if (btl_transfer(&dev->port, BTL_CMD_CRYPT, 0, dev->cfg->iv, BTL_CRYPT_IV_SIZE,
+			 NULL, dev->cfg->retry) < 0)
+		return flash_fail(dev, "device has no encrypted write");
+	return 0;
+}
 
-	serial_close(conf.fd);
-	exit(EXIT_SUCCESS);
+/*
+ * \brief open COMMIT session of the first page run, so device digests
+ *        it while writing. Older bootloaders without COMMIT are not checked.
+ */
+static void flash_commit_open(struct btlctl_dev *dev)
+{
+	struct flash_run run = { 0, 0 };
+	uint8_t buf[4];
+
+	image_pages(&dev->cfg->image, BTL_FLASH_PAGE_SIZE, flash_run_first, &run);
+
+	btl_set_u32(buf, run.len);
+	dev->commit = btl_transfer(&dev->port, BTL_CMD_COMMIT, run.addr, buf, 4,
+			NULL, dev->cfg->retry) >= 0;
+}
+
+/*
+ * \brief sign written page run, bootloader without signature check
+ *        rejects SIGN and the run is checked by CRC-32 only
+ */
+static void flash_sign(struct btlctl_dev *dev, uint32_t addr, const uint8_t *data,
+		       uint32_t len)
+{
+	struct btl_sign_msg_s msg;
+	struct sha256_ctx sha;
+	uint8_t sig[ED25519_SIG_SIZE];
+
+	msg.addr = addr;
+	msg.size = len;
+	sha256_init(&sha);
+	sha256_update(&sha, data, len);
+	sha256_final(&sha, msg.digest);
+
+	ed25519_sign(sig, dev->cfg->seed, &msg, sizeof(msg));
+	btl_transfer(&dev->port, BTL_CMD_SIGN, addr, sig, sizeof(sig),
+		     NULL, dev->cfg->retry);
 }
 
+/*
+ * \brief final COMMIT request of run, repeated while device digests
+ *        the rest of run in background
+ */
+static int flash_commit_request(struct btlctl_dev *dev, uint32_t addr, uint32_t len,
+				uint8_t *req, struct btl_commit_s *cm)
+{
+	uint32_t reached = BTL_COMMIT_NO_PAGE;
+	int retry = dev->cfg->retry;
+
+	for (;;) {
+		if (btl_transfer_exec(&dev->port, BTL_CMD_COMMIT, addr, req, 8, cm,
+				      BTL_DIGEST_PAGE_TIME * (len / BTL_FLASH_PAGE_SIZE) +
+				      (dev->cfg->key ? BTL_SIGN_TIME : 0),
+				      dev->cfg->retry) < (int)sizeof(*cm))
+			return -1;
+
+		if (cm->result != BTL_COMMIT_BUSY)
+			return 0;
+
+		/* digest goes on between requests */
+		if (reached == BTL_COMMIT_NO_PAGE || cm->page > reached) {
+			reached = cm->page;
+			retry = dev->cfg->retry;
+		} else if (retry-- == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		if (reached >= addr && reached < addr + len)
+			usleep(1000L * BTL_DIGEST_PAGE_TIME *
+			       ((addr + len - reached) / BTL_FLASH_PAGE_SIZE));
+	}
+}
+
+/*
+ * \brief write mismatched page again: erase it, open COMMIT of the run
+ *        over and resend stream packets of the page. A frame damaged by
+ *        a lost byte may pass CRC-8 and gets written wrong.
+ */
+static int flash_repair(struct btlctl_dev *dev, uint32_t addr, uint32_t len,
+			uint32_t page)
+{
+	struct btlctl_conf *cfg = dev->cfg;
+	btl_stream_t part = cfg->stream;
+	unsigned int first, last;
+	int bytes = dev->bytes;
+	uint8_t buf[4];
+	int err;
+
+	for (first = 0; first < part.count; first++) {
+		if (part.addr[first] + btl_stream_size(&part, first) > page)
+			break;
+	}
+	for (last = first; last < part.count; last++) {
+		if (part.addr[last] >= page + BTL_FLASH_PAGE_SIZE)
+			break;
+	}
+
+	btl_set_u32(buf, BTL_FLASH_PAGE_SIZE);
+	if (btl_transfer_exec(&dev->port, BTL_CMD_ERASE, page, buf, 4, NULL,
+			      BTL_ERASE_PAGE_TIME, cfg->retry) < 0)
+		return flash_fail(dev, "flash erase failed");
+
+	/* encrypted packets are resent with counter block of session */
+	if (flash_crypt(dev) < 0)
+		return -1;
+
+	btl_set_u32(buf, len);
+	if (btl_transfer(&dev->port, BTL_CMD_COMMIT, addr, buf, 4, NULL, cfg->retry) < 0)
+		return flash_fail(dev, "commit failed");
+
+	part.count = last;
+	if (cfg->nack)
+		err = flash_stream_sr(dev, &part, first);
+	else
+		err = flash_stream(dev, &part, first);
+	/* progress counts image bytes once */
+	dev->bytes = bytes;
+	return err;
+}
+
+/*
+ * \brief image_pages callback, check digest of written page run.
+ *        Mismatched page not located by device is found by page digests,
+ *        located page is written again up to retry count.
+ */
+static int flash_commit(void *arg, uint32_t addr, uint32_t len)
+{
+	struct btlctl_dev *dev = arg;
+	struct btl_commit_s cm;
+	uint8_t buf[BTL_MAX_DATA_SIZE], *data;
+	int retry = dev->cfg->retry;
+	uint32_t page;
+	int err = -1;
+
+	if ((data = malloc(len)) == NULL)
+		return flash_fail(dev, "commit buffer allocation failed");
+
+	image_fill(&dev->cfg->image, addr, len, data);
+	btl_set_u32(buf, len);
+	btl_set_u32(buf + 4, crc32_calc(0, data, len));
+
+	for (;;) {
+		if (dev->cfg->key)
+			flash_sign(dev, addr, data, len);
+
+		if (flash_commit_request(dev, addr, len, buf, &cm) < 0) {
+			flash_fail(dev, "commit failed");
+			break;
+		}
+
+		if (cm.result == BTL_COMMIT_PASS) {
+			err = 0;
+			break;
+		}
+
+		if (cm.result == BTL_COMMIT_SIGN) {
+			/* first page is erased by device, run is written again */
+			dev->bad = addr;
+			errno = EACCES;
+			flash_fail(dev, "commit signature rejected");
+			break;
+		}
+
+		page = cm.page;
+		if (page == BTL_COMMIT_NO_PAGE) {
+			for (page = addr; page < addr + len; page += BTL_FLASH_PAGE_SIZE) {
+				if (!flash_page_match(dev, page))
+					break;
+			}
+			if (page == addr + len)
+				page = BTL_COMMIT_NO_PAGE;
+		}
+
+		/* broadcast packets of bus are not answered, page is not repaired */
+		if (page == BTL_COMMIT_NO_PAGE || dev->cfg->stream.dst || retry-- == 0) {
+			dev->bad = page;
+			errno = EIO;
+			flash_fail(dev, "commit digest mismatch");
+			break;
+		}
+
+		if (flash_repair(dev, addr, len, page) < 0)
+			break;
+	}
+
+	free(data);
+	return err;
+}
+
+/*
+ * \brief program shared image to one device, runs in own thread.
+ *        Only pages covering populated ranges are erased,
+ *        only populated ranges are transferred in address order.
+ *        With journal, session is resumed from first unconfirmed page.
+ *        Written runs are checked by device digest, no read back pass.
+ */
+static int flash_image(struct btlctl_dev *dev)
+{
+	struct btlctl_conf *cfg = dev->cfg;
+	unsigned int first;
+
+	dev->id = bootloader_id(dev);
+	dev->bad = BTL_COMMIT_NO_PAGE;
+
+	first = flash_resume(dev, &cfg->stream);
+
+	if (!cfg->skip) {
+		image_pages(&cfg->image, BTL_FLASH_PAGE_SIZE, flash_erase_size, dev);
+		if (image_pages(&cfg->image, BTL_FLASH_PAGE_SIZE, flash_erase, dev) < 0)
+			return -1;
+	}
+
+	/* erased pages are lost, journal starts from resume address */
+	if (first < cfg->stream.count)
+		session_save(&dev->sess, cfg->stream.addr[first]);
+
+	if (flash_crypt(dev) < 0)
+		return -1;
+
+	flash_commit_open(dev);
+
+	if (cfg->nack) {
+		if (flash_stream_sr(dev, &cfg->stream, first) < 0)
+			return -1;
+	} else if (flash_stream(dev, &cfg->stream, first) < 0) {
+		return -1;
+	}
+
+	if (dev->commit &&
+	    image_pages(&cfg->image, BTL_FLASH_PAGE_SIZE, flash_commit, dev) < 0) {
+		/* next session resumes from mismatched page */
+		if (dev->bad != BTL_COMMIT_NO_PAGE)
+			session_save(&dev->sess, dev->bad);
+		return -1;
+	}
+
+	session_done(&dev->sess);
+	btl_write(&dev->port, BTL_CMD_RESET, 0, 0, NULL, 0);
+	return 0;
+}
+
+static void *flash_worker(void *arg)
+{
+	struct btlctl_dev *dev = arg;
+	double start = btl_time();
+
+	flash_image(dev);
+	session_close(&dev->sess);
+
+	dev->time = btl_time() - start;
+	dev->done = 1;
+	return NULL;
+}
+
+/*
+ * \brief longest reply timeout of devices on bus
+ */
+static int bus_rto(struct btlctl_conf *cfg)
+{
+	int i, rto = BTL_RTO_MIN;
+
+	for (i = 0; i < cfg->ndevs; i++) {
+		if (cfg->devs[i].port.rto > rto)
+			rto = cfg->devs[i].port.rto;
+	}
+	return rto;
+}
+
+/*
+ * \brief wait until broadcast is sent, broadcast is not answered,
+ *        so everything received after it on single wire line is echo.
+ */
+static int bus_drain(struct btlctl_conf *cfg)
+{
+	if (serial_drain(cfg->bcast.fd) < 0)
+		return -1;
+
+	if (cfg->echo)
+		btl_flush(&cfg->bcast, bus_rto(cfg));
+	return 0;
+}
+
+/*
+ * \brief switch baud rate of all devices on bus by broadcast
+ */
+static void bus_set_baud(struct btlctl_conf *cfg)
+{
+	uint8_t buf[4];
+
+	btl_set_u32(buf, cfg->baud);
+	if (btl_write(&cfg->bcast, BTL_CMD_BAUD, 0, 0, buf, 4) < 0 ||
+	    bus_drain(cfg) < 0)
+		failure(errno, "Bus set baud failed");
+
+	usleep(1000L * BTL_RTO_MIN);
+	if (serial_setup(cfg->bcast.fd, cfg->baud) < 0 ||
+	    (cfg->rtscts && serial_set_rtscts(cfg->bcast.fd, 1) < 0))
+		failure(errno, "Can't set serial port %s parameters", cfg->devs[0].name);
+	serial_set_timeout(cfg->bcast.fd, BTL_RTO_MIN / 1000.0);
+}
+
+/*
+ * \brief image_pages callback, erase pages of all devices by broadcast.
+ *        Broadcast is not answered, erase time is waited instead.
+ */
+static int bus_erase(void *arg, uint32_t addr, uint32_t len)
+{
+	struct btlctl_conf *cfg = arg;
+	uint8_t buf[4];
+
+	btl_set_u32(buf, len);
+	if (btl_write(&cfg->bcast, BTL_CMD_ERASE, 0, addr, buf, 4) < 0 ||
+	    bus_drain(cfg) < 0)
+		return -1;
+
+	usleep(1000L * (bus_rto(cfg) + BTL_ERASE_PAGE_TIME * (len / BTL_FLASH_PAGE_SIZE + 1)));
+	return 0;
+}
+
+/*
+ * \brief read write bitmap of device, mark packets \first to \last
+ *        of window \start not written by device in \need.
+ */
+static int bus_poll(struct btlctl_dev *dev, uint32_t start,
+		unsigned int first, unsigned int last, uint8_t *need)
+{
+	const btl_stream_t *st = &dev->cfg->stream;
+	uint8_t map[BTL_BITMAP_SIZE];
+	unsigned int off, n, k, size;
+
+	size = (st->addr[last - 1] - start) / BTL_MAX_DATA_SIZE / 8 + 1;
+
+	for (off = 0; off < size; off += BTL_MAX_DATA_SIZE) {
+		if (btl_transfer(&dev->port, BTL_CMD_BITMAP, off, NULL, 0, &map[off],
+				 dev->cfg->retry) <= 0)
+			return flash_fail(dev, "bitmap poll failed");
+	}
+
+	dev->bytes = 0;
+	for (k = first; k < last; k++) {
+		n = (st->addr[k] - start) / BTL_MAX_DATA_SIZE;
+		if (map[n >> 3] & (1 << (n & 7)))
+			dev->bytes += btl_stream_size(st, k);
+		else
+			need[k - first] = 1;
+	}
+	return 0;
+}
+
+/*
+ * \brief broadcast packets \first to \last of bitmap window, packets
+ *        missed by any device are broadcast again.
+ */
+static void bus_window(struct btlctl_conf *cfg, unsigned int first, unsigned int last)
+{
+	const btl_stream_t *st = &cfg->stream;
+	uint32_t start = st->addr[first] & ~(BTL_MAX_DATA_SIZE - 1);
+	unsigned int k, n, missing;
+	uint8_t *need, buf[4];
+	int i, round;
+
+	if ((need = malloc(last - first)) == NULL)
+		failure(errno, "Can't allocate bitmap");
+	memset(need, 1, last - first);
+
+	btl_set_u32(buf, BTL_BITMAP_RANGE);
+	if (btl_write(&cfg->bcast, BTL_CMD_BITMAP, 0, start, buf, 4) < 0)
+		failure(errno, "Serial write failed");
+
+	for (round = 0; round < BTL_BUS_ROUNDS; round++) {
+		for (k = first; k < last; k += n) {
+			for (n = 0; k + n < last && need[k + n - first]; n++)
+				;
+			if (n && btl_stream_write(&cfg->bcast, st, k, n) < 0)
+				failure(errno, "Serial write failed");
+			if (!n)
+				n = 1;
+		}
+
+		/* bitmap request waits behind broadcast in device queue */
+		if (bus_drain(cfg) < 0)
+			failure(errno, "Serial write failed");
+
+		memset(need, 0, last - first);
+		for (i = 0; i < cfg->ndevs; i++) {
+			if (!cfg->devs[i].err)
+				bus_poll(&cfg->devs[i], start, first, last, need);
+		}
+
+		for (k = 0, missing = 0; k < last - first; k++)
+			missing += need[k];
+
+		printf("Window 0x%08x round %d, %u of %u packets missing\n",
+				start, round + 1, missing, last - first);
+		if (!missing)
+			break;
+	}
+
+	for (i = 0; missing && i < cfg->ndevs; i++) {
+		memset(need, 0, last - first);
+		if (!cfg->devs[i].err &&
+		    bus_poll(&cfg->devs[i], start, first, last, need) == 0 &&
+		    memchr(need, 1, last - first)) {
+			errno = EIO;
+			flash_fail(&cfg->devs[i], "broadcast write incomplete");
+		}
+	}
+	free(need);
+}
+
+/*
+ * \brief flash all devices on shared bus with one transfer of image.
+ *        Erase and write packets are broadcast, devices are polled
+ *        for write bitmaps and checked with COMMIT one by one.
+ */
+static void flash_bus(struct btlctl_conf *cfg)
+{
+	const btl_stream_t *st = &cfg->stream;
+	struct btlctl_dev *dev;
+	double start = btl_time();
+	unsigned int first, last;
+	int i;
+
+	for (i = 0; i < cfg->ndevs; i++) {
+		dev = &cfg->devs[i];
+		dev->bad = BTL_COMMIT_NO_PAGE;
+		if (!bootloader_id(dev)) {
+			errno = ETIMEDOUT;
+			flash_fail(dev, "device does not answer");
+		}
+	}
+
+	if (!cfg->skip &&
+	    image_pages(&cfg->image, BTL_FLASH_PAGE_SIZE, bus_erase, cfg) < 0)
+		failure(errno, "Broadcast erase failed");
+
+	for (i = 0; i < cfg->ndevs; i++) {
+		if (!cfg->devs[i].err)
+			flash_crypt(&cfg->devs[i]);
+		if (!cfg->devs[i].err)
+			flash_commit_open(&cfg->devs[i]);
+	}
+
+	for (first = 0; first < st->count; first = last) {
+		for (last = first; last < st->count &&
+		     st->addr[last] - (st->addr[first] & ~(BTL_MAX_DATA_SIZE - 1)) <
+		     BTL_BITMAP_RANGE; last++)
+			;
+		bus_window(cfg, first, last);
+	}
+
+	for (i = 0; i < cfg->ndevs; i++) {
+		dev = &cfg->devs[i];
+		if (!dev->err && dev->commit)
+			image_pages(&cfg->image, BTL_FLASH_PAGE_SIZE, flash_commit, dev);
+		if (!dev->err)
+			btl_write(&dev->port, BTL_CMD_RESET, 0, 0, NULL, 0);
+		dev->time = btl_time() - start;
+	}
+}
+
+/*
+ * \brief build broadcast write packets, one packet per bitmap block.
+ *        Gaps between segments sharing a block are filled with 0xff.
+ */
+static void flash_load_blocks(struct btlctl_conf *cfg)
+{
+	struct image *img = &cfg->image;
+	uint8_t data[BTL_MAX_DATA_SIZE];
+	uint32_t s, e, b, end, next = 0;
+	int i, j;
+
+	cfg->stream.dst = btl_eui_broadcast;
+
+	for (i = 0; i < img->nsegs; i++) {
+		end = img->segs[i].addr + img->segs[i].len;
+		s = img->segs[i].addr > next ? img->segs[i].addr : next;
+
+		for (; s < end; s = next) {
+			b = s & ~(BTL_MAX_DATA_SIZE - 1);
+			next = b + BTL_MAX_DATA_SIZE;
+
+			for (j = i, e = s; j < img->nsegs && img->segs[j].addr < next; j++) {
+				e = img->segs[j].addr + img->segs[j].len;
+				if (e > next)
+					e = next;
+			}
+
+			image_fill(img, s, e - s, data);
+			if (cfg->enc)
+				aes_ctr(&cfg->aes, cfg->iv, s, data, e - s);
+			if (btl_stream_add(&cfg->stream, BTL_CMD_WRITE, 0, s, data, e - s) < 0)
+				failure(errno, "Can't allocate write packets");
+		}
+	}
+}
+
+/*
+ * \brief load image and build write packets of all segments
+ */
+static void flash_load(struct btlctl_conf *cfg)
+{
+	uint8_t data[BTL_MAX_DATA_SIZE];
+	struct image_seg *seg;
+	uint32_t off, sz;
+	int i, err;
+
+	if (image_load(&cfg->image, cfg->flash, cfg->addr) < 0)
+		failure(errno, "Can't load flash file %s", cfg->flash);
+
+	cfg->digest = image_digest(&cfg->image);
+
+	for (i = 0; i < cfg->image.nsegs; i++) {
+		seg = &cfg->image.segs[i];
+		printf("Segment 0x%08x - 0x%08x, %u bytes\n", seg->addr,
+				seg->addr + seg->len, seg->len);
+	}
+
+	if (cfg->bus) {
+		flash_load_blocks(cfg);
+		return;
+	}
+
+	for (i = 0; i < cfg->image.nsegs; i++) {
+		seg = &cfg->image.segs[i];
+
+		for (off = 0; off < seg->len; off += sz) {
+			sz = seg->len - off;
+			if (sz > BTL_MAX_DATA_SIZE)
+				sz = BTL_MAX_DATA_SIZE;
+
+			/* packets are encrypted once for all devices */
+			memcpy(data, &seg->data[off], sz);
+			if (cfg->enc)
+				aes_ctr(&cfg->aes, cfg->iv, seg->addr + off, data, sz);
+
+			if (cfg->nack)
+				err = btl_stream_add(&cfg->stream, BTL_CMD_SWRITE,
+						cfg->stream.count & 0xff, seg->addr + off,
+						data, sz);
+			else
+				err = btl_stream_add(&cfg->stream, BTL_CMD_WRITE, 0,
+						seg->addr + off, data, sz);
+			if (err < 0)
+				failure(errno, "Can't allocate write packets");
+		}
+	}
+}
+
+/*
+ * \brief flash all devices in parallel, report aggregated progress
+ *        and result per device.
+ */
+static void flash_file(struct btlctl_conf *cfg)
+{
+	struct btlctl_dev *dev;
+	double start = btl_time();
+	long total, bytes, erased, erase_total;
+	int i, done, fail;
+	char id[32];
+
+	flash_load(cfg);
+
+	total = (long)cfg->image.size * cfg->ndevs;
+
+	printf("Start programm %u bytes, %d device(s)\n",
+			cfg->image.size, cfg->ndevs);
+
+	if (cfg->bus) {
+		flash_bus(cfg);
+		goto report;
+	}
+
+	for (i = 0; i < cfg->ndevs; i++) {
+		dev = &cfg->devs[i];
+		if (pthread_create(&dev->thread, NULL, flash_worker, dev) != 0)
+			failure(errno, "Can't create thread for %s", dev->name);
+	}
+
+	do {
+		usleep(100000);
+		bytes = 0;
+		done = 0;
+		erased = 0;
+		erase_total = 0;
+		for (i = 0; i < cfg->ndevs; i++) {
+			bytes += cfg->devs[i].bytes;
+			done += cfg->devs[i].done;
+			erased += cfg->devs[i].erased;
+			erase_total += cfg->devs[i].erase_total;
+		}
+		if (erased < erase_total)
+			printf("erase %ld %%, ", (erased * 100) / erase_total);
+		printf("%ld %% [%d/%d done]\r", total ? (bytes * 100) / total : 100,
+				done, cfg->ndevs);
+		fflush(stdout);
+		fflush(stderr);
+	} while (done < cfg->ndevs);
+	printf("\n");
+
+	for (i = 0; i < cfg->ndevs; i++)
+		pthread_join(cfg->devs[i].thread, NULL);
+
+report:
+	fail = 0;
+	for (i = 0; i < cfg->ndevs; i++) {
+		dev = &cfg->devs[i];
+
+		printf("%-17s %-20s %s %.2f s", btl_id_str(dev->id, id), dev->name,
+				dev->err ? "FAIL" : "PASS", dev->time);
+		if (dev->port.srtt)
+			printf(", rtt %.2f ms", dev->port.srtt / 1000.0);
+		if (dev->bad != BTL_COMMIT_NO_PAGE)
+			printf(", first bad page 0x%08x", dev->bad);
+		if (dev->resumed)
+			printf(", resumed after %d bytes", dev->resumed);
+		if (dev->err) {
+			printf(", %s at %d bytes: %s", dev->msg, dev->bytes, strerror(dev->err));
+			fail++;
+		}
+		printf("\n");
+	}
+	printf("Done, %d passed, %d failed, total time %.2f s\n",
+			cfg->ndevs - fail, fail, btl_time() - start);
+
+	btl_stream_free(&cfg->stream);
+	image_free(&cfg->image);
+	if (fail)
+		exit(EXIT_FAILURE);
+}
+
+/*
+ * \brief read flash range with streaming read. Lost frame or
+ *        credit restarts stream from the first missing byte.
+ */
+static int dump_read(struct btlctl_dev *dev, uint32_t addr, uint32_t len, uint8_t *buf)
+{
+	struct btlctl_conf *cfg = dev->cfg;
+	uint8_t data[BTL_MAX_DATA_SIZE], req[8];
+	uint32_t pos = 0, credit = 0, a;
+	int retry = cfg->retry, open = 0, sz;
+	uint8_t id = 0, cmd, status;
+	long start = 0;
+
+	while (pos < len) {
+		if (!open) {
+			if (retry-- < 0)
+				return -1;
+
+			btl_set_u32(req, len - pos);
+			btl_set_u32(req + 4, BTL_DUMP_CREDIT);
+			credit = pos + BTL_DUMP_CREDIT;
+			if (btl_write(&dev->port, BTL_CMD_SREAD, ++id, addr + pos, req, 8) < 0)
+				return -1;
+			open = 1;
+			start = btl_time_us();
+		}
+
+		if ((sz = btl_read(&dev->port, &cmd, &status, &a, data)) < 0) {
+			if (errno == ETIMEDOUT)
+				btl_rto_backoff(&dev->port);
+			btl_flush(&dev->port, dev->port.rto);
+			open = 0;
+			continue;
+		}
+
+		if (cmd == (BTL_CMD_SREAD | BTL_PKT_REPLY)) {
+			if (status != BTL_STATUS_OK) {
+				errno = EIO;
+				return -1;
+			}
+			continue;
+		}
+
+		/* frames of previous stream are skipped */
+		if (cmd != (BTL_CMD_DATA | BTL_PKT_REPLY) || status != id)
+			continue;
+
+		if (a != addr + pos || sz == 0 || pos + sz > len) {
+			open = 0;
+			continue;
+		}
+
+		/* stream is timed to its first frame */
+		if (start) {
+			btl_rtt_sample(&dev->port, btl_time_us() - start);
+			start = 0;
+		}
+
+		memcpy(&buf[pos], data, sz);
+		pos += sz;
+		dev->bytes = pos;
+		retry = cfg->retry;
+
+		if (credit < len && credit - pos <= BTL_DUMP_CREDIT / 2) {
+			credit = pos + BTL_DUMP_CREDIT;
+			if (btl_write(&dev->port, BTL_CMD_CREDIT, id, addr + credit, NULL, 0) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static void dump_file(struct btlctl_conf *cfg)
+{
+	struct btlctl_dev *dev;
+	uint8_t *buf;
+	char *path;
+	double start;
+	int i, fd;
+
+	if (cfg->len <= 0)
+		failure(0, "Dump length is not set");
+
+	if ((buf = malloc(cfg->len)) == NULL)
+		failure(errno, "Can't allocate dump buffer");
+
+	for (i = 0; i < cfg->ndevs; i++) {
+		dev = &cfg->devs[i];
+
+		if (cfg->ndevs == 1) {
+			path = strdup(cfg->dump);
+		} else {
+			dev->id = bootloader_id(dev);
+			if (asprintf(&path, "%s.%012llx", cfg->dump,
+				     (unsigned long long)dev->id) < 0)
+				path = NULL;
+		}
+		if (!path)
+			failure(errno, "Can't allocate dump file name");
+
+		start = btl_time();
+		if (dump_read(dev, cfg->addr, cfg->len, buf) < 0)
+			failure(errno, "Dump of %s failed at %d bytes", dev->name, dev->bytes);
+
+		printf("Dump 0x%08x - 0x%08x of %s to %s, %.2f s\n", cfg->addr,
+				cfg->addr + cfg->len, dev->name, path, btl_time() - start);
+
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644)) < 0)
+			failure(errno, "Can't create dump file %s", path);
+
+		if (write(fd, buf, cfg->len) != cfg->len)
+			failure(errno, "Can't write dump file %s", path);
+
+		close(fd);
+		free(path);
+		dev->bytes = 0;
+	}
+	free(buf);
+}
+
+static void btlctl_add_dev(struct btlctl_conf *cfg, const char *name)
+{
+	struct btlctl_dev *dev;
+
+	cfg->devs = realloc(cfg->devs, (cfg->ndevs + 1) * sizeof(struct btlctl_dev));
+	if (!cfg->devs)
+		failure(errno, "Can't allocate device");
+
+	dev = &cfg->devs[cfg->ndevs++];
+	memset(dev, 0, sizeof(struct btlctl_dev));
+	dev->cfg = cfg;
+	if ((dev->name = strdup(name)) == NULL)
+		failure(errno, "Can't allocate device");
+}
+
+/*
+ * \brief make list of devices from comma separated names and glob patterns
+ */
+static void btlctl_parse_devs(struct btlctl_conf *cfg)
+{
+	char *list, *name, *save;
+#ifndef __MINGW32__
+	glob_t gl;
+	size_t i;
+#endif
+
+	if ((list = strdup(cfg->dev)) == NULL)
+		failure(errno, "Can't allocate device list");
+
+	for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+#ifndef __MINGW32__
+		if (strpbrk(name, "*?[")) {
+			if (glob(name, 0, NULL, &gl) != 0)
+				failure(0, "No serial devices match %s", name);
+
+			for (i = 0; i < gl.gl_pathc; i++)
+				btlctl_add_dev(cfg, gl.gl_pathv[i]);
+			globfree(&gl);
+			continue;
+		}
+#endif
+		btlctl_add_dev(cfg, name);
+	}
+	free(list);
+
+	if (!cfg->ndevs)
+		failure(0, "No serial device");
+}
+
+/*
+ * \brief make list of devices on shared bus from EUI48 list,
+ *        all of them use the first serial device
+ */
+static void btlctl_parse_bus(struct btlctl_conf *cfg)
+{
+	char *list, *eui, *save, *port;
+	struct btlctl_dev *dev;
+	unsigned int b[6];
+	int i;
+
+	if ((list = strdup(cfg->bus)) == NULL || (port = strdup(cfg->dev)) == NULL)
+		failure(errno, "Can't allocate device list");
+
+	strtok_r(port, ",", &save);
+
+	for (eui = strtok_r(list, ",", &save); eui; eui = strtok_r(NULL, ",", &save)) {
+		if (sscanf(eui, "%x:%x:%x:%x:%x:%x", &b[5], &b[4], &b[3], &b[2], &b[1], &b[0]) != 6)
+			failure(0, "Invalid EUI48 %s", eui);
+
+		btlctl_add_dev(cfg, port);
+		dev = &cfg->devs[cfg->ndevs - 1];
+		for (i = 0; i < 6; i++) {
+			dev->eui[i] = b[i];
+			dev->id |= (uint64_t)(b[i] & 0xff) << (8 * i);
+		}
+	}
+	free(list);
+	free(port);
+
+	if (!cfg->ndevs)
+		failure(0, "No bus device");
+}
+
+/*
+ * \brief load Ed25519 secret seed, optionally print its public key
+ */
+static void btlctl_load_key(struct btlctl_conf *cfg)
+{
+	uint8_t pub[ED25519_KEY_SIZE];
+	FILE *f;
+	int i;
+
+	if ((f = fopen(cfg->key, "rb")) == NULL)
+		failure(errno, "Can't open key file %s", cfg->key);
+	if (fread(cfg->seed, 1, sizeof(cfg->seed), f) != sizeof(cfg->seed))
+		failure(0, "Key file %s is shorter than %u bytes", cfg->key,
+			(unsigned int)sizeof(cfg->seed));
+	fclose(f);
+
+	if (!cfg->pubkey)
+		return;
+
+	ed25519_public(pub, cfg->seed);
+	for (i = 0; i < ED25519_KEY_SIZE; i++)
+		printf("%02x", pub[i]);
+	printf("\n");
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * \brief fill buffer from generator of system
+ * \return 0 or -1 on error
+ */
+static int btlctl_random(void *buf, unsigned int len)
+{
+	uint8_t *p = buf;
+#ifdef __MINGW32__
+	unsigned int r;
+
+	while (len--) {
+		if (rand_s(&r))
+			return -1;
+		*p++ = r;
+	}
+	return 0;
+#else
+	FILE *f;
+	int err = 0;
+
+	if ((f = fopen("/dev/urandom", "rb")) == NULL)
+		return -1;
+	if (fread(p, 1, len, f) != len)
+		err = -1;
+	fclose(f);
+	return err;
+#endif
+}
+
+/*
+ * \brief load AES-128 key, counter block is random for every session,
+ *        so keystream is not reused with the same key
+ */
+static void btlctl_load_enc(struct btlctl_conf *cfg)
+{
+	uint8_t key[AES_KEY_SIZE];
+	FILE *f;
+
+	if ((f = fopen(cfg->enc, "rb")) == NULL)
+		failure(errno, "Can't open key file %s", cfg->enc);
+	if (fread(key, 1, sizeof(key), f) != sizeof(key))
+		failure(0, "Key file %s is shorter than %u bytes", cfg->enc,
+			(unsigned int)sizeof(key));
+	fclose(f);
+	aes_init(&cfg->aes, key);
+
+	/* nonce, the last 32 bits count blocks from 0 */
+	memset(cfg->iv, 0, sizeof(cfg->iv));
+	/* predictable nonce may repeat keystream of other session */
+	if (btlctl_random(cfg->iv, sizeof(cfg->iv) - 4) < 0)
+		failure(errno, "Can't get random nonce");
+}
+
+static void selftest_hex(uint8_t *out, const char *hex)
+{
+	unsigned int b;
+
+	for (; *hex; hex += 2) {
+		sscanf(hex, "%2x", &b);
+		*out++ = b;
+	}
+}
+
+static int selftest_result(const char *name, int pass)
+{
+	printf("%-28s %s\n", name, pass ? "ok" : "FAIL");
+	return pass ? 0 : -1;
+}
+
+static int selftest_check(const char *name, const uint8_t *res, const char *hex)
+{
+	uint8_t exp[128];
+
+	selftest_hex(exp, hex);
+	return selftest_result(name, memcmp(res, exp, strlen(hex) / 2) == 0);
+}
+
+/*
+ * \brief known answer tests of ciphers shared with bootloader,
+ *        FIPS 197 C.1, SP 800-38A F.5.1, FIPS 180-2 B.1, RFC 8032 7.1
+ */
+static void btlctl_selftest(void)
+{
+	static const char ctr_pt[] =
+		"6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+		"30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+	static const char ctr_ct[] =
+		"874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+		"5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee";
+	uint8_t key[AES_KEY_SIZE], iv[AES_BLOCK_SIZE], buf[64], out[64];
+	uint8_t seed[ED25519_KEY_SIZE], pub[ED25519_KEY_SIZE];
+	struct sha256_ctx sha;
+	struct aes_ctx aes;
+	int err = 0;
+
+	selftest_hex(key, "000102030405060708090a0b0c0d0e0f");
+	selftest_hex(buf, "00112233445566778899aabbccddeeff");
+	aes_init(&aes, key);
+	aes_encrypt(&aes, out, buf);
+	err |= selftest_check("AES-128", out, "69c4e0d86a7b0430d8cdb78070b4c55a");
+
+	selftest_hex(key, "2b7e151628aed2a6abf7158809cf4f3c");
+	selftest_hex(iv, "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+	aes_init(&aes, key);
+	selftest_hex(buf, ctr_pt);
+	aes_ctr(&aes, iv, 0, buf, sizeof(buf));
+	err |= selftest_check("AES-128-CTR", buf, ctr_ct);
+
+	/* unaligned pieces, as packets land on device */
+	selftest_hex(buf, ctr_pt);
+	aes_ctr(&aes, iv, 0, buf, 7);
+	aes_ctr(&aes, iv, 7, buf + 7, 30);
+	aes_ctr(&aes, iv, 37, buf + 37, sizeof(buf) - 37);
+	err |= selftest_check("AES-128-CTR unaligned", buf, ctr_ct);
+
+	sha256_init(&sha);
+	sha256_update(&sha, "abc", 3);
+	sha256_final(&sha, out);
+	err |= selftest_check("SHA-256", out,
+		"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+	selftest_hex(seed, "9d61b19deffd5a60ba844af492ec2cc44449c5697b326919703bac031cae7f60");
+	ed25519_public(pub, seed);
+	err |= selftest_check("Ed25519 public key", pub,
+		"d75a980182b10ab7d54bfed3c964073a0ee172f3daa62325af021a68f707511a");
+	ed25519_sign(out, seed, "", 0);
+	err |= selftest_check("Ed25519 sign", out,
+		"e5564300c360ac729086e2cc806e828a84877f1eb8e5d974d873e065224901555fb8821590a33bac"
+		"c61e39701cf9b46bd25bf5f0595bbe24655141438e7a100b");
+
+	err |= selftest_result("Ed25519 verify", ed25519_verify(out, pub, "", 0) == 0);
+	out[0] ^= 1;
+	err |= selftest_result("Ed25519 verify forged", ed25519_verify(out, pub, "", 0) < 0);
+
+	exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* frames of benchmark stream and passes over it */
+#define BENCH_FRAMES		100000
+#define BENCH_PASSES		10
+/* longest garbage in front of frame */
+#define BENCH_NOISE_MAX		32
+
+static const struct bench_case {
+	const char *name;
+	/* frames of 1000 with garbage in front */
+	unsigned int noise;
+	/* bit errors per million bits */
+	unsigned int ber;
+} bench_cases[] = {
+	{ "clean",		0,	0 },
+	{ "garbage 10%",	100,	0 },
+	{ "garbage 50%",	500,	0 },
+	{ "BER 1e-5",		0,	10 },
+	{ "BER 1e-4",		0,	100 },
+	{ "BER 1e-3",		0,	1000 },
+	{ "garbage 10%, BER 1e-4",	100,	100 },
+};
+
+#define BENCH_CASES		(sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+/* xorshift32, streams are the same on every run */
+static uint32_t bench_rand(uint32_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 17;
+	*s ^= *s << 5;
+	return *s;
+}
+
+/*
+ * \brief WRITE frame \n of stream, its address is \n
+ */
+static int bench_frame(uint8_t *buf, uint32_t n)
+{
+	uint8_t data[BTL_MAX_DATA_SIZE];
+	uint32_t s = (n * 2654435761u) | 1;
+	unsigned int i, len;
+
+	len = bench_rand(&s) % (BTL_MAX_DATA_SIZE + 1);
+	for (i = 0; i < len; i++)
+		data[i] = bench_rand(&s);
+
+	return btl_encode(buf, BTL_CMD_WRITE, BTL_STATUS_OK, n, data, len);
+}
+
+static size_t bench_stream(uint8_t *buf, const struct bench_case *bc)
+{
+	uint32_t s = 0x12345678;
+	size_t len = 0, bit;
+	unsigned int i, n;
+
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		if (bench_rand(&s) % 1000 < bc->noise) {
+			/* garbage is rich in prefixes to hit resync */
+			n = 1 + bench_rand(&s) % BENCH_NOISE_MAX;
+			while (n--)
+				buf[len++] = bench_rand(&s) & 1 ? BTL_PKT_PREXIX : bench_rand(&s);
+		}
+		len += bench_frame(&buf[len], i);
+	}
+
+	if (!bc->ber)
+		return len;
+
+	/* uniform gaps of mean 1e6 / ber bits */
+	for (bit = bench_rand(&s) % (2000000 / bc->ber); bit < len * 8;
+	     bit += 1 + bench_rand(&s) % (2000000 / bc->ber))
+		buf[bit / 8] ^= 1 << (bit % 8);
+
+	return len;
+}
+
+/*
+ * \brief feed stream to decoder in pieces of receive buffer size,
+ *        as bytes are read from port
+ * \return number of frames, \good counts frames sent,
+ *         \crc and \size count dropped frames
+ */
+static unsigned long bench_parse(struct btl_decoder *dec, const uint8_t *buf, size_t len,
+		unsigned long *good, unsigned long *crc, unsigned long *size)
+{
+	btl_packet_t *pkt = btl_decoder_pkt(dec);
+	uint8_t frame[BTL_MAX_PKT_SIZE];
+	unsigned long frames = 0;
+	unsigned int used;
+	size_t pos, chunk;
+	int res;
+
+	btl_decoder_reset(dec);
+	for (pos = 0; pos < len; pos += used) {
+		chunk = len - pos < BTL_RX_BUF_SIZE ? len - pos : BTL_RX_BUF_SIZE;
+		res = btl_decode_feed(dec, &buf[pos], chunk, &used);
+		if (res == BTL_DEC_FRAME) {
+			frames++;
+			/* others passed CRC check by chance */
+			if (good && pkt->addr < BENCH_FRAMES &&
+			    bench_frame(frame, pkt->addr) == (int)btl_size_pkt(pkt) &&
+			    !memcmp(frame, pkt, btl_size_pkt(pkt)))
+				(*good)++;
+		} else if (res == BTL_DEC_ECRC && crc) {
+			(*crc)++;
+		} else if (res == BTL_DEC_ESIZE && size) {
+			(*size)++;
+		}
+	}
+	return frames;
+}
+
+/*
+ * \brief parse throughput of frame decoder shared with bootloader
+ */
+static void btlctl_bench(void)
+{
+	const struct bench_case *bc;
+	struct btl_decoder dec;
+	unsigned long frames, good, crc, size;
+	unsigned int pass;
+	size_t len;
+	uint8_t *buf;
+	double sec;
+	long us;
+
+	buf = malloc(BENCH_FRAMES * (BTL_MAX_PKT_SIZE + BENCH_NOISE_MAX));
+	if (!buf)
+		failure(errno, "Can't allocate benchmark stream");
+
+	printf("%-24s %8s %10s %8s %8s %8s %8s\n", "Stream", "MB/s", "frames/s",
+	       "frames", "false", "CRC err", "size err");
+
+	for (bc = bench_cases; bc < bench_cases + BENCH_CASES; bc++) {
+		len = bench_stream(buf, bc);
+
+		good = crc = size = 0;
+		frames = bench_parse(&dec, buf, len, &good, &crc, &size);
+
+		us = btl_time_us();
+		for (pass = 0; pass < BENCH_PASSES; pass++)
+			bench_parse(&dec, buf, len, NULL, NULL, NULL);
+		sec = (btl_time_us() - us) / 1e6;
+
+		printf("%-24s %8.1f %10.0f %8lu %8lu %8lu %8lu\n", bc->name,
+		       len * (double)BENCH_PASSES / sec / 1e6,
+		       frames * (double)BENCH_PASSES / sec,
+		       frames, frames - good, crc, size);
+	}
+
+	free(buf);
+	exit(EXIT_SUCCESS);
+}
+
+static void btlctl_open_dev(struct btlctl_dev *dev)
+{
+	struct btlctl_conf *cfg = dev->cfg;
+
+	if ((dev->fd = serial_open(dev->name)) < 0)
+		failure(errno, "Can't open serial port %s", dev->name);
+
+	if (serial_setup(dev->fd, BAUD_RATE_DEFAULT) < 0)
+		failure(errno, "Can't set serial port %s parameters", dev->name);
+
+	/* reads wait not longer than the shortest reply timeout */
+	serial_set_timeout(dev->fd, BTL_RTO_MIN / 1000.0);
+	btl_port_init(&dev->port, dev->fd, BTL_TIMEOUT);
+
+	/* devices on bus switch by broadcast */
+	if (cfg->baud != BAUD_RATE_DEFAULT && !cfg->bus) {
+		bootloader_set_baud(dev);
+		if (serial_setup(dev->fd, cfg->baud) < 0)
+			failure(errno, "Can't set serial port %s parameters", dev->name);
+		serial_set_timeout(dev->fd, BTL_RTO_MIN / 1000.0);
+	}
+
+	if (cfg->rtscts && serial_set_rtscts(dev->fd, 1) < 0)
+		failure(errno, "Can't set serial port %s flow control", dev->name);
+}
+
+int main(int argc, char **argv)
+{
+	struct option opt[OPT_LEN + 1];
+	char optstr[2 * OPT_LEN + 1];
+	struct btlctl_conf conf;
+	struct btlctl_dev *dev;
+	int i;
+
+	memset(&conf, 0, sizeof(struct btlctl_conf));
+
+	/* set default values */
+	conf.dev = BTLCTL_DEVICE_DEFAULT;
+	conf.baud = BAUD_RATE_DEFAULT;
+	conf.window = BTL_WINDOW;
+
+	if (prog_option_make(btlctl_options, opt, optstr, OPT_LEN) < 0)
+		failure(0, "Invalid options");
+
+	if (prog_option_load(argc, argv, btlctl_options, opt, optstr, &conf) < 0)
+		usage(argv[0], btlctl_options);
+
+	if (conf.help)
+		usage(argv[0], btlctl_options);
+
+	if (conf.selftest)
+		btlctl_selftest();
+
+	if (conf.bench)
+		btlctl_bench();
+
+	if (conf.bus && conf.bridge)
+		failure(0, "Bridge is not supported on bus");
+
+	/* reply to a packet sent ahead would collide with the next one on wire */
+	if (conf.echo)
+		conf.window = 1;
+
+	if (conf.pubkey && !conf.key)
+		failure(0, "Public key requires secret seed file");
+
+	if (conf.key)
+		btlctl_load_key(&conf);
+
+	if (conf.enc)
+		btlctl_load_enc(&conf);
+
+	if (conf.bus)
+		btlctl_parse_bus(&conf);
+	else
+		btlctl_parse_devs(&conf);
+
+	for (i = 0; i < conf.ndevs; i++) {
+		dev = &conf.devs[i];
+
+		/* devices on bus share the port */
+		if (conf.bus && i) {
+			dev->fd = conf.devs[0].fd;
+			btl_port_init(&dev->port, dev->fd, BTL_TIMEOUT);
+		} else {
+			btlctl_open_dev(dev);
+		}
+
+		if (conf.bus)
+			dev->port.dst = dev->eui;
+		dev->port.echo = conf.echo;
+
+		if (conf.bridge)
+			bootloader_bridge(dev);
+	}
+
+	if (conf.bus) {
+		btl_port_init(&conf.bcast, conf.devs[0].fd, BTL_TIMEOUT);
+		conf.bcast.dst = btl_eui_broadcast;
+		if (conf.baud != BAUD_RATE_DEFAULT)
+			bus_set_baud(&conf);
+	}
+
+	for (i = 0; i < conf.ndevs; i++) {
+		dev = &conf.devs[i];
+
+		if (conf.ndevs > 1 && (conf.info || conf.stats || conf.profile))
+			printf("Device %s:\n", dev->name);
+
+		if (conf.info)
+			bootloader_info(dev);
+
+		if (conf.stats)
+			bootloader_stats(dev);
+
+		if (conf.profile)
+			bootloader_profile(dev);
+
+		if (conf.erase_test)
+			bootloader_erase_test(dev);
+	}
+
+	if (conf.dump)
+		dump_file(&conf);
+
+	if (conf.flash)
+		flash_file(&conf);
+
+	for (i = 0; i < conf.ndevs; i++) {
+		dev = &conf.devs[i];
+
+		if (conf.reset)
+			bootloader_reset(dev);
+
+		if (!conf.bus || i == 0)
+			serial_close(dev->fd);
+	}
+	exit(EXIT_SUCCESS);
+}
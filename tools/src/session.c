@@ -0,0 +1,99 @@
+/*
+ * Console tool for bootloader for Silicon Labs erf32fg13 device
+ *
+ * Author
+ * 2024  Andrey Mitrofanov <avmwww@gmail.com>
+ *
+ * Flashing session journal
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "session.h"
+
+#define SESSION_MAGIC		"btlctl-session 1"
+
+int session_open(struct session *s, const char *dir, uint64_t id, uint32_t image)
+{
+	uint64_t jid;
+	uint32_t jimage, jaddr;
+	char magic[32];
+	FILE *f;
+
+	memset(s, 0, sizeof(struct session));
+	s->id = id;
+	s->image = image;
+
+	if (asprintf(&s->path, "%s/%012" PRIx64 ".session", dir, id) < 0) {
+		s->path = NULL;
+		return -1;
+	}
+
+	if ((f = fopen(s->path, "r")) == NULL)
+		return 0;
+
+	if (fscanf(f, "%31[^\n]\nid %" SCNx64 "\nimage %" SCNx32 "\naddr %" SCNx32,
+		   magic, &jid, &jimage, &jaddr) == 4 &&
+	    !strcmp(magic, SESSION_MAGIC) && jid == id && jimage == image) {
+		s->addr = jaddr;
+		s->valid = 1;
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Journal is written to temporary file and renamed,
+ * so it is never left half written
+ */
+int session_save(struct session *s, uint32_t addr)
+{
+	char *tmp;
+	FILE *f;
+	int err = 0;
+
+	if (!s->path)
+		return 0;
+
+	if (asprintf(&tmp, "%s.tmp", s->path) < 0)
+		return -1;
+
+	if ((f = fopen(tmp, "w")) == NULL) {
+		free(tmp);
+		return -1;
+	}
+
+	fprintf(f, SESSION_MAGIC "\nid %012" PRIx64 "\nimage %08" PRIx32 "\naddr %08" PRIx32 "\n",
+			s->id, s->image, addr);
+
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+		err = -1;
+	if (fclose(f) != 0)
+		err = -1;
+
+	if (err == 0 && rename(tmp, s->path) < 0)
+		err = -1;
+
+	free(tmp);
+	if (err == 0)
+		s->addr = addr;
+	return err;
+}
+
+void session_done(struct session *s)
+{
+	if (s->path)
+		unlink(s->path);
+	s->valid = 0;
+}
+
+void session_close(struct session *s)
+{
+	free(s->path);
+	s->path = NULL;
+}